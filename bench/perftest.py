@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+
+# Traffic for `make perftest' (see perftest.sh): a server that sinks UDP,
+# accepts TCP connections and answers DNS, and clients that measure packets
+# per second, connection setup latency and DNS queries per second through
+# whatever sits in between.
+
+import argparse
+import multiprocessing
+import os
+import selectors
+import socket
+import struct
+import sys
+import threading
+import time
+
+# the sink's count of UDP packets, served on the control port
+received = 0
+
+
+def percentiles(values, ps=(50, 90, 99)):
+    values = sorted(values)
+    if not values:
+        return "no samples"
+    return " ".join("p%d %.2f" % (p, values[min(len(values) - 1, len(values) * p // 100)] * 1000) for p in ps) \
+        + " max %.2f ms" % (values[-1] * 1000)
+
+
+def dns_name(msg, off):
+    labels = []
+    while msg[off]:
+        labels.append(msg[off + 1:off + 1 + msg[off]].decode())
+        off += msg[off] + 1
+    return ".".join(labels), off + 1
+
+
+def dns_answer(query, addr):
+    """A queries get `addr', anything else an empty answer"""
+    name, off = dns_name(query, 12)
+    qtype = struct.unpack("!H", query[off:off + 2])[0]
+    question = query[12:off + 4]
+    # QR, RD, RA, NOERROR
+    header = query[:2] + struct.pack("!HHHHH", 0x8180, 1, 1 if qtype == 1 else 0, 0, 0)
+    if qtype != 1:
+        return header + question
+    return header + question + struct.pack("!HHHIH", 0xc00c, 1, 1, 300, 4) + socket.inet_aton(addr)
+
+
+def serve(args):
+    def udp_sink():
+        global received
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 1 << 24)
+        s.bind(("", args.udp_port))
+        buf = bytearray(65536)
+        while True:
+            s.recv_into(buf)
+            received += 1
+
+    def tcp_accept():
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind(("", args.tcp_port))
+        s.listen(4096)
+        while True:
+            s.accept()[0].close()
+
+    def dns():
+        s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        s.bind(("", args.dns_port))
+        while True:
+            query, peer = s.recvfrom(4096)
+            try:
+                s.sendto(dns_answer(query, args.answer), peer)
+            except (IndexError, struct.error, UnicodeDecodeError):
+                pass
+
+    def control():
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        s.bind(("", args.control_port))
+        s.listen(16)
+        while True:
+            c = s.accept()[0]
+            c.sendall(b"%d\n" % received)
+            c.close()
+
+    for fn in (udp_sink, tcp_accept, dns, control):
+        threading.Thread(target=fn, daemon=True).start()
+    while True:
+        time.sleep(3600)
+
+
+def control_count(addr):
+    host, port = addr.rsplit(":", 1)
+    with socket.create_connection((host, int(port)), timeout=5) as c:
+        return int(c.makefile().readline())
+
+
+def udp_flood(host, port, size, seconds, result):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    # a source port per process, so that each is a flow of its own
+    s.connect((host, port))
+    payload = bytes(size)
+    sent = 0
+    end = time.monotonic() + seconds
+    while time.monotonic() < end:
+        for _ in range(256):
+            try:
+                s.send(payload)
+                sent += 1
+            except OSError:
+                # the queue is full or the socket buffer is; keep going
+                pass
+    result.put(sent)
+
+
+def udp(args):
+    before = control_count(args.control)
+    result = multiprocessing.Queue()
+    procs = [multiprocessing.Process(target=udp_flood, args=(args.host, args.port, args.size, args.seconds, result))
+             for _ in range(args.procs)]
+    for p in procs:
+        p.start()
+    sent = sum(result.get() for _ in procs)
+    for p in procs:
+        p.join()
+    # let the last packets arrive
+    time.sleep(0.5)
+    got = control_count(args.control) - before
+    print("udp: %d bytes, %.0f pps sent, %.0f pps received, %.1f%% lost"
+          % (args.size, sent / args.seconds, got / args.seconds, 100.0 * (sent - got) / sent if sent else 0))
+
+
+def connect(args):
+    times, failed = [], 0
+    for _ in range(args.count):
+        start = time.monotonic()
+        try:
+            socket.create_connection((args.host, args.port), timeout=args.timeout).close()
+            times.append(time.monotonic() - start)
+        except OSError:
+            failed += 1
+        time.sleep(args.interval / 1000)
+    print("connect: %d connections, %d failed, %s" % (args.count, failed, percentiles(times)))
+
+
+def dns_query(qid, name):
+    qname = b"".join(bytes([len(label)]) + label.encode() for label in name.split(".")) + b"\0"
+    return struct.pack("!HHHHHH", qid, 0x0100, 1, 0, 0, 0) + qname + struct.pack("!HH", 1, 1)
+
+
+def dns(args):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.connect((args.server, args.port))
+    s.setblocking(False)
+    sel = selectors.DefaultSelector()
+    sel.register(s, selectors.EVENT_READ)
+
+    # by ID: when it was sent
+    pending = {}
+    times, lost, sent, next_id = [], 0, 0, 0
+    end = time.monotonic() + args.seconds
+
+    while True:
+        now = time.monotonic()
+        while now < end and len(pending) < args.window:
+            next_id = (next_id + 1) & 0xffff
+            if next_id in pending:
+                break
+            s.send(dns_query(next_id, "name%d.%s" % (sent % args.names, args.domain)))
+            pending[next_id] = now
+            sent += 1
+        if not pending:
+            break
+        for _ in sel.select(0.01):
+            while True:
+                try:
+                    msg = s.recv(4096)
+                except BlockingIOError:
+                    break
+                qid = struct.unpack("!H", msg[:2])[0]
+                if qid in pending:
+                    times.append(time.monotonic() - pending.pop(qid))
+        now = time.monotonic()
+        for qid in [qid for qid, t in pending.items() if now - t > args.timeout]:
+            del pending[qid]
+            lost += 1
+
+    print("dns: %d names, %.0f queries/s answered, %d lost, %s"
+          % (args.names, len(times) / args.seconds, lost, percentiles(times)))
+
+
+def resolve(args):
+    s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    s.settimeout(1)
+    for _ in range(5):
+        try:
+            s.sendto(dns_query(1, args.name), (args.server, args.port))
+            msg = s.recv(4096)
+        except OSError:
+            continue
+        if struct.unpack("!H", msg[6:8])[0] > 0:
+            print(socket.inet_ntoa(msg[-4:]))
+            return
+    sys.exit("no answer for %s" % args.name)
+
+
+def wait(args):
+    for _ in range(50):
+        try:
+            socket.create_connection((args.host, args.port), timeout=0.1).close()
+            return
+        except OSError:
+            time.sleep(0.1)
+    sys.exit("nothing listening on %s:%d" % (args.host, args.port))
+
+
+def stats(args):
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as s:
+        s.connect(args.path)
+        sys.stdout.write(s.makefile().read())
+
+
+parser = argparse.ArgumentParser()
+sub = parser.add_subparsers(dest="cmd", required=True)
+
+p = sub.add_parser("serve", help="sink UDP, accept TCP and answer DNS")
+p.add_argument("--udp-port", type=int, default=9)
+p.add_argument("--tcp-port", type=int, default=80)
+p.add_argument("--dns-port", type=int, default=53)
+p.add_argument("--control-port", type=int, default=7)
+p.add_argument("--answer", default="192.0.2.10", help="address every A query is answered with")
+p.set_defaults(fn=serve)
+
+p = sub.add_parser("udp", help="UDP packets per second, sent and received")
+p.add_argument("host")
+p.add_argument("port", type=int)
+p.add_argument("-c", "--control", required=True, help="the server's control port, as host:port")
+p.add_argument("-P", "--procs", type=int, default=os.cpu_count())
+p.add_argument("-s", "--size", type=int, default=64)
+p.add_argument("-t", "--seconds", type=float, default=10)
+p.set_defaults(fn=udp)
+
+p = sub.add_parser("connect", help="TCP connection setup latency")
+p.add_argument("host")
+p.add_argument("port", type=int)
+p.add_argument("-n", "--count", type=int, default=1000)
+p.add_argument("-i", "--interval", type=float, default=0, help="milliseconds between connections")
+p.add_argument("--timeout", type=float, default=5)
+p.set_defaults(fn=connect)
+
+p = sub.add_parser("dns", help="DNS queries per second and latency")
+p.add_argument("server")
+p.add_argument("port", type=int)
+p.add_argument("-d", "--domain", default="bench.test")
+p.add_argument("-n", "--names", type=int, default=1000, help="distinct names asked for")
+p.add_argument("-t", "--seconds", type=float, default=10)
+p.add_argument("-w", "--window", type=int, default=100, help="queries outstanding at once")
+p.add_argument("--timeout", type=float, default=1)
+p.set_defaults(fn=dns)
+
+p = sub.add_parser("resolve", help="print the first address a name resolves to")
+p.add_argument("server")
+p.add_argument("port", type=int)
+p.add_argument("name")
+p.set_defaults(fn=resolve)
+
+p = sub.add_parser("wait", help="wait for a TCP port to accept connections")
+p.add_argument("host")
+p.add_argument("port", type=int)
+p.set_defaults(fn=wait)
+
+p = sub.add_parser("stats", help="print what a Unix stream socket sends")
+p.add_argument("path")
+p.set_defaults(fn=stats)
+
+args = parser.parse_args()
+args.fn(args)
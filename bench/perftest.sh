@@ -0,0 +1,158 @@
+#!/bin/sh
+
+# `make perftest': runs each daemon in a throwaway network namespace in front
+# of a server namespace, sends traffic through it with perftest.py, and prints
+# what got through, how fast, and what the kernel's queue dropped.  Needs
+# root, iptables, ipset and dbus-daemon; touches nothing outside the two
+# namespaces and a temporary directory.
+
+set -eu
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+pt=$top/bench/perftest.py
+seconds=${PERFTEST_SECONDS:-10}
+pids=
+
+cli() {
+    ip netns exec dnat-cli "$@"
+}
+
+cleanup() {
+    for pid in $pids; do
+        kill "$pid" 2>/dev/null || true
+    done
+    wait 2>/dev/null || true
+    ip netns del dnat-cli 2>/dev/null || true
+    ip netns del dnat-srv 2>/dev/null || true
+    rm -rf "$work"
+}
+
+# runs "$@" in the background, to be killed by cleanup() or stop(); a
+# command, not a shell function, so that $last is the process itself
+start() {
+    "$@" &
+    pids="$pids $!"
+    last=$!
+}
+
+stop() {
+    kill "$1" 2>/dev/null || true
+    wait "$1" 2>/dev/null || true
+}
+
+# copies stdin to the report as well
+report() {
+    tee -a "$work/report"
+}
+
+# waits for a daemon to bind queue $1, giving up if it exits
+wait_queue() {
+    for i in $(seq 50); do
+        if cli awk -v q="$1" '$1 == q { found = 1 } END { exit !found }' /proc/net/netfilter/nfnetlink_queue; then
+            return
+        fi
+        if ! kill -0 "$last" 2>/dev/null; then
+            break
+        fi
+        sleep 0.1
+    done
+    echo "nothing bound queue $1; see the daemon's log:" >&2
+    cat "$work"/*.log >&2
+    exit 1
+}
+
+queue_drops() {
+    cli awk -v q="$1" '$1 == q { print "queue " $1 ": " $3 " waiting, " $6 " dropped (queue full), " $7 " dropped (socket full)" }' \
+        /proc/net/netfilter/nfnetlink_queue | report
+}
+
+if [ "$(id -u)" != 0 ]; then
+    echo "perftest needs root, for network namespaces and iptables" >&2
+    exit 1
+fi
+for cmd in ip iptables ipset dbus-daemon python3; do
+    if ! command -v "$cmd" >/dev/null; then
+        echo "perftest needs $cmd" >&2
+        exit 1
+    fi
+done
+
+work=$(mktemp -d)
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+ip netns add dnat-cli
+ip netns add dnat-srv
+ip link add veth0 netns dnat-cli type veth peer name veth1 netns dnat-srv
+ip -n dnat-cli addr add 192.0.2.1/24 dev veth0
+ip -n dnat-srv addr add 192.0.2.10/24 dev veth1
+ip -n dnat-cli link set veth0 up
+ip -n dnat-srv link set veth1 up
+ip -n dnat-cli link set lo up
+ip -n dnat-srv link set lo up
+
+start ip netns exec dnat-srv python3 "$pt" serve --answer 192.0.2.10
+cli python3 "$pt" wait 192.0.2.10 7
+
+echo "== dyndnat: 198.51.100.10 mapped to the server" | report
+echo 198.51.100.10,192.0.2.10 > "$work/table.csv"
+cli iptables -t raw -A OUTPUT -d 198.51.100.0/24 -j NFQUEUE --queue-num 1
+start ip netns exec dnat-cli "$top/dyndnat/dyndnat" 1 "$work/table.csv" 2> "$work/dyndnat.log"
+wait_queue 1
+cli python3 "$pt" udp 198.51.100.10 9 -c 192.0.2.10:7 -t "$seconds" | report
+cli python3 "$pt" connect 198.51.100.10 80 | report
+queue_drops 1
+stop "$last"
+cli iptables -t raw -F OUTPUT
+
+echo "== dns-dnat: names under bench.test, answered by the server" | report
+cli ipset create dns-dnat hash:ip
+# on mangle, where the connmark keeps flows dns-dnat has set up out of the queue
+cli iptables -t mangle -A OUTPUT -d 10.64.0.0/12 -m connmark ! --mark 0x10/0x10 -j NFQUEUE --queue-num 1
+start ip netns exec dnat-cli "$top/dns-dnat/dns-dnat" -c 0x10 1 0 10.64.0.0/12 dns-dnat 5353 192.0.2.10 2> "$work/dns-dnat.log"
+wait_queue 1
+# retries until dns-dnat answers
+addr=$(cli python3 "$pt" resolve 127.0.0.1 5353 name0.bench.test)
+echo "name0.bench.test is $addr" | report
+cli python3 "$pt" dns 127.0.0.1 5353 -t "$seconds" | report
+cli python3 "$pt" udp "$addr" 9 -c 192.0.2.10:7 -t "$seconds" | report
+cli python3 "$pt" connect "$addr" 80 | report
+queue_drops 1
+stop "$last"
+cli iptables -t mangle -F OUTPUT
+cli ipset destroy dns-dnat
+
+echo "== nfq-unit-start: a unit that takes 50ms to start and stops after 2s" | report
+cat > "$work/bus.conf" <<EOF
+<busconfig>
+  <listen>unix:path=$work/bus</listen>
+  <auth>EXTERNAL</auth>
+  <policy context="default">
+    <allow user="*"/>
+    <allow own="*"/>
+    <allow send_destination="*"/>
+    <allow receive_sender="*"/>
+  </policy>
+</busconfig>
+EOF
+start dbus-daemon --config-file="$work/bus.conf" --nofork --nopidfile 2> "$work/dbus.log"
+while [ ! -S "$work/bus" ]; do
+    sleep 0.1
+done
+export DBUS_SYSTEM_BUS_ADDRESS="unix:path=$work/bus"
+start "$top/bench/systemd-standin" -d 50 -i 2000 2> "$work/systemd-standin.log"
+cli iptables -A OUTPUT -d 192.0.2.10 -p tcp --dport 80 -j NFQUEUE --queue-num 2
+cli iptables -A OUTPUT -d 192.0.2.10 -p udp --dport 9 -j NFQUEUE --queue-num 2
+start ip netns exec dnat-cli "$top/nfq-unit-start/nfq-unit-start" -s "$work/nfq.sock" 2 perftest.service 2> "$work/nfq-unit-start.log"
+wait_queue 2
+# spread out, so that some connections find the unit stopped
+cli python3 "$pt" connect 192.0.2.10 80 -i 10 | report
+cli python3 "$pt" udp 192.0.2.10 9 -c 192.0.2.10:7 -t "$seconds" | report
+python3 "$pt" stats "$work/nfq.sock" | report
+queue_drops 2
+stop "$last"
+cli iptables -F OUTPUT
+
+echo
+echo "== report"
+cat "$work/report"
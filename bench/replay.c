@@ -0,0 +1,489 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+
+#include <libmnl/libmnl.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_queue.h>
+
+#include "replay.h"
+
+/*
+ * Benchmark harness for the `bench' build: hands packets to a queue callback
+ * one netlink message at a time, as nfq_loop() would after each recvfrom(),
+ * and times each call.  The packets come from a pcap file or are made up, as
+ * `flows' distinct TCP and UDP flows picked at random.  A `hit' fraction of
+ * their destinations is handed to the tool to map, so that lookups for those
+ * succeed; packets to the rest go straight through.
+ *
+ * Sending verdicts doesn't leave the process, and every malloc() is counted.
+ */
+
+#define REPLAY_DEFAULT_PACKETS 1000000
+#define REPLAY_DEFAULT_FLOWS 1024
+#define REPLAY_DEFAULT_HIT 0.5
+#define REPLAY_DEFAULT_SIZE 64
+#define REPLAY_MAX_FLOWS (1 << 20)
+
+/* where the packet ID sits in a message */
+#define REPLAY_PH_OFFSET (MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg)) + MNL_ATTR_HDRLEN)
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NS 0xa1b23c4d
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_LINUX_SLL2 276
+
+struct pkt {
+    uint8_t *data;
+    uint16_t len;
+    struct nlmsghdr *msg;
+};
+
+struct dest {
+    bool used;
+    int version;
+    uint8_t addr[16];
+    uint8_t mapped[16];
+};
+
+static struct pkt *pkts = NULL;
+static uint32_t npkts = 0, pkts_cap = 0;
+
+static struct dest *dests;
+static uint32_t dests_mask;
+
+static uint64_t allocs = 0, sent = 0;
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+void *malloc(size_t size) {
+    ++allocs;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    ++allocs;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    ++allocs;
+    return __libc_realloc(ptr, size);
+}
+
+/* stands in for the netlink socket the verdicts would go out on */
+ssize_t mnl_socket_sendto(const struct mnl_socket *nl, const void *buf, size_t len) {
+    (void) nl, (void) buf;
+    ++sent;
+    return len;
+}
+
+int mnl_socket_get_fd(const struct mnl_socket *nl) {
+    (void) nl;
+    return -1;
+}
+
+void replay_sent(void) {
+    ++sent;
+}
+
+static void pkt_add(const uint8_t *data, uint16_t len) {
+    if (npkts == pkts_cap) {
+        pkts_cap = pkts_cap ? 2 * pkts_cap : 1024;
+        pkts = realloc(pkts, pkts_cap * sizeof(struct pkt));
+        if (!pkts) {
+            perror("pkt_add: realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pkts[npkts].data = malloc(len);
+    if (!pkts[npkts].data) {
+        perror("pkt_add: malloc");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(pkts[npkts].data, data, len);
+    pkts[npkts].len = len;
+    ++npkts;
+}
+
+static uint16_t ip_csum(const void *hdr, size_t len) {
+    const uint16_t *p = hdr;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2) {
+        sum += *p++;
+    }
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static void synthesize(uint32_t flows, uint16_t size) {
+    uint8_t buf[0xffff] = {0};
+    struct iphdr *ip = (struct iphdr *) buf;
+    struct tcphdr *tcp = (struct tcphdr *) (ip + 1);
+    struct udphdr *udp = (struct udphdr *) (ip + 1);
+
+    for (uint32_t i = 0; i < flows; ++i) {
+        memset(buf, 0, size);
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(size);
+        ip->ttl = 64;
+        /* from 10.0.0.0/12, to 198.18.0.0/15 */
+        ip->saddr = htonl(0x0a000000 | (i & 0xfffff));
+        ip->daddr = htonl(0xc6120000 | (i & 0x1ffff));
+        if (i % 2 == 0) {
+            ip->protocol = IPPROTO_TCP;
+            tcp->source = htons(1024 + i % 60000);
+            tcp->dest = htons(443);
+            tcp->doff = 5;
+            tcp->ack = 1;
+        } else {
+            ip->protocol = IPPROTO_UDP;
+            udp->source = htons(1024 + i % 60000);
+            udp->dest = htons(53);
+            udp->len = htons(size - sizeof(struct iphdr));
+        }
+        ip->check = ip_csum(ip, sizeof(struct iphdr));
+        pkt_add(buf, size);
+    }
+}
+
+static uint32_t rd32(const uint8_t *p, bool swap) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return swap ? __builtin_bswap32(v) : v;
+}
+
+static void load_pcap(const char *fp, bool ipv6) {
+    FILE *file = fopen(fp, "r");
+    uint8_t hdr[24], rec[16], *buf;
+    uint32_t magic, linktype, skipped = 0;
+    bool swap;
+
+    if (!file) {
+        perror("load_pcap: fopen");
+        exit(EXIT_FAILURE);
+    }
+    buf = malloc(0x40000);
+    if (!buf) {
+        perror("load_pcap: malloc");
+        exit(EXIT_FAILURE);
+    }
+    if (fread(hdr, sizeof(hdr), 1, file) != 1) {
+        fprintf(stderr, "%s is not a pcap file\n", fp);
+        exit(EXIT_FAILURE);
+    }
+    magic = rd32(hdr, false);
+    swap = magic == __builtin_bswap32(PCAP_MAGIC) || magic == __builtin_bswap32(PCAP_MAGIC_NS);
+    if (!swap && magic != PCAP_MAGIC && magic != PCAP_MAGIC_NS) {
+        fprintf(stderr, "%s is not a pcap file (pcapng files need converting first)\n", fp);
+        exit(EXIT_FAILURE);
+    }
+    linktype = rd32(hdr + 20, swap) & 0xffff;
+
+    while (fread(rec, sizeof(rec), 1, file) == 1) {
+        uint32_t caplen = rd32(rec + 8, swap), off = 0, version, len;
+        uint16_t proto = 0;
+
+        if (caplen > 0x40000 || fread(buf, caplen, 1, file) != 1) {
+            fprintf(stderr, "%s is truncated or corrupt\n", fp);
+            exit(EXIT_FAILURE);
+        }
+
+        switch (linktype) {
+            case LINKTYPE_ETHERNET:
+                off = 14;
+                if (caplen >= 14) {
+                    proto = buf[12] << 8 | buf[13];
+                }
+                /* one VLAN tag */
+                if (proto == ETH_P_8021Q && caplen >= 18) {
+                    proto = buf[16] << 8 | buf[17];
+                    off = 18;
+                }
+                if (proto != ETH_P_IP && proto != ETH_P_IPV6) {
+                    off = caplen;
+                }
+                break;
+            case LINKTYPE_LINUX_SLL:
+                off = 16;
+                break;
+            case LINKTYPE_LINUX_SLL2:
+                off = 20;
+                break;
+            case LINKTYPE_RAW:
+            case LINKTYPE_IPV4:
+            case LINKTYPE_IPV6:
+                break;
+            default:
+                fprintf(stderr, "unsupported pcap link type %u\n", linktype);
+                exit(EXIT_FAILURE);
+        }
+
+        len = caplen > off ? caplen - off : 0;
+        version = len > 0 ? buf[off] >> 4 : 0;
+        if (version == 4 && len >= sizeof(struct iphdr) && ntohs(((struct iphdr *) (buf + off))->tot_len) >= sizeof(struct iphdr)
+                && len >= ntohs(((struct iphdr *) (buf + off))->tot_len)) {
+            pkt_add(buf + off, ntohs(((struct iphdr *) (buf + off))->tot_len));
+        } else if (version == 6 && ipv6 && len >= sizeof(struct ipv6hdr)
+                && len >= sizeof(struct ipv6hdr) + ntohs(((struct ipv6hdr *) (buf + off))->payload_len)) {
+            pkt_add(buf + off, sizeof(struct ipv6hdr) + ntohs(((struct ipv6hdr *) (buf + off))->payload_len));
+        } else {
+            /* other protocols, and packets cut short by the snap length */
+            ++skipped;
+        }
+    }
+    if (ferror(file)) {
+        perror("load_pcap: fread");
+        exit(EXIT_FAILURE);
+    }
+    if (skipped > 0) {
+        fprintf(stderr, "skipped %u packets that aren't whole %s packets\n", skipped, ipv6 ? "IP" : "IPv4");
+    }
+
+    free(buf);
+    fclose(file);
+}
+
+static uint8_t *pkt_daddr(struct pkt *p, int *version) {
+    *version = p->data[0] >> 4;
+    return *version == 6 ? p->data + offsetof(struct ipv6hdr, daddr) : p->data + offsetof(struct iphdr, daddr);
+}
+
+static struct dest *dest_find(const uint8_t *addr, int version) {
+    size_t alen = version == 6 ? 16 : 4;
+    uint32_t h = 2166136261u;
+
+    for (size_t i = 0; i < alen; ++i) {
+        h = (h ^ addr[i]) * 16777619u;
+    }
+    for (;; h = (h + 1) & dests_mask) {
+        struct dest *d = &dests[h & dests_mask];
+        if (!d->used || (d->version == version && memcmp(d->addr, addr, alen) == 0)) {
+            return d;
+        }
+    }
+}
+
+/* spreads the hits evenly over the destinations in the order they are
+ * first seen, and rewrites the packets to the ones the tool asks for */
+static uint32_t map_dests(double hit, const struct replay_ops *ops) {
+    uint32_t ndests = 0, nhits = 0;
+    int version;
+
+    for (dests_mask = 1; dests_mask < 2 * npkts; dests_mask <<= 1);
+    dests = calloc(dests_mask, sizeof(struct dest));
+    if (!dests) {
+        perror("map_dests: calloc");
+        exit(EXIT_FAILURE);
+    }
+    --dests_mask;
+
+    for (uint32_t i = 0; i < npkts; ++i) {
+        uint8_t *daddr = pkt_daddr(&pkts[i], &version);
+        size_t alen = version == 6 ? 16 : 4;
+        struct dest *d = dest_find(daddr, version);
+
+        if (!d->used) {
+            d->used = true;
+            d->version = version;
+            memcpy(d->addr, daddr, alen);
+            memcpy(d->mapped, daddr, alen);
+            if (nhits < (ndests + 1) * hit) {
+                ops->map(d->mapped, version);
+                ++nhits;
+            }
+            ++ndests;
+        }
+        memcpy(daddr, d->mapped, alen);
+    }
+
+    free(dests);
+    return ndests;
+}
+
+static void build_msgs(void) {
+    for (uint32_t i = 0; i < npkts; ++i) {
+        struct pkt *p = &pkts[i];
+        struct nfqnl_msg_packet_hdr ph = {
+            .hw_protocol = htons(p->data[0] >> 4 == 6 ? ETH_P_IPV6 : ETH_P_IP),
+            .hook = NF_INET_PRE_ROUTING,
+        };
+        struct nfgenmsg *nfg;
+
+        p->msg = malloc(MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg))
+                + MNL_ATTR_HDRLEN + MNL_ALIGN(sizeof(ph)) + MNL_ATTR_HDRLEN + MNL_ALIGN(p->len));
+        if (!p->msg) {
+            perror("build_msgs: malloc");
+            exit(EXIT_FAILURE);
+        }
+        mnl_nlmsg_put_header(p->msg);
+        p->msg->nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_PACKET;
+        nfg = mnl_nlmsg_put_extra_header(p->msg, sizeof(struct nfgenmsg));
+        nfg->nfgen_family = AF_UNSPEC;
+        nfg->version = NFNETLINK_V0;
+        nfg->res_id = htons(0);
+        mnl_attr_put(p->msg, NFQA_PACKET_HDR, sizeof(ph), &ph);
+        mnl_attr_put(p->msg, NFQA_PAYLOAD, p->len, p->data);
+    }
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [-r file.pcap | -f flows -s size] [-n packets] [-h hit_ratio]\n", name);
+    exit(EXIT_FAILURE);
+}
+
+int replay_main(int argc, char **argv, const struct replay_ops *ops) {
+    char *pcap = NULL, *endptr = NULL;
+    uint64_t npackets = 0, total = 0, allocs_before, sent_before;
+    uint32_t flows = REPLAY_DEFAULT_FLOWS, ndests, *ns, seed = 2463534242u;
+    uint16_t size = REPLAY_DEFAULT_SIZE;
+    double hit = REPLAY_DEFAULT_HIT;
+    struct nlmsghdr *work;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:h:n:r:s:")) != -1) {
+        endptr = NULL;
+        switch (opt) {
+            case 'f':
+                flows = (uint32_t) strtoul(optarg, &endptr, 10);
+                if (flows == 0 || flows > REPLAY_MAX_FLOWS) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'h':
+                hit = strtod(optarg, &endptr);
+                if (hit < 0 || hit > 1) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'n':
+                npackets = strtoull(optarg, &endptr, 10);
+                if (npackets == 0) {
+                    usage(argv[0]);
+                }
+                break;
+            case 'r':
+                pcap = optarg;
+                break;
+            case 's': {
+                unsigned long s = strtoul(optarg, &endptr, 10);
+                if (s < sizeof(struct iphdr) + sizeof(struct tcphdr) || s > 0xffff) {
+                    usage(argv[0]);
+                }
+                size = (uint16_t) s;
+                break;
+            }
+            default:
+                usage(argv[0]);
+        }
+        if (endptr && (optarg[0] == '\0' || *endptr != '\0')) {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    if (pcap) {
+        load_pcap(pcap, ops->ipv6);
+        if (npkts == 0) {
+            fprintf(stderr, "no packets to replay in %s\n", pcap);
+            exit(EXIT_FAILURE);
+        }
+    } else {
+        synthesize(flows, size);
+    }
+    if (npackets == 0) {
+        npackets = pcap ? npkts : REPLAY_DEFAULT_PACKETS;
+    }
+
+    ndests = map_dests(hit, ops);
+    if (ops->ready) {
+        ops->ready();
+    }
+    build_msgs();
+
+    ns = malloc(npackets * sizeof(uint32_t));
+    work = malloc(MNL_SOCKET_BUFFER_SIZE + 0xffff);
+    if (!ns || !work) {
+        perror("replay_main: malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    allocs_before = allocs;
+    sent_before = sent;
+    for (uint64_t i = 0; i < npackets; ++i) {
+        struct pkt *p;
+        uint32_t id = htonl((uint32_t) i + 1);
+        uint64_t start;
+
+        if (pcap) {
+            p = &pkts[i % npkts];
+        } else {
+            /* xorshift32 */
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            p = &pkts[seed % npkts];
+        }
+        /* the callback may mangle the packet, so it gets a fresh copy */
+        memcpy(work, p->msg, p->msg->nlmsg_len);
+        memcpy((char *) work + REPLAY_PH_OFFSET, &id, sizeof(id));
+
+        start = now_nsec();
+        if (mnl_cb_run(work, work->nlmsg_len, 0, 0, ops->cb, ops->data) < 0) {
+            perror("mnl_cb_run");
+            exit(EXIT_FAILURE);
+        }
+        if (ops->tick) {
+            ops->tick();
+        }
+        ns[i] = (uint32_t) (now_nsec() - start);
+        total += ns[i];
+    }
+
+    printf("%lu packets, %s%s, %u destinations, %u%% mapped\n",
+            (unsigned long) npackets, pcap ? "from " : "synthetic", pcap ? pcap : "", ndests, (unsigned) (hit * 100 + 0.5));
+    printf("%.0f packets/s\n", npackets * 1e9 / (total ? total : 1));
+    qsort(ns, npackets, sizeof(uint32_t), cmp_u32);
+    printf("ns/packet: p50 %u p90 %u p99 %u p99.9 %u max %u\n",
+            ns[npackets / 2], ns[npackets * 9 / 10], ns[npackets * 99 / 100], ns[npackets * 999 / 1000], ns[npackets - 1]);
+    printf("%.3f allocations/packet, %.3f sends/packet\n",
+            (double) (allocs - allocs_before) / npackets, (double) (sent - sent_before) / npackets);
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __REPLAY_H__
+#define __REPLAY_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <libmnl/libmnl.h>
+
+struct replay_ops {
+    /* whether IPv6 packets are replayed as well as IPv4 ones */
+    bool ipv6;
+    /* called once for each destination picked to have a mapping, with its
+     * 4 or 16 byte address, which it may rewrite in every packet to it */
+    void (*map)(uint8_t *, int);
+    /* called once every destination has been mapped */
+    void (*ready)(void);
+    /* if set, called after each packet, as nfq_loop() would look at its
+     * other descriptors between reads; timed as part of the packet */
+    void (*tick)(void);
+    mnl_cb_t cb;
+    void *data;
+};
+
+int replay_main(int, char **, const struct replay_ops *);
+void replay_sent(void);
+
+#endif
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <systemd/sd-bus.h>
+
+/*
+ * A stand-in for systemd on a private bus, for `make perftest': just enough
+ * of org.freedesktop.systemd1 for nfq-unit-start.  Any unit can be loaded
+ * and is inactive until it is started, which takes `-d' milliseconds.  With
+ * `-i', a unit stops again once it has been active that long, so that
+ * traffic keeps having to wait for it to start.
+ *
+ * The bus is whatever sd_bus_open_system() finds, so point both this and
+ * nfq-unit-start at the private bus with DBUS_SYSTEM_BUS_ADDRESS.
+ */
+
+#define STANDIN_MAX_UNITS 32
+#define STANDIN_DEFAULT_DELAY_MS 100
+
+#define MANAGER_PATH "/org/freedesktop/systemd1"
+#define MANAGER_IFACE "org.freedesktop.systemd1.Manager"
+#define UNIT_PREFIX "/org/freedesktop/systemd1/unit"
+#define UNIT_IFACE "org.freedesktop.systemd1.Unit"
+#define PROPERTIES_IFACE "org.freedesktop.DBus.Properties"
+
+struct unit {
+    char *name;
+    char path[256];
+    bool active;
+    /* the StartUnit job in progress, or 0 */
+    uint32_t job;
+    /* CLOCK_MONOTONIC microseconds, or 0 */
+    uint64_t start_at, stop_at;
+};
+
+static struct unit units[STANDIN_MAX_UNITS];
+static int nunits = 0;
+static uint32_t next_job = 1;
+static uint64_t start_delay, active_time = 0;
+static sd_bus *bus;
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* the unit called `name', made up on first use */
+static struct unit *unit_get(const char *name) {
+    struct unit *unit;
+    size_t off;
+
+    for (int i = 0; i < nunits; ++i) {
+        if (strcmp(units[i].name, name) == 0) {
+            return &units[i];
+        }
+    }
+    if (nunits == STANDIN_MAX_UNITS) {
+        return NULL;
+    }
+
+    unit = &units[nunits++];
+    unit->name = strdup(name);
+    /* escaped as systemd does, with anything but letters and digits as _xx */
+    off = snprintf(unit->path, sizeof(unit->path), "%s/", UNIT_PREFIX);
+    for (const char *c = name; *c && off + 4 < sizeof(unit->path); ++c) {
+        if (isalnum((unsigned char) *c)) {
+            unit->path[off++] = *c;
+        } else {
+            off += snprintf(unit->path + off, sizeof(unit->path) - off, "_%02x", (unsigned char) *c);
+        }
+    }
+    unit->path[off] = '\0';
+    return unit;
+}
+
+static struct unit *unit_by_path(const char *path) {
+    for (int i = 0; i < nunits; ++i) {
+        if (strcmp(units[i].path, path) == 0) {
+            return &units[i];
+        }
+    }
+    return NULL;
+}
+
+static const char *unit_state(const struct unit *unit) {
+    return unit->active ? "active" : "inactive";
+}
+
+static void set_active(struct unit *unit, bool b_state) {
+    int ret;
+
+    unit->active = b_state;
+    fprintf(stderr, "%s %s\n", unit->name, unit_state(unit));
+    ret = sd_bus_emit_signal(bus, unit->path, PROPERTIES_IFACE, "PropertiesChanged", "sa{sv}as",
+            UNIT_IFACE, 1, "ActiveState", "s", unit_state(unit), 0);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_emit_signal PropertiesChanged: %s\n", strerror(-ret));
+    }
+}
+
+static void job_done(struct unit *unit) {
+    char job[64];
+    int ret;
+
+    snprintf(job, sizeof(job), "%s/job/%u", MANAGER_PATH, unit->job);
+    ret = sd_bus_emit_signal(bus, MANAGER_PATH, MANAGER_IFACE, "JobRemoved", "uoss", unit->job, job, unit->name, "done");
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_emit_signal JobRemoved: %s\n", strerror(-ret));
+    }
+    unit->job = 0;
+}
+
+static int manager_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    (void) data, (void) ret_error;
+    const char *name, *mode;
+    struct unit *unit;
+    char job[64];
+    int ret;
+
+    if (sd_bus_message_is_method_call(msg, MANAGER_IFACE, "Subscribe")) {
+        return sd_bus_reply_method_return(msg, "");
+    }
+
+    if (sd_bus_message_is_method_call(msg, MANAGER_IFACE, "LoadUnit")
+            || sd_bus_message_is_method_call(msg, MANAGER_IFACE, "GetUnit")) {
+        if ((ret = sd_bus_message_read(msg, "s", &name)) < 0) {
+            return ret;
+        }
+        if (!(unit = unit_get(name))) {
+            return sd_bus_reply_method_errorf(msg, SD_BUS_ERROR_LIMITS_EXCEEDED, "too many units");
+        }
+        return sd_bus_reply_method_return(msg, "o", unit->path);
+    }
+
+    if (sd_bus_message_is_method_call(msg, MANAGER_IFACE, "StartUnit")) {
+        if ((ret = sd_bus_message_read(msg, "ss", &name, &mode)) < 0) {
+            return ret;
+        }
+        if (!(unit = unit_get(name))) {
+            return sd_bus_reply_method_errorf(msg, SD_BUS_ERROR_LIMITS_EXCEEDED, "too many units");
+        }
+        if (!unit->job) {
+            unit->job = next_job++;
+            unit->start_at = now_usec() + start_delay;
+        }
+        snprintf(job, sizeof(job), "%s/job/%u", MANAGER_PATH, unit->job);
+        ret = sd_bus_reply_method_return(msg, "o", job);
+        /* nothing to wait for, but the job still has to finish */
+        if (unit->active) {
+            job_done(unit);
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
+static int unit_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    (void) data, (void) ret_error;
+    const char *iface, *prop;
+    struct unit *unit = unit_by_path(sd_bus_message_get_path(msg));
+    int ret;
+
+    if (!unit || !sd_bus_message_is_method_call(msg, PROPERTIES_IFACE, "Get")) {
+        return 0;
+    }
+    if ((ret = sd_bus_message_read(msg, "ss", &iface, &prop)) < 0) {
+        return ret;
+    }
+    if (strcmp(iface, UNIT_IFACE) != 0 || strcmp(prop, "ActiveState") != 0) {
+        return sd_bus_reply_method_errorf(msg, SD_BUS_ERROR_UNKNOWN_PROPERTY, "only %s.ActiveState is known", UNIT_IFACE);
+    }
+    return sd_bus_reply_method_return(msg, "v", "s", unit_state(unit));
+}
+
+/* starts and stops units that are due, and says when the next one is */
+static uint64_t run_timers(void) {
+    uint64_t now = now_usec(), next = UINT64_MAX;
+
+    for (int i = 0; i < nunits; ++i) {
+        struct unit *unit = &units[i];
+
+        if (unit->job && !unit->active && unit->start_at <= now) {
+            set_active(unit, true);
+            job_done(unit);
+            unit->stop_at = active_time ? now + active_time : 0;
+        } else if (unit->active && unit->stop_at && unit->stop_at <= now) {
+            set_active(unit, false);
+            unit->stop_at = 0;
+        }
+
+        if (unit->job && !unit->active && unit->start_at < next) {
+            next = unit->start_at;
+        }
+        if (unit->active && unit->stop_at && unit->stop_at < next) {
+            next = unit->stop_at;
+        }
+    }
+
+    return next == UINT64_MAX ? UINT64_MAX : next > now ? next - now : 0;
+}
+
+static uint64_t parse_ms(char *arg, char *name) {
+    char *endptr;
+    unsigned long ms = strtoul(arg, &endptr, 10);
+
+    if (arg[0] == '\0' || *endptr != '\0') {
+        fprintf(stderr, "usage: %s [-d start_delay_ms] [-i active_ms]\n", name);
+        exit(EXIT_FAILURE);
+    }
+    return (uint64_t) ms * 1000;
+}
+
+int main(int argc, char **argv) {
+    int opt, ret;
+
+    start_delay = STANDIN_DEFAULT_DELAY_MS * 1000;
+    while ((opt = getopt(argc, argv, "d:i:")) != -1) {
+        switch (opt) {
+            case 'd':
+                start_delay = parse_ms(optarg, argv[0]);
+                break;
+            case 'i':
+                active_time = parse_ms(optarg, argv[0]);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-d start_delay_ms] [-i active_ms]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    ret = sd_bus_open_system(&bus);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_open_system: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    ret = sd_bus_add_object(bus, NULL, MANAGER_PATH, manager_cb, NULL);
+    if (ret >= 0) {
+        ret = sd_bus_add_fallback(bus, NULL, UNIT_PREFIX, unit_cb, NULL);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_add_object: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+    ret = sd_bus_request_name(bus, "org.freedesktop.systemd1", 0);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_request_name: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    for (;;) {
+        uint64_t timeout;
+
+        ret = sd_bus_process(bus, NULL);
+        if (ret < 0) {
+            fprintf(stderr, "sd_bus_process: %s\n", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+        if (ret > 0) {
+            continue;
+        }
+
+        timeout = run_timers();
+        ret = sd_bus_wait(bus, timeout);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "sd_bus_wait: %s\n", strerror(-ret));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
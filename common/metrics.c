@@ -0,0 +1,334 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "metrics.h"
+
+/*
+ * Counters and histograms for scraping, in the Prometheus text format over
+ * HTTP on a Unix socket, e.g. `curl --unix-socket path http://localhost/'.
+ *
+ * Each thread counts into its own shard, allocated the first time it counts
+ * anything and never freed, so updates are plain loads and stores that the
+ * scraping thread only ever reads; nothing that counts waits on anything.
+ * Shards are summed when the metrics are served.  Gauges are set by whichever
+ * thread owns the value, and a process that doesn't own one at all leaves it
+ * out with metrics_omit().  Histograms have power-of-two buckets from 1us.
+ *
+ * Shared by the daemons: the metrics themselves come from the metrics.h of
+ * whichever one is being built.
+ *
+ * The kernel's counters for the queues this process serves are read from
+ * /proc/net/netfilter/nfnetlink_queue when the metrics are served.
+ */
+
+#define METRICS_BUCKETS 25
+#define METRICS_MAX_QUEUES 16
+#define METRICS_NFQ_PROC "/proc/net/netfilter/nfnetlink_queue"
+/* how long a client gets to send its request */
+#define METRICS_REQUEST_TIMEOUT_MS 1000
+
+struct metrics_hist {
+    /* the last bucket is +Inf */
+    _Atomic uint64_t buckets[METRICS_BUCKETS + 1];
+    _Atomic uint64_t sum_ns;
+};
+
+struct metrics_shard {
+    struct metrics_shard *next;
+    _Atomic uint64_t counters[M_COUNTERS];
+    struct metrics_hist hists[M_HISTOGRAMS];
+};
+
+struct metric_info {
+    const char *name, *labels, *help;
+};
+
+#define METRIC_INFO(id, name, labels, help) {name, labels, help},
+static const struct metric_info counter_info[] = {METRICS_COUNTERS(METRIC_INFO)};
+static const struct metric_info gauge_info[] = {METRICS_GAUGES(METRIC_INFO)};
+#undef METRIC_INFO
+#define METRIC_INFO(id, name, help) {name, "", help},
+static const struct metric_info hist_info[] = {METRICS_HISTOGRAMS(METRIC_INFO)};
+#undef METRIC_INFO
+
+static struct metrics_shard *_Atomic shards = NULL;
+static __thread struct metrics_shard *local = NULL;
+static _Atomic int64_t gauges[M_GAUGES];
+static _Atomic bool omitted[M_GAUGES];
+
+static _Atomic unsigned int queues[METRICS_MAX_QUEUES];
+static _Atomic int nqueues = 0;
+
+static int listen_fd = -1;
+
+static struct metrics_shard *shard(void) {
+    struct metrics_shard *s = local;
+
+    if (s) {
+        return s;
+    }
+    s = calloc(1, sizeof(struct metrics_shard));
+    if (!s) {
+        return NULL;
+    }
+    s->next = atomic_load_explicit(&shards, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(&shards, &s->next, s, memory_order_release, memory_order_relaxed));
+    local = s;
+    return s;
+}
+
+/* only ever written by the thread owning the shard */
+static inline void bump(_Atomic uint64_t *v, uint64_t n) {
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void metrics_add(enum metrics_counter c, uint64_t n) {
+    struct metrics_shard *s = shard();
+    if (s) {
+        bump(&s->counters[c], n);
+    }
+}
+
+void metrics_inc(enum metrics_counter c) {
+    metrics_add(c, 1);
+}
+
+void metrics_set(enum metrics_gauge g, int64_t v) {
+    atomic_store_explicit(&gauges[g], v, memory_order_relaxed);
+}
+
+void metrics_omit(enum metrics_gauge g) {
+    atomic_store_explicit(&omitted[g], true, memory_order_relaxed);
+}
+
+void metrics_observe(enum metrics_histogram h, uint64_t ns) {
+    struct metrics_shard *s = shard();
+    uint64_t us = ns / 1000;
+    int b;
+
+    if (!s) {
+        return;
+    }
+    /* bucket b holds values of at most 2^b us */
+    b = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (b > METRICS_BUCKETS) {
+        b = METRICS_BUCKETS;
+    }
+    bump(&s->hists[h].buckets[b], 1);
+    bump(&s->hists[h].sum_ns, ns);
+}
+
+uint64_t metrics_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void metrics_queue(unsigned int queue_num) {
+    int n = atomic_load(&nqueues);
+
+    if (n < METRICS_MAX_QUEUES) {
+        atomic_store(&queues[n], queue_num);
+        atomic_store(&nqueues, n + 1);
+    }
+}
+
+static void print_header(FILE *f, const struct metric_info *info, const struct metric_info *prev, const char *type) {
+    if (!prev || strcmp(prev->name, info->name) != 0) {
+        fprintf(f, "# HELP %s%s %s\n", METRICS_PREFIX, info->name, info->help);
+        fprintf(f, "# TYPE %s%s %s\n", METRICS_PREFIX, info->name, type);
+    }
+}
+
+static void print_value(FILE *f, const struct metric_info *info, const char *value) {
+    if (info->labels[0]) {
+        fprintf(f, "%s%s{%s} %s\n", METRICS_PREFIX, info->name, info->labels, value);
+    } else {
+        fprintf(f, "%s%s %s\n", METRICS_PREFIX, info->name, value);
+    }
+}
+
+static void print_queues(FILE *f) {
+    unsigned int queue, portid, waiting, mode, range, queue_dropped, user_dropped, id, one;
+    int n = atomic_load(&nqueues);
+    bool header = false;
+    char line[256];
+    FILE *proc;
+
+    if (n == 0 || !(proc = fopen(METRICS_NFQ_PROC, "r"))) {
+        return;
+    }
+    while (fgets(line, sizeof(line), proc)) {
+        bool ours = false;
+
+        if (sscanf(line, "%u %u %u %u %u %u %u %u %u", &queue, &portid, &waiting, &mode, &range,
+                    &queue_dropped, &user_dropped, &id, &one) < 7) {
+            continue;
+        }
+        for (int i = 0; i < n; ++i) {
+            ours |= atomic_load(&queues[i]) == queue;
+        }
+        if (!ours) {
+            continue;
+        }
+        if (!header) {
+            fprintf(f, "# HELP %snfqueue_waiting Packets waiting in the kernel queue\n", METRICS_PREFIX);
+            fprintf(f, "# TYPE %snfqueue_waiting gauge\n", METRICS_PREFIX);
+            fprintf(f, "# HELP %snfqueue_dropped_total Packets the kernel dropped instead of queueing\n", METRICS_PREFIX);
+            fprintf(f, "# TYPE %snfqueue_dropped_total counter\n", METRICS_PREFIX);
+            header = true;
+        }
+        fprintf(f, "%snfqueue_waiting{queue=\"%u\"} %u\n", METRICS_PREFIX, queue, waiting);
+        fprintf(f, "%snfqueue_dropped_total{queue=\"%u\",reason=\"queue_full\"} %u\n", METRICS_PREFIX, queue, queue_dropped);
+        fprintf(f, "%snfqueue_dropped_total{queue=\"%u\",reason=\"socket_full\"} %u\n", METRICS_PREFIX, queue, user_dropped);
+    }
+    fclose(proc);
+}
+
+static void print_metrics(FILE *f) {
+    struct metrics_shard *first = atomic_load_explicit(&shards, memory_order_acquire), *s;
+    const struct metric_info *prev = NULL;
+    char value[32];
+
+    for (int c = 0; c < M_COUNTERS; ++c) {
+        uint64_t total = 0;
+        for (s = first; s; s = s->next) {
+            total += atomic_load_explicit(&s->counters[c], memory_order_relaxed);
+        }
+        print_header(f, &counter_info[c], c > 0 ? &counter_info[c - 1] : NULL, "counter");
+        snprintf(value, sizeof(value), "%" PRIu64, total);
+        print_value(f, &counter_info[c], value);
+    }
+
+    for (int g = 0; g < M_GAUGES; ++g) {
+        if (atomic_load_explicit(&omitted[g], memory_order_relaxed)) {
+            continue;
+        }
+        print_header(f, &gauge_info[g], prev, "gauge");
+        snprintf(value, sizeof(value), "%" PRId64, atomic_load_explicit(&gauges[g], memory_order_relaxed));
+        print_value(f, &gauge_info[g], value);
+        prev = &gauge_info[g];
+    }
+
+    for (int h = 0; h < M_HISTOGRAMS; ++h) {
+        const char *name = hist_info[h].name;
+        uint64_t count = 0, sum_ns = 0;
+
+        print_header(f, &hist_info[h], NULL, "histogram");
+        for (int b = 0; b <= METRICS_BUCKETS; ++b) {
+            for (s = first; s; s = s->next) {
+                count += atomic_load_explicit(&s->hists[h].buckets[b], memory_order_relaxed);
+            }
+            if (b < METRICS_BUCKETS) {
+                fprintf(f, "%s%s_bucket{le=\"%.9g\"} %" PRIu64 "\n", METRICS_PREFIX, name, (double) (1ULL << b) / 1e6, count);
+            } else {
+                fprintf(f, "%s%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", METRICS_PREFIX, name, count);
+            }
+        }
+        for (s = first; s; s = s->next) {
+            sum_ns += atomic_load_explicit(&s->hists[h].sum_ns, memory_order_relaxed);
+        }
+        fprintf(f, "%s%s_sum %.9f\n", METRICS_PREFIX, name, (double) sum_ns / 1e9);
+        fprintf(f, "%s%s_count %" PRIu64 "\n", METRICS_PREFIX, name, count);
+    }
+
+    print_queues(f);
+}
+
+static void metrics_serve(int fd) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    char request[4096], header[128], *text = NULL;
+    size_t len = 0, off = 0;
+    int hlen;
+    FILE *f;
+
+    /* whatever was asked for, everything is the answer; a client that
+     * sends nothing still gets it once the timeout runs out */
+    if (poll(&pfd, 1, METRICS_REQUEST_TIMEOUT_MS) > 0 && recv(fd, request, sizeof(request), 0) < 0) {
+        return;
+    }
+
+    f = open_memstream(&text, &len);
+    if (!f) {
+        perror("metrics_serve: open_memstream");
+        return;
+    }
+    print_metrics(f);
+    fclose(f);
+
+    hlen = snprintf(header, sizeof(header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", len);
+    if (send(fd, header, hlen, MSG_NOSIGNAL) == hlen) {
+        while (off < len) {
+            ssize_t n = send(fd, text + off, len - off, MSG_NOSIGNAL);
+            if (n <= 0) {
+                break;
+            }
+            off += n;
+        }
+    }
+    free(text);
+}
+
+static void *metrics_loop(void *data) {
+    (void) data;
+
+    for (;;) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("metrics_loop: accept4");
+            }
+            continue;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+void metrics_init(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    pthread_t thread;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "metrics socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("metrics_init: socket");
+        exit(EXIT_FAILURE);
+    }
+    /* left over from a previous run */
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        perror("metrics_init: bind");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&thread, NULL, metrics_loop, NULL) != 0) {
+        perror("metrics_init: pthread_create");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
@@ -0,0 +1,117 @@
+/*
+ * The `bench' build: replays packets through queue_cb() and nfct_add(), with
+ * the netlink socket and conntrack replaced by stubs (see ../bench/replay.c).
+ * Mapped destinations are given synthetic addresses as a DNS answer would,
+ * and the packets are sent to those.
+ */
+
+#include <errno.h>
+
+#include <sys/socket.h>
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+
+#include "nfqueue.c"
+#include "nat_table.h"
+#include "nat_table6.h"
+#include "replay.h"
+
+#define BENCH_FLOWS_BITS 21
+#define BENCH_TTL 3600
+
+/* conntrack as nfct_add() sees it: a set of flows, by a hash of the tuple */
+static uint64_t flows[1 << BENCH_FLOWS_BITS];
+static uint32_t nflows = 0;
+
+static uint32_t fwmark = 0;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len) {
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t flow_hash(const struct nf_conntrack *ct) {
+    uint64_t h = 14695981039346656037ull;
+    uint16_t ports[] = {nfct_get_attr_u16(ct, ATTR_PORT_SRC), nfct_get_attr_u16(ct, ATTR_PORT_DST)};
+    uint8_t proto = nfct_get_attr_u8(ct, ATTR_L4PROTO);
+
+    if (nfct_get_attr_u8(ct, ATTR_L3PROTO) == AF_INET6) {
+        h = hash_bytes(h, nfct_get_attr(ct, ATTR_IPV6_SRC), sizeof(struct in6_addr));
+        h = hash_bytes(h, nfct_get_attr(ct, ATTR_IPV6_DST), sizeof(struct in6_addr));
+    } else {
+        uint32_t addrs[] = {nfct_get_attr_u32(ct, ATTR_IPV4_SRC), nfct_get_attr_u32(ct, ATTR_IPV4_DST)};
+        h = hash_bytes(h, addrs, sizeof(addrs));
+    }
+    h = hash_bytes(h, &proto, sizeof(proto));
+    h = hash_bytes(h, ports, sizeof(ports));
+    /* 0 marks a free slot */
+    return h | 1;
+}
+
+int nfct_query(struct nfct_handle *h, const enum nf_conntrack_query query, const void *data) {
+    uint64_t key = flow_hash(data);
+    uint32_t mask = (1 << BENCH_FLOWS_BITS) - 1, i;
+    (void) h;
+
+    for (i = key & mask; flows[i] != 0; i = (i + 1) & mask) {
+        if (flows[i] == key) {
+            if (query == NFCT_Q_CREATE) {
+                errno = EEXIST;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    if (query != NFCT_Q_CREATE) {
+        errno = ENOENT;
+        return -1;
+    }
+    /* past three quarters full, new flows are simply forgotten */
+    if (nflows < mask / 4 * 3) {
+        flows[i] = key;
+        ++nflows;
+    }
+    return 0;
+}
+
+/* nfq_send_verdict() writes to the netlink socket directly */
+ssize_t sendmsg(int fd, const struct msghdr *msg, int flags) {
+    ssize_t len = 0;
+    (void) fd, (void) flags;
+
+    for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+        len += msg->msg_iov[i].iov_len;
+    }
+    replay_sent();
+    return len;
+}
+
+static void map(uint8_t *daddr, int version) {
+    if (version == 6) {
+        struct in6_addr val, key;
+        memcpy(&val, daddr, sizeof(val));
+        if (nt6_reverse_lookup(&val, BENCH_TTL, &key) == 0) {
+            memcpy(daddr, &key, sizeof(key));
+        }
+    } else {
+        in_addr_t val, key;
+        memcpy(&val, daddr, sizeof(val));
+        key = nt_reverse_lookup(val, BENCH_TTL);
+        if (key != (in_addr_t) -1) {
+            memcpy(daddr, &key, sizeof(key));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    struct replay_ops ops = {.ipv6 = true, .map = map, .cb = queue_cb, .data = &fwmark};
+    char range[] = "100.64.0.0/12", prefix6[] = "fd00:64::/96";
+
+    nt_init(range, NULL, false, NULL);
+    nt6_init(prefix6);
+
+    return replay_main(argc, argv, &ops);
+}
@@ -0,0 +1,333 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <signal.h>
+
+#include <event2/event.h>
+
+#include <udns.h>
+
+#include "cache.h"
+#include "upstream.h"
+
+/*
+ * Caches upstream answers for their TTL, and counts how often each name is
+ * asked for while it is cached.  A name asked for at least `min_queries'
+ * times is re-resolved in the background once 10% of its TTL remains, so the
+ * cached answer, and through the refresh callback the NAT mapping, never
+ * goes cold for it.  Refreshes are limited by a token bucket so that a burst
+ * of names expiring together can't flood the upstream servers.
+ *
+ * SIGUSR1 dumps the counters to stderr, along with the upstream statistics.
+ */
+
+#define CACHE_BUCKETS (1 << 16)
+#define CACHE_MAX 65536
+/* refresh once this fraction of the TTL remains */
+#define CACHE_REFRESH_DIV 10
+/* answers with shorter TTLs aren't worth refreshing */
+#define CACHE_MIN_REFRESH_TTL CACHE_REFRESH_DIV
+/* default refreshes per second */
+#define CACHE_DEFAULT_RATE 20
+
+struct cache_entry {
+    struct cache_entry *next;
+    struct event *ev;
+    uint32_t hash;
+    int type;
+    time_t expires;
+    /* queries answered from this entry since it was filled */
+    uint32_t queries;
+    bool refreshing;
+    char *qname, *cname;
+    int nrr;
+    /* then the addresses and the names */
+    unsigned char addrs[];
+};
+
+/* what a refresh needs once the entry it was started for may be gone */
+struct refresh {
+    int type;
+    char name[];
+};
+
+static struct cache_entry *buckets[CACHE_BUCKETS];
+static unsigned nentries = 0;
+static struct event_base *base;
+
+static unsigned min_queries = 0;
+static unsigned rate = CACHE_DEFAULT_RATE;
+static cache_refresh_fn *refresh_fn;
+static double tokens;
+static time_t tokens_updated;
+
+static uint64_t refreshed = 0, refresh_limited = 0;
+
+/* FNV-1a, ignoring case as DNS does */
+static uint32_t name_hash(const char *name, int type) {
+    uint32_t h = 2166136261u ^ (uint32_t) type;
+    for (; *name; ++name) {
+        h ^= (unsigned char) tolower((unsigned char) *name);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static size_t addr_size(int type) {
+    return type == DNS_T_AAAA ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+static struct cache_entry **find(const char *name, int type, uint32_t hash) {
+    struct cache_entry **p = &buckets[hash & (CACHE_BUCKETS - 1)];
+    for (; *p; p = &(*p)->next) {
+        if ((*p)->hash == hash && (*p)->type == type && strcasecmp((*p)->qname, name) == 0) {
+            break;
+        }
+    }
+    return p;
+}
+
+static void entry_remove(struct cache_entry **p) {
+    struct cache_entry *e = *p;
+    *p = e->next;
+    event_free(e->ev);
+    free(e);
+    --nentries;
+}
+
+static bool take_token(void) {
+    time_t now = time(NULL);
+
+    tokens += (double) (now - tokens_updated) * rate;
+    if (tokens > rate) {
+        tokens = rate;
+    }
+    tokens_updated = now;
+
+    if (tokens < 1) {
+        ++refresh_limited;
+        return false;
+    }
+    --tokens;
+    return true;
+}
+
+static void refresh_cb(void *result, int status, void *arg) {
+    struct refresh *r = arg;
+    struct cache_entry **p = find(r->name, r->type, name_hash(r->name, r->type));
+    (void) status;
+
+    if (*p) {
+        (*p)->refreshing = false;
+    }
+    if (result) {
+        ++refreshed;
+        cache_put(r->name, r->type, result);
+        refresh_fn(r->name, r->type, result);
+    }
+    free(r);
+}
+
+static bool refresh(struct cache_entry *e) {
+    struct refresh *r = malloc(sizeof(struct refresh) + strlen(e->qname) + 1);
+
+    if (!r) {
+        return false;
+    }
+    r->type = e->type;
+    strcpy(r->name, e->qname);
+
+    if (up_resolve(r->name, r->type, refresh_cb, r) < 0) {
+        free(r);
+        return false;
+    }
+    e->refreshing = true;
+    return true;
+}
+
+/*
+ * Fires when the entry is due for a refresh, and again once it has
+ * expired.  Until then, a refresh held back by the rate limit is retried
+ * every second.
+ */
+static void entry_cb(evutil_socket_t fd, short what, void *data) {
+    struct cache_entry *e = data;
+    time_t now = time(NULL);
+    struct timeval tv = {1, 0};
+    (void) fd, (void) what;
+
+    if (now >= e->expires) {
+        entry_remove(find(e->qname, e->type, e->hash));
+        return;
+    }
+
+    /* the timer is monotonic and `expires' isn't, so this can also be
+     * early after the clock stepped back, with refreshing turned off */
+    if (min_queries > 0 && !e->refreshing && e->queries >= min_queries && (!take_token() || !refresh(e))) {
+        evtimer_add(e->ev, &tv);
+        return;
+    }
+
+    tv.tv_sec = e->expires - now;
+    evtimer_add(e->ev, &tv);
+}
+
+void *cache_get(const char *name, int type) {
+    struct cache_entry *e = *find(name, type, name_hash(name, type));
+    time_t now = time(NULL);
+    size_t asize = addr_size(type), qlen, clen;
+    struct dns_rr_a4 *a4;
+    struct dns_rr_a6 *a6;
+    void *ret;
+    char *names;
+
+    if (!e || e->expires <= now) {
+        return NULL;
+    }
+    ++e->queries;
+
+    /* a fresh copy laid out like the ones udns returns, to be freed the
+     * same way */
+    qlen = strlen(e->qname) + 1;
+    clen = strlen(e->cname) + 1;
+    if (type == DNS_T_AAAA) {
+        a6 = malloc(sizeof(struct dns_rr_a6) + e->nrr * asize + qlen + clen);
+        if (!a6) {
+            return NULL;
+        }
+        a6->dnsa6_addr = (struct in6_addr *) (a6 + 1);
+        a6->dnsa6_nrr = e->nrr;
+        a6->dnsa6_ttl = e->expires - now;
+        memcpy(a6->dnsa6_addr, e->addrs, e->nrr * asize);
+        names = (char *) (a6->dnsa6_addr + e->nrr);
+        a6->dnsa6_qname = memcpy(names, e->qname, qlen);
+        a6->dnsa6_cname = memcpy(names + qlen, e->cname, clen);
+        ret = a6;
+    } else {
+        a4 = malloc(sizeof(struct dns_rr_a4) + e->nrr * asize + qlen + clen);
+        if (!a4) {
+            return NULL;
+        }
+        a4->dnsa4_addr = (struct in_addr *) (a4 + 1);
+        a4->dnsa4_nrr = e->nrr;
+        a4->dnsa4_ttl = e->expires - now;
+        memcpy(a4->dnsa4_addr, e->addrs, e->nrr * asize);
+        names = (char *) (a4->dnsa4_addr + e->nrr);
+        a4->dnsa4_qname = memcpy(names, e->qname, qlen);
+        a4->dnsa4_cname = memcpy(names + qlen, e->cname, clen);
+        ret = a4;
+    }
+
+    return ret;
+}
+
+void cache_put(const char *name, int type, const void *result) {
+    uint32_t hash = name_hash(name, type);
+    struct cache_entry **p = find(name, type, hash), *e;
+    size_t asize = addr_size(type), qlen, clen;
+    const char *cname;
+    const void *addrs;
+    uint32_t ttl;
+    int nrr;
+    struct timeval tv = {0, 0};
+
+    if (type == DNS_T_AAAA) {
+        const struct dns_rr_a6 *a6 = result;
+        cname = a6->dnsa6_cname;
+        ttl = a6->dnsa6_ttl;
+        nrr = a6->dnsa6_nrr;
+        addrs = a6->dnsa6_addr;
+    } else {
+        const struct dns_rr_a4 *a4 = result;
+        cname = a4->dnsa4_cname;
+        ttl = a4->dnsa4_ttl;
+        nrr = a4->dnsa4_nrr;
+        addrs = a4->dnsa4_addr;
+    }
+
+    /* replacing an entry, as a refresh does, starts counting queries
+     * afresh, so a name has to stay popular to keep being refreshed */
+    if (*p) {
+        entry_remove(p);
+    }
+    if (ttl == 0 || nentries >= CACHE_MAX) {
+        return;
+    }
+
+    qlen = strlen(name) + 1;
+    clen = strlen(cname) + 1;
+    e = malloc(sizeof(struct cache_entry) + nrr * asize + qlen + clen);
+    if (!e) {
+        return;
+    }
+    e->ev = evtimer_new(base, entry_cb, e);
+    if (!e->ev) {
+        free(e);
+        return;
+    }
+    e->hash = hash;
+    e->type = type;
+    e->expires = time(NULL) + ttl;
+    e->queries = 0;
+    e->refreshing = false;
+    e->nrr = nrr;
+    memcpy(e->addrs, addrs, nrr * asize);
+    e->qname = memcpy(e->addrs + nrr * asize, name, qlen);
+    e->cname = memcpy(e->qname + qlen, cname, clen);
+
+    e->next = *p;
+    *p = e;
+    ++nentries;
+
+    tv.tv_sec = ttl;
+    if (min_queries > 0 && ttl >= CACHE_MIN_REFRESH_TTL) {
+        tv.tv_sec -= ttl / CACHE_REFRESH_DIV;
+    }
+    evtimer_add(e->ev, &tv);
+}
+
+static void stats_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what, (void) data;
+    fprintf(stderr, "cache: %u entries, %lu refreshed, %lu refreshes held back by the rate limit\n",
+            nentries, (unsigned long) refreshed, (unsigned long) refresh_limited);
+}
+
+void cache_init(struct event_base *event_base, char *refresh, cache_refresh_fn *fn) {
+    char *endptr = NULL;
+
+    struct event *stats_ev;
+
+    base = event_base;
+    refresh_fn = fn;
+
+    stats_ev = evsignal_new(base, SIGUSR1, stats_cb, NULL);
+    if (!stats_ev || event_add(stats_ev, NULL) < 0) {
+        perror("cache_init: evsignal_new");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!refresh) {
+        return;
+    }
+
+    min_queries = (unsigned) strtoul(refresh, &endptr, 10);
+    if (*endptr == ':') {
+        char *rate_str = endptr + 1;
+        rate = (unsigned) strtoul(rate_str, &endptr, 10);
+        if (rate_str[0] == '\0') {
+            endptr = rate_str;
+        }
+    }
+    if (refresh[0] == '\0' || *endptr != '\0' || min_queries == 0 || rate == 0) {
+        fprintf(stderr, "invalid refresh setting %s, expected min_queries[:refreshes_per_second]\n", refresh);
+        exit(EXIT_FAILURE);
+    }
+
+    tokens = rate;
+    tokens_updated = time(NULL);
+}
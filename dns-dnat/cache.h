@@ -0,0 +1,13 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <event2/event.h>
+
+/* gets each refreshed answer, a struct dns_rr_a4 or dns_rr_a6 to free */
+typedef void cache_refresh_fn(const char *, int, void *);
+
+void cache_init(struct event_base *, char *, cache_refresh_fn *);
+void *cache_get(const char *, int);
+void cache_put(const char *, int, const void *);
+
+#endif
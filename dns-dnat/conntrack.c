@@ -1,21 +1,32 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <alloca.h>
+#include <stdbool.h>
+#include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <arpa/inet.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
 #include <linux/icmp.h>
+#include <linux/icmpv6.h>
 #include <linux/tcp.h>
 #include <linux/udp.h>
 
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
+#include "conntrack.h"
+#include "metrics.h"
 #include "nat_table.h"
+#include "nat_table6.h"
 
 static struct nfct_handle *handle;
+static uint32_t ctmark;
 
-int nfct_init(void) {
+int nfct_init(uint32_t mark) {
+    ctmark = mark;
     handle = nfct_open(CONNTRACK, 0);
     if (!handle) {
         return -1;
@@ -27,10 +38,24 @@ void nfct_cleanup(void) {
   nfct_close(handle);
 }
 
+/* a GET that finds nothing is how a new flow is found, not a failure */
+static int ct_query(enum nf_conntrack_query query, struct nf_conntrack *ct, enum metrics_counter counter) {
+    uint64_t start = metrics_now();
+    int ret = nfct_query(handle, query, ct);
+
+    metrics_observe(M_CT_QUERY, metrics_now() - start);
+    metrics_inc(counter);
+    if (ret == -1 && query != NFCT_Q_GET) {
+        metrics_inc(M_CT_FAILURES);
+    }
+    return ret;
+}
+
 union l4hdr {
     struct tcphdr tcp;
     struct udphdr udp;
     struct icmphdr icmp;
+    struct icmp6hdr icmp6;
 };
 
 in_addr_t nfct_add(uint8_t *pkt) {
@@ -42,14 +67,14 @@ in_addr_t nfct_add(uint8_t *pkt) {
 
     in_addr_t new_daddr = nt_lookup(ip->daddr);
     if (new_daddr == (in_addr_t) -1) {
+      metrics_inc(M_NAT_MISSES);
       return 0;
     }
+    metrics_inc(M_NAT_HITS);
 
-    ct = nfct_new();
-    if (!ct) {
-        perror("nfct_new");
-        return -1;
-    }
+    /* keep the conntrack object off the heap; this runs for every packet */
+    ct = alloca(nfct_maxsize());
+    memset(ct, 0, nfct_maxsize());
 
     nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET);
     nfct_set_attr_u32(ct, ATTR_IPV4_SRC, ip->saddr);
@@ -80,7 +105,12 @@ in_addr_t nfct_add(uint8_t *pkt) {
 
     nfct_set_attr_u32(ct, ATTR_DNAT_IPV4, new_daddr);
 
-    ret = nfct_query(handle, NFCT_Q_GET, ct);
+    /* lets the ruleset keep the rest of the flow out of the queue */
+    if (ctmark) {
+        nfct_set_attr_u32(ct, ATTR_MARK, ctmark);
+    }
+
+    ret = ct_query(NFCT_Q_GET, ct, M_CT_GETS);
     if (ret == -1) {
         char s_saddr[16], s_daddr[16], s_naddr[16], s_proto[9], s_sport[7], s_dport[7];
         inet_ntop(AF_INET, &(ip->saddr), s_saddr, 16);
@@ -104,15 +134,331 @@ in_addr_t nfct_add(uint8_t *pkt) {
         }
         fprintf(stderr, "%s connection from %s%s to %s%s via %s\n", s_proto, s_saddr, s_sport, s_naddr, s_dport, s_daddr);
 
-        ret = nfct_query(handle, NFCT_Q_CREATE, ct);
+        ret = ct_query(NFCT_Q_CREATE, ct, M_CT_CREATES);
         if (ret == -1) {
             perror("nfct_query");
         }
+    } else if (ctmark) {
+        /* the flow exists but was queued anyway, so it lacks our mark; the
+         * NAT of an existing entry can't be changed, so only send the tuple */
+        struct nf_conntrack *mark_ct = alloca(nfct_maxsize());
+        memset(mark_ct, 0, nfct_maxsize());
+        nfct_copy(mark_ct, ct, NFCT_CP_ORIG);
+        nfct_set_attr_u32(mark_ct, ATTR_MARK, ctmark);
+        if (ct_query(NFCT_Q_UPDATE, mark_ct, M_CT_UPDATES) == -1) {
+            perror("nfct_query");
+        }
     }
 
-    nfct_destroy(ct);
-
     if (ret == -1) return (in_addr_t) ret;
 
     return new_daddr;
 }
+
+/* like nfct_add(), for an IPv6 packet whose transport header is at `l4';
+ * returns 1 and the real address if the destination is mapped */
+int nfct_add6(uint8_t *pkt, uint8_t proto, uint8_t *l4_ptr, struct in6_addr *new_daddr) {
+    int ret;
+    struct nf_conntrack *ct;
+
+    struct ipv6hdr *ip6 = (struct ipv6hdr *) pkt;
+    union l4hdr *l4 = (union l4hdr *) l4_ptr;
+
+    if (nt6_lookup(&ip6->daddr, new_daddr) < 0) {
+        metrics_inc(M_NAT_MISSES);
+        return 0;
+    }
+    metrics_inc(M_NAT_HITS);
+
+    ct = alloca(nfct_maxsize());
+    memset(ct, 0, nfct_maxsize());
+
+    nfct_set_attr_u8(ct, ATTR_L3PROTO, AF_INET6);
+    nfct_set_attr(ct, ATTR_IPV6_SRC, &ip6->saddr);
+    nfct_set_attr(ct, ATTR_IPV6_DST, &ip6->daddr);
+    nfct_set_attr_u8(ct, ATTR_L4PROTO, proto);
+    switch (proto) {
+        case IPPROTO_TCP:
+            nfct_set_attr_u16(ct, ATTR_PORT_SRC, l4->tcp.source);
+            nfct_set_attr_u16(ct, ATTR_PORT_DST, l4->tcp.dest);
+            nfct_set_attr_u8(ct, ATTR_TCP_STATE, TCP_CONNTRACK_ESTABLISHED);
+            break;
+        case IPPROTO_UDP:
+            nfct_set_attr_u16(ct, ATTR_PORT_SRC, l4->udp.source);
+            nfct_set_attr_u16(ct, ATTR_PORT_DST, l4->udp.dest);
+            break;
+        case IPPROTO_ICMPV6:
+            nfct_set_attr_u8(ct, ATTR_ICMP_TYPE, l4->icmp6.icmp6_type);
+            nfct_set_attr_u8(ct, ATTR_ICMP_CODE, l4->icmp6.icmp6_code);
+            if (l4->icmp6.icmp6_type == ICMPV6_ECHO_REQUEST || l4->icmp6.icmp6_type == ICMPV6_ECHO_REPLY) {
+                nfct_set_attr_u16(ct, ATTR_ICMP_ID, l4->icmp6.icmp6_identifier);
+            }
+            break;
+    };
+
+    nfct_setobjopt(ct, NFCT_SOPT_SETUP_REPLY);
+
+    nfct_set_attr_u32(ct, ATTR_TIMEOUT, 120);
+
+    nfct_set_attr(ct, ATTR_DNAT_IPV6, new_daddr);
+
+    if (ctmark) {
+        nfct_set_attr_u32(ct, ATTR_MARK, ctmark);
+    }
+
+    ret = ct_query(NFCT_Q_GET, ct, M_CT_GETS);
+    if (ret == -1) {
+        char s_saddr[INET6_ADDRSTRLEN], s_daddr[INET6_ADDRSTRLEN], s_naddr[INET6_ADDRSTRLEN];
+        char s_proto[9], s_sport[7], s_dport[7];
+        inet_ntop(AF_INET6, &ip6->saddr, s_saddr, sizeof(s_saddr));
+        inet_ntop(AF_INET6, &ip6->daddr, s_daddr, sizeof(s_daddr));
+        inet_ntop(AF_INET6, new_daddr, s_naddr, sizeof(s_naddr));
+        switch (proto) {
+            case IPPROTO_TCP:
+                sprintf(s_proto, "TCP");
+                snprintf(s_sport, 7, ":%u", ntohs(l4->tcp.source));
+                snprintf(s_dport, 7, ":%u", ntohs(l4->tcp.dest));
+                break;
+            case IPPROTO_UDP:
+                sprintf(s_proto, "UDP");
+                snprintf(s_sport, 7, ":%u", ntohs(l4->udp.source));
+                snprintf(s_dport, 7, ":%u", ntohs(l4->udp.dest));
+                break;
+            default:
+                snprintf(s_proto, 9, "ICMPv6 %u", l4->icmp6.icmp6_type);
+                s_sport[0] = s_dport[0] = '\0';
+                break;
+        }
+        fprintf(stderr, "%s connection from %s%s to %s%s via %s\n", s_proto, s_saddr, s_sport, s_naddr, s_dport, s_daddr);
+
+        ret = ct_query(NFCT_Q_CREATE, ct, M_CT_CREATES);
+        if (ret == -1) {
+            perror("nfct_query");
+        }
+    } else if (ctmark) {
+        struct nf_conntrack *mark_ct = alloca(nfct_maxsize());
+        memset(mark_ct, 0, nfct_maxsize());
+        nfct_copy(mark_ct, ct, NFCT_CP_ORIG);
+        nfct_set_attr_u32(mark_ct, ATTR_MARK, ctmark);
+        if (ct_query(NFCT_Q_UPDATE, mark_ct, M_CT_UPDATES) == -1) {
+            perror("nfct_query");
+        }
+    }
+
+    if (ret == -1) return ret;
+
+    return 1;
+}
+
+/*
+ * The flows towards the NAT range, by conntrack ID, so that each is counted
+ * towards its address exactly once: a flow can turn up both in a dump and as
+ * a NEW event, and a DESTROY must only uncount a flow that was counted.  After
+ * events are lost, a fresh dump marks every flow that still exists and the
+ * rest are uncounted (see flows_resync()).  Only the watch thread uses it.
+ *
+ * Open addressing with linear probing; a slot with daddr 0 is free, as 0.0.0.0
+ * is never in the NAT range.
+ */
+struct flow {
+    uint32_t id;
+    in_addr_t daddr;
+    /* the resync that last saw it */
+    uint32_t seen;
+};
+
+#define FLOWS_MIN_SIZE 4096
+
+static struct flow *flows = NULL;
+static uint32_t flows_mask = 0, nflows = 0, resyncs = 0;
+static uint32_t watch_min, watch_max;
+
+static inline uint32_t flow_hash(uint32_t id) {
+    return id * 2654435761u;
+}
+
+static struct flow *flow_slot(struct flow *table, uint32_t mask, uint32_t id) {
+    uint32_t i = flow_hash(id) & mask;
+
+    while (table[i].daddr && table[i].id != id) {
+        i = (i + 1) & mask;
+    }
+    return &table[i];
+}
+
+/* a table of `size' slots with every flow that `keep' (or everything if NULL) */
+static void flows_rebuild(uint32_t size, bool (*keep)(const struct flow *)) {
+    struct flow *table = calloc(size, sizeof(struct flow));
+
+    if (!table) {
+        perror("flows_rebuild: calloc");
+        exit(EXIT_FAILURE);
+    }
+    nflows = 0;
+    for (uint32_t i = 0; flows && i <= flows_mask; ++i) {
+        if (!flows[i].daddr) {
+            continue;
+        }
+        if (keep && !keep(&flows[i])) {
+            nt_flow_destroy(flows[i].daddr);
+            continue;
+        }
+        *flow_slot(table, size - 1, flows[i].id) = flows[i];
+        ++nflows;
+    }
+    free(flows);
+    flows = table;
+    flows_mask = size - 1;
+}
+
+static void flow_new(uint32_t id, in_addr_t daddr) {
+    struct flow *f;
+
+    if (ntohl(daddr) < watch_min || ntohl(daddr) > watch_max) {
+        return;
+    }
+    if (2 * (nflows + 1) > flows_mask + 1) {
+        flows_rebuild(2 * (flows_mask + 1), NULL);
+    }
+
+    f = flow_slot(flows, flows_mask, id);
+    f->seen = resyncs;
+    if (f->daddr) {
+        return;
+    }
+    f->id = id;
+    f->daddr = daddr;
+    ++nflows;
+    nt_flow_new(daddr);
+}
+
+static void flow_destroy(uint32_t id) {
+    struct flow *f = flow_slot(flows, flows_mask, id);
+    uint32_t i, j;
+
+    if (!f->daddr) {
+        return;
+    }
+    nt_flow_destroy(f->daddr);
+    --nflows;
+
+    /* shift back whatever would no longer be found past the hole */
+    i = f - flows;
+    for (j = (i + 1) & flows_mask; flows[j].daddr; j = (j + 1) & flows_mask) {
+        uint32_t home = flow_hash(flows[j].id) & flows_mask;
+        if (((j - home) & flows_mask) >= ((j - i) & flows_mask)) {
+            flows[i] = flows[j];
+            i = j;
+        }
+    }
+    flows[i].daddr = 0;
+}
+
+static int watch_cb(enum nf_conntrack_msg_type type, struct nf_conntrack *ct, void *data) {
+    (void) data;
+
+    /* IPv6 mappings are reclaimed by age alone (see nat_table6.c) */
+    if (nfct_get_attr_u8(ct, ATTR_L3PROTO) != AF_INET) {
+        return NFCT_CB_CONTINUE;
+    }
+
+    if (type == NFCT_T_DESTROY) {
+        flow_destroy(nfct_get_attr_u32(ct, ATTR_ID));
+    } else {
+        flow_new(nfct_get_attr_u32(ct, ATTR_ID), nfct_get_attr_u32(ct, ATTR_ORIG_IPV4_DST));
+    }
+
+    return NFCT_CB_CONTINUE;
+}
+
+static bool flow_seen(const struct flow *f) {
+    return f->seen == resyncs;
+}
+
+/*
+ * Counts every flow that exists right now, and uncounts every flow that
+ * doesn't, at startup (flows that outlived a restart) and whenever events were
+ * lost.  Events queued meanwhile are handled afterwards and only repeat what
+ * the dump found, or report flows it missed because they came or went.
+ */
+static void flows_resync(struct nfct_handle *dump_handle) {
+    uint32_t family = AF_INET;
+
+    ++resyncs;
+    if (nfct_query(dump_handle, NFCT_Q_DUMP, &family) == -1) {
+        /* better to keep counts that might be too high than drop them all */
+        perror("flows_resync: nfct_query");
+        return;
+    }
+    flows_rebuild(flows_mask + 1, flow_seen);
+}
+
+static void *nfct_watch_loop(void *data) {
+    struct nfct_handle *watch_handle = (struct nfct_handle *) data, *dump_handle;
+
+    dump_handle = nfct_open(CONNTRACK, 0);
+    if (!dump_handle) {
+        perror("nfct_watch_loop: nfct_open");
+        exit(EXIT_FAILURE);
+    }
+    nfct_callback_register(dump_handle, NFCT_T_ALL, watch_cb, NULL);
+    flows_resync(dump_handle);
+
+    while (true) {
+        if (nfct_catch(watch_handle) == -1) {
+            if (errno == ENOBUFS) {
+                fprintf(stderr, "lost conntrack events; recounting flows\n");
+                flows_resync(dump_handle);
+                continue;
+            }
+            perror("nfct_catch");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    nfct_close(dump_handle);
+    nfct_close(watch_handle);
+    return NULL;
+}
+
+void nfct_watch(pthread_t *forked_thread) {
+    int ret;
+    struct nfct_handle *watch_handle;
+    struct nfct_filter *filter;
+    struct nfct_filter_ipv4 range;
+
+    watch_handle = nfct_open(CONNTRACK, NF_NETLINK_CONNTRACK_NEW | NF_NETLINK_CONNTRACK_DESTROY);
+    if (!watch_handle) {
+        perror("nfct_watch: nfct_open");
+        exit(EXIT_FAILURE);
+    }
+
+    /* only hear about flows towards the NAT range */
+    nt_range(&watch_min, &watch_max);
+    range.addr = watch_min;
+    range.mask = ~(watch_max - watch_min);
+
+    filter = nfct_filter_create();
+    if (!filter) {
+        perror("nfct_filter_create");
+        exit(EXIT_FAILURE);
+    }
+    nfct_filter_add_attr(filter, NFCT_FILTER_DST_IPV4, &range);
+    if (nfct_filter_attach(nfct_fd(watch_handle), filter) == -1) {
+        perror("nfct_filter_attach");
+        exit(EXIT_FAILURE);
+    }
+    nfct_filter_destroy(filter);
+
+    nfct_callback_register(watch_handle, NFCT_T_NEW | NFCT_T_DESTROY, watch_cb, NULL);
+
+    flows_rebuild(FLOWS_MIN_SIZE, NULL);
+
+    /* subscribed before the first dump, which the thread does, so that no
+     * flow falls between the two */
+    ret = pthread_create(forked_thread, NULL, nfct_watch_loop, watch_handle);
+    if (ret != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(ret));
+        exit(EXIT_FAILURE);
+    }
+}
@@ -2,9 +2,13 @@
 #define __CONTRACK_H__
 
 #include <stdint.h>
+#include <pthread.h>
+#include <arpa/inet.h>
 
-int nfct_init(void);
+int nfct_init(uint32_t);
 void nfct_cleanup(void);
-int nfct_add(uint8_t *);
+in_addr_t nfct_add(uint8_t *);
+int nfct_add6(uint8_t *, uint8_t, uint8_t *, struct in6_addr *);
+void nfct_watch(pthread_t *);
 
 #endif
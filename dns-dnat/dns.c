@@ -30,79 +30,321 @@
 
 #include <udns.h>
 
+#include "cache.h"
 #include "ipset.h"
+#include "metrics.h"
 #include "nat_table.h"
+#include "nat_table6.h"
+#include "policy.h"
+#include "tcp.h"
+#include "dns.h"
+#include "upstream.h"
 
 struct cb_data {
-    struct dns_ctx *ctx;
     char *ipset;
+    char *ipset6;
+    bool ipv6;
 };
 
-static void server_cb(struct evdns_server_request *req, void *data_void) {
+struct question {
+    struct request *r;
+    int err;
+};
+
+/* a client request, answered once all of its questions are */
+struct request {
+    const struct dns_reply_ops *ops;
+    void *reply;
+    int nquestions;
+    const char **names;
+    const int *types;
+    int pending;
+    struct question questions[];
+};
+
+static struct cb_data data;
+
+static int resolve_error(int status) {
+    switch (status) {
+        case DNS_E_NXDOMAIN:
+            return DNS_ERR_NOTEXIST;
+        case DNS_E_NODATA:
+            return DNS_ERR_NODATA;
+        default:
+            return DNS_ERR_SERVERFAILED;
+    }
+}
+
+static void count_response(int err) {
+    switch (err) {
+        case DNS_ERR_NONE:
+        case DNS_ERR_NODATA:
+            metrics_inc(M_DNS_NOERROR);
+            break;
+        case DNS_ERR_NOTEXIST:
+            metrics_inc(M_DNS_NXDOMAIN);
+            break;
+        default:
+            metrics_inc(M_DNS_SERVFAIL);
+            break;
+    }
+}
+
+static int answer_a(struct request *r, const char *name, struct dns_rr_a4 *ans, int status) {
     int err = DNS_ERR_NONE;
-    struct cb_data *data = (struct cb_data *) data_void;
-    struct dns_rr_a4 *ans;
+    const char *ipset;
+    enum policy_action action = policy_match(name, &ipset);
 
-    for (uint16_t i = 0; i < req->nquestions; ++i) {
-        const struct evdns_server_question *q = req->questions[i];
-        int ret;
+    if (!ans) {
+        return resolve_error(status);
+    }
 
-        if (q->type != EVDNS_TYPE_A) {
-            err = DNS_ERR_NOTEXIST;
-            continue;
+    if (strcmp(ans->dnsa4_qname, ans->dnsa4_cname) != 0) {
+        r->ops->add_cname(r->reply, ans->dnsa4_qname, ans->dnsa4_cname, ans->dnsa4_ttl);
+    }
+
+    if (action == POLICY_PASS) {
+        if (r->ops->add_a(r->reply, ans->dnsa4_cname, ans->dnsa4_nrr, ans->dnsa4_addr, ans->dnsa4_ttl) < 0) {
+            err = DNS_ERR_SERVERFAILED;
         }
+        free(ans);
+        return err;
+    }
 
-        ans = dns_resolve_a4(data->ctx, q->name, 0);
-        if (!ans) {
-            switch (dns_status(data->ctx)) {
-                case DNS_E_NXDOMAIN:
-                    err = DNS_ERR_NOTEXIST;
-                    continue;
-                case DNS_E_NODATA:
-                    err = DNS_ERR_NODATA;
-                    continue;
-                default:
-                    err = DNS_ERR_SERVERFAILED;
-                    break;
-            }
+    for (uint16_t j = 0; j < ans->dnsa4_nrr; ++j) {
+        in_addr_t orig_addr = ans->dnsa4_addr[j].s_addr;
+        in_addr_t nat_addr = nt_reverse_lookup(orig_addr, ans->dnsa4_ttl);
+        if (nat_addr == (in_addr_t) -1) {
+            err = DNS_ERR_SERVERFAILED;
             break;
         }
+        ipset_add(ipset ? ipset : data.ipset, orig_addr);
 
-        if (strcmp(ans->dnsa4_qname, ans->dnsa4_cname) != 0) {
-            evdns_server_request_add_cname_reply(req, ans->dnsa4_qname, ans->dnsa4_cname, ans->dnsa4_ttl);
+        if (r->ops->add_a(r->reply, ans->dnsa4_cname, 1, &nat_addr, ans->dnsa4_ttl) < 0) {
+            err = DNS_ERR_SERVERFAILED;
+            break;
         }
+    }
 
-        for (uint16_t j = 0; j < ans->dnsa4_nrr; ++j) {
-            in_addr_t orig_addr = ans->dnsa4_addr[j].s_addr;
-            in_addr_t nat_addr = nt_reverse_lookup(orig_addr);
-            ipset_add(data->ipset, orig_addr);
+    free(ans);
+    return err;
+}
 
-            ret = evdns_server_request_add_a_reply(req, ans->dnsa4_cname, 1, &nat_addr, ans->dnsa4_ttl);
-            if (ret < 0) {
-                err = DNS_ERR_SERVERFAILED;
-                break;
-            }
-        }
+static int answer_aaaa(struct request *r, const char *name, struct dns_rr_a6 *ans, int status) {
+    int err = DNS_ERR_NONE;
+    const char *ipset;
+    /* a per-rule ipset holds IPv4 addresses, so it doesn't apply here */
+    enum policy_action action = policy_match(name, &ipset);
+
+    if (!ans) {
+        return resolve_error(status);
+    }
 
+    if (strcmp(ans->dnsa6_qname, ans->dnsa6_cname) != 0) {
+        r->ops->add_cname(r->reply, ans->dnsa6_qname, ans->dnsa6_cname, ans->dnsa6_ttl);
+    }
+
+    if (action == POLICY_PASS) {
+        if (r->ops->add_aaaa(r->reply, ans->dnsa6_cname, ans->dnsa6_nrr, ans->dnsa6_addr, ans->dnsa6_ttl) < 0) {
+            err = DNS_ERR_SERVERFAILED;
+        }
         free(ans);
+        return err;
+    }
+
+    for (uint16_t j = 0; j < ans->dnsa6_nrr; ++j) {
+        struct in6_addr nat_addr;
+        if (nt6_reverse_lookup(&ans->dnsa6_addr[j], ans->dnsa6_ttl, &nat_addr) < 0) {
+            err = DNS_ERR_SERVERFAILED;
+            break;
+        }
+        if (data.ipset6) {
+            ipset_add6(data.ipset6, &ans->dnsa6_addr[j]);
+        }
+
+        if (r->ops->add_aaaa(r->reply, ans->dnsa6_cname, 1, &nat_addr, ans->dnsa6_ttl) < 0) {
+            err = DNS_ERR_SERVERFAILED;
+            break;
+        }
+    }
+
+    free(ans);
+    return err;
+}
+
+static void request_finish(struct request *r) {
+    int err = DNS_ERR_NONE;
+
+    /* as if the questions had been answered in order */
+    for (int i = 0; i < r->nquestions; ++i) {
+        err = r->questions[i].err;
+        if (err == DNS_ERR_SERVERFAILED) {
+            break;
+        }
+    }
+
+    count_response(err);
+    r->ops->respond(r->reply, err);
+    free(r);
+}
+
+static void question_cb(void *result, int status, void *arg) {
+    struct question *q = arg;
+    struct request *r = q->r;
+    int i = q - r->questions;
+
+    if (r->types[i] == DNS_T_AAAA) {
+        q->err = answer_aaaa(r, r->names[i], result, status);
+    } else {
+        q->err = answer_a(r, r->names[i], result, status);
+    }
+
+    if (--r->pending == 0) {
+        request_finish(r);
+    }
+}
+
+static void resolved_cb(void *result, int status, void *arg) {
+    struct question *q = arg;
+    int i = q - q->r->questions;
+
+    if (result) {
+        cache_put(q->r->names[i], q->r->types[i], result);
+    }
+    question_cb(result, status, arg);
+}
+
+/* refreshed answers only need to keep the NAT mappings and ipsets warm */
+static int discard_add(void *reply, const char *name, int n, const void *addrs, int ttl) {
+    (void) reply, (void) name, (void) n, (void) addrs, (void) ttl;
+    return 0;
+}
+
+static int discard_add_cname(void *reply, const char *name, const char *cname, int ttl) {
+    (void) reply, (void) name, (void) cname, (void) ttl;
+    return 0;
+}
+
+static void discard_respond(void *reply, int err) {
+    (void) reply, (void) err;
+}
+
+static const struct dns_reply_ops discard_ops = {discard_add_cname, discard_add, discard_add, discard_respond};
+
+static void refresh_cb(const char *name, int type, void *result) {
+    struct request r = {.ops = &discard_ops};
+
+    if (type == DNS_T_AAAA) {
+        answer_aaaa(&r, name, result, 0);
+    } else {
+        answer_a(&r, name, result, 0);
     }
+}
+
+void dns_answer(const struct dns_reply_ops *ops, void *reply, int nquestions, const char **names, const int *types) {
+    struct request *r = calloc(1, sizeof(struct request) + nquestions * sizeof(struct question));
+    void *cached;
+
+    if (!r) {
+        perror("dns_answer: calloc");
+        count_response(DNS_ERR_SERVERFAILED);
+        ops->respond(reply, DNS_ERR_SERVERFAILED);
+        return;
+    }
+    r->ops = ops;
+    r->reply = reply;
+    r->nquestions = nquestions;
+    r->names = names;
+    r->types = types;
+    /* held until every question has been sent off */
+    r->pending = 1;
+
+    for (int i = 0; i < nquestions; ++i) {
+        r->questions[i].r = r;
+        if (types[i] != DNS_T_A && !(types[i] == DNS_T_AAAA && data.ipv6)) {
+            r->questions[i].err = DNS_ERR_NOTEXIST;
+            continue;
+        }
 
-    evdns_server_request_respond(req, err);
+        ++r->pending;
+        cached = cache_get(names[i], types[i]);
+        metrics_inc(cached ? M_CACHE_HITS : M_CACHE_MISSES);
+        if (cached) {
+            question_cb(cached, 0, &r->questions[i]);
+        } else if (up_resolve(names[i], types[i], resolved_cb, &r->questions[i]) < 0) {
+            r->questions[i].err = DNS_ERR_SERVERFAILED;
+            --r->pending;
+        }
+    }
+
+    if (--r->pending == 0) {
+        request_finish(r);
+    }
 }
 
-void dns_loop(uint16_t port, char *upstream_dns, char *ipset) {
+/* the UDP side is served by evdns, which keeps the questions for us */
+struct udp_reply {
+    struct evdns_server_request *req;
+    const char **names;
+    int *types;
+};
+
+static int udp_add_cname(void *reply, const char *name, const char *cname, int ttl) {
+    return evdns_server_request_add_cname_reply(((struct udp_reply *) reply)->req, name, cname, ttl);
+}
+
+static int udp_add_a(void *reply, const char *name, int n, const void *addrs, int ttl) {
+    return evdns_server_request_add_a_reply(((struct udp_reply *) reply)->req, name, n, addrs, ttl);
+}
+
+static int udp_add_aaaa(void *reply, const char *name, int n, const void *addrs, int ttl) {
+    return evdns_server_request_add_aaaa_reply(((struct udp_reply *) reply)->req, name, n, addrs, ttl);
+}
+
+static void udp_respond(void *reply_void, int err) {
+    struct udp_reply *reply = reply_void;
+    evdns_server_request_respond(reply->req, err);
+    free(reply);
+}
+
+static const struct dns_reply_ops udp_ops = {udp_add_cname, udp_add_a, udp_add_aaaa, udp_respond};
+
+static void server_cb(struct evdns_server_request *req, void *data_void) {
+    struct udp_reply *reply;
+    (void) data_void;
+
+    /* names and types share the allocation with the reply */
+    reply = malloc(sizeof(struct udp_reply) + req->nquestions * (sizeof(char *) + sizeof(int)));
+    if (!reply) {
+        perror("server_cb: malloc");
+        count_response(DNS_ERR_SERVERFAILED);
+        evdns_server_request_respond(req, DNS_ERR_SERVERFAILED);
+        return;
+    }
+    reply->req = req;
+    reply->names = (const char **) (reply + 1);
+    reply->types = (int *) (reply->names + req->nquestions);
+
+    for (int i = 0; i < req->nquestions; ++i) {
+        reply->names[i] = req->questions[i]->name;
+        reply->types[i] = req->questions[i]->type;
+    }
+
+    dns_answer(&udp_ops, reply, req->nquestions, reply->names, reply->types);
+}
+
+static void expire_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what, (void) data;
+    nt_expire();
+}
+
+void dns_loop(uint16_t port, char *upstream_dns, int tcp_conns, char *refresh, char *ipset, char *ipset6, bool ipv6, char *policy) {
     struct event_base *base;
     struct evdns_server_port *server;
+    struct event *expire_ev;
+    struct timeval second = {1, 0};
     evutil_socket_t server_fd;
     struct sockaddr_in listenaddr;
-    struct dns_ctx *ctx = &dns_defctx;
-
-    dns_reset(ctx);
-    dns_add_serv(ctx, upstream_dns);
-    if (dns_open(ctx) < 0) {
-        perror("dns_open");
-        exit(EXIT_FAILURE);
-    }
 
     base = event_base_new();
     if (!base) {
@@ -110,6 +352,13 @@ void dns_loop(uint16_t port, char *upstream_dns, char *ipset) {
         exit(EXIT_FAILURE);
     }
 
+    up_init(upstream_dns, base, tcp_conns);
+    cache_init(base, refresh, refresh_cb);
+
+    if (policy) {
+        policy_init(policy, base);
+    }
+
     server_fd = socket(AF_INET, SOCK_DGRAM, 0);
     if (server_fd < 0) {
         perror("dns_loop: socket");
@@ -131,11 +380,19 @@ void dns_loop(uint16_t port, char *upstream_dns, char *ipset) {
         exit(EXIT_FAILURE);
     }
 
-    struct cb_data data = {ctx, ipset};
-    server = evdns_add_server_port_with_base(base, server_fd, 0, server_cb, &data);
+    data = (struct cb_data){ipset, ipset6, ipv6};
+    server = evdns_add_server_port_with_base(base, server_fd, 0, server_cb, NULL);
+    tcp_listen(base, port);
+
+    expire_ev = event_new(base, -1, EV_PERSIST, expire_cb, NULL);
+    if (!expire_ev || event_add(expire_ev, &second) < 0) {
+        perror("dns_loop: event_new");
+        exit(EXIT_FAILURE);
+    }
 
     event_base_dispatch(base);
 
+    event_free(expire_ev);
     evdns_close_server_port(server);
     event_base_free(base);
 }
@@ -2,7 +2,17 @@
 #define __DNS_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 
-void dns_loop(uint16_t, char *, char *);
+/* where the answers to a request go; err is an evdns DNS_ERR_* code */
+struct dns_reply_ops {
+    int (*add_cname)(void *, const char *, const char *, int);
+    int (*add_a)(void *, const char *, int, const void *, int);
+    int (*add_aaaa)(void *, const char *, int, const void *, int);
+    void (*respond)(void *, int);
+};
+
+void dns_answer(const struct dns_reply_ops *, void *, int, const char **, const int *);
+void dns_loop(uint16_t, char *, int, char *, char *, char *, bool, char *);
 
 #endif
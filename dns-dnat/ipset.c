@@ -46,7 +46,9 @@
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/ipset/ip_set.h>
 
-int ipset_add(const char *setname, in_addr_t ipaddr)
+#include "metrics.h"
+
+static int ipset_add_addr(const char *setname, int family, const void *addr)
 {
     struct nlmsghdr *nlh;
     struct nfgenmsg *nfg;
@@ -54,7 +56,6 @@ int ipset_add(const char *setname, in_addr_t ipaddr)
     struct nlattr *nested[2];
     char buffer[256];
     int rc;
-    struct in_addr addr = (struct in_addr){ipaddr};
 
     rc = 0;
 
@@ -68,7 +69,7 @@ int ipset_add(const char *setname, in_addr_t ipaddr)
     nlh->nlmsg_flags = NLM_F_REQUEST;
 
     nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
-    nfg->nfgen_family = AF_INET;
+    nfg->nfgen_family = family;
     nfg->version = NFNETLINK_V0;
     nfg->res_id = htons(0);
 
@@ -76,8 +77,12 @@ int ipset_add(const char *setname, in_addr_t ipaddr)
     mnl_attr_put(nlh, IPSET_ATTR_SETNAME, strlen(setname) + 1, setname);
     nested[0] = mnl_attr_nest_start(nlh, IPSET_ATTR_DATA);
     nested[1] = mnl_attr_nest_start(nlh, IPSET_ATTR_IP);
-    mnl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV4
-            | NLA_F_NET_BYTEORDER, sizeof(struct in_addr), &addr);
+    if (family == AF_INET)
+        mnl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV4
+                | NLA_F_NET_BYTEORDER, sizeof(struct in_addr), addr);
+    else
+        mnl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV6
+                | NLA_F_NET_BYTEORDER, sizeof(struct in6_addr), addr);
     mnl_attr_nest_end(nlh, nested[1]);
     mnl_attr_nest_end(nlh, nested[0]);
 
@@ -96,3 +101,22 @@ close:
     mnl_socket_close(mnl);
     return rc;
 }
+
+static int ipset_count(int rc)
+{
+    metrics_inc(M_IPSET_WRITES);
+    if (rc < 0)
+        metrics_inc(M_IPSET_FAILURES);
+    return rc;
+}
+
+int ipset_add(const char *setname, in_addr_t ipaddr)
+{
+    struct in_addr addr = (struct in_addr){ipaddr};
+    return ipset_count(ipset_add_addr(setname, AF_INET, &addr));
+}
+
+int ipset_add6(const char *setname, const struct in6_addr *addr)
+{
+    return ipset_count(ipset_add_addr(setname, AF_INET6, addr));
+}
@@ -4,5 +4,6 @@
 #include <arpa/inet.h>
 
 int ipset_add(const char *, const in_addr_t);
+int ipset_add6(const char *, const struct in6_addr *);
 
 #endif
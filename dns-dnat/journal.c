@@ -0,0 +1,247 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+/*
+ * Append-only log of NAT table changes, written through a shared mapping of
+ * the file so that a crash of the process loses nothing that was appended.
+ * The file starts with a header identifying the NAT range, followed by
+ * fixed-size records.  Every record carries a check word that is written
+ * last, so a torn or never-written record at the tail ends the replay.
+ * Periodically the live mappings are written out to a fresh file that
+ * atomically replaces the old one.
+ */
+
+#define JN_MAGIC 0x4c4e4a54414e4444ULL /* "DDNATJNL" */
+/* records the file grows by whenever it runs out of room */
+#define JN_CHUNK (1UL << 16)
+
+struct jn_header {
+    uint64_t magic;
+    uint32_t min_key;
+    uint32_t max_key;
+};
+
+static char *path = NULL;
+static int fd = -1;
+static struct jn_header *header = NULL;
+static struct jn_rec *recs;
+static uint32_t len, cap;
+
+static uint32_t jn_check(const struct jn_rec *rec) {
+    uint64_t x = ((uint64_t) rec->key << 32 | rec->val) ^ ((uint64_t) rec->expires * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return (uint32_t) x ^ (uint32_t) JN_MAGIC;
+}
+
+static void jn_map(uint32_t new_cap) {
+    size_t size = sizeof(struct jn_header) + (size_t) new_cap * sizeof(struct jn_rec);
+
+    if (ftruncate(fd, size) < 0) {
+        perror("journal: ftruncate");
+        exit(EXIT_FAILURE);
+    }
+
+    if (header) {
+        header = mremap(header, sizeof(struct jn_header) + (size_t) cap * sizeof(struct jn_rec), size, MREMAP_MAYMOVE);
+    } else {
+        header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (header == MAP_FAILED) {
+        perror("journal: mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    recs = (struct jn_rec *) (header + 1);
+    cap = new_cap;
+}
+
+static void jn_unmap(void) {
+    munmap(header, sizeof(struct jn_header) + (size_t) cap * sizeof(struct jn_rec));
+    close(fd);
+    header = NULL;
+    fd = -1;
+}
+
+void jn_open(const char *fp, uint32_t min_key, uint32_t max_key, jn_replay_fn *replay) {
+    struct stat st;
+
+    path = strdup(fp);
+    if (!path) {
+        perror("jn_open: strdup");
+        exit(EXIT_FAILURE);
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror("jn_open: open");
+        exit(EXIT_FAILURE);
+    }
+
+    cap = 0;
+    if ((size_t) st.st_size >= sizeof(struct jn_header)) {
+        cap = (st.st_size - sizeof(struct jn_header)) / sizeof(struct jn_rec);
+    }
+    jn_map(cap > 0 ? cap : JN_CHUNK);
+
+    if (header->magic != JN_MAGIC || header->min_key != min_key || header->max_key != max_key) {
+        if (header->magic != 0) {
+            fprintf(stderr, "journal `%s' does not match the NAT range; starting afresh\n", path);
+        }
+        memset(header, 0, sizeof(struct jn_header) + (size_t) cap * sizeof(struct jn_rec));
+        header->magic = JN_MAGIC;
+        header->min_key = min_key;
+        header->max_key = max_key;
+    }
+
+    for (len = 0; len < cap && recs[len].check == jn_check(&recs[len]); ++len) {
+        replay(recs[len].key, recs[len].val, recs[len].expires);
+    }
+    fprintf(stderr, "replayed %u journal records from `%s'\n", len, path);
+
+    /* anything after the first bad record is garbage from a torn write */
+    memset(recs + len, 0, (size_t) (cap - len) * sizeof(struct jn_rec));
+}
+
+void jn_put(in_addr_t key, in_addr_t val, uint32_t expires) {
+    struct jn_rec *rec;
+
+    if (!header) {
+        return;
+    }
+
+    if (len == cap) {
+        jn_map(cap + JN_CHUNK);
+    }
+
+    rec = &recs[len];
+    rec->key = key;
+    rec->val = val;
+    rec->expires = expires;
+    __atomic_store_n(&rec->check, jn_check(rec), __ATOMIC_RELEASE);
+    ++len;
+}
+
+uint32_t jn_len(void) {
+    return header ? len : 0;
+}
+
+/* makes a rename into the journal's directory survive a crash */
+static void jn_sync_dir(void) {
+    char *dir = strdup(path);
+    int dir_fd;
+
+    if (!dir) {
+        perror("jn_sync_dir: strdup");
+        return;
+    }
+    dir_fd = open(dirname(dir), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0 || fsync(dir_fd) < 0) {
+        perror("jn_sync_dir: fsync");
+    }
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    free(dir);
+}
+
+void jn_compact(struct jn_rec *live, uint32_t nlive) {
+    char *tmp_path;
+    int tmp_fd;
+    struct jn_header tmp_header;
+    size_t off, size;
+
+    if (!header) {
+        return;
+    }
+
+    tmp_path = malloc(strlen(path) + 5);
+    if (!tmp_path) {
+        perror("jn_compact: malloc");
+        return;
+    }
+    sprintf(tmp_path, "%s.new", path);
+
+    tmp_fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tmp_fd < 0) {
+        perror("jn_compact: open");
+        goto jn_compact_failure;
+    }
+
+    tmp_header = *header;
+    for (uint32_t i = 0; i < nlive; ++i) {
+        live[i].check = jn_check(&live[i]);
+    }
+
+    if (write(tmp_fd, &tmp_header, sizeof(tmp_header)) != sizeof(tmp_header)) {
+        perror("jn_compact: write");
+        goto jn_compact_failure;
+    }
+    size = (size_t) nlive * sizeof(struct jn_rec);
+    for (off = 0; off < size;) {
+        ssize_t ret = write(tmp_fd, (char *) live + off, size - off);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("jn_compact: write");
+            goto jn_compact_failure;
+        }
+        off += ret;
+    }
+
+    if (fsync(tmp_fd) < 0 || rename(tmp_path, path) < 0) {
+        perror("jn_compact: rename");
+        goto jn_compact_failure;
+    }
+    close(tmp_fd);
+    free(tmp_path);
+    jn_sync_dir();
+
+    jn_unmap();
+
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror("jn_compact: open");
+        exit(EXIT_FAILURE);
+    }
+    cap = 0;
+    jn_map(nlive + JN_CHUNK);
+    len = nlive;
+
+    fprintf(stderr, "compacted journal to %u records\n", nlive);
+    return;
+
+jn_compact_failure:
+    if (tmp_fd >= 0) {
+        close(tmp_fd);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+}
+
+void jn_sync(void) {
+    if (!header) {
+        return;
+    }
+
+    /* start writeback without waiting for it */
+    if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE) < 0) {
+        perror("jn_sync: sync_file_range");
+    }
+}
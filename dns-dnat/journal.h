@@ -0,0 +1,23 @@
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/* a record with expires == 0 removes the mapping for key */
+struct jn_rec {
+    in_addr_t key;
+    in_addr_t val;
+    uint32_t expires;
+    uint32_t check;
+};
+
+typedef void jn_replay_fn(in_addr_t, in_addr_t, uint32_t);
+
+void jn_open(const char *, uint32_t, uint32_t, jn_replay_fn *);
+void jn_put(in_addr_t, in_addr_t, uint32_t);
+uint32_t jn_len(void);
+void jn_compact(struct jn_rec *, uint32_t);
+void jn_sync(void);
+
+#endif
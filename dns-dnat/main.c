@@ -1,60 +1,152 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
 #include <pthread.h>
 
+#include "conntrack.h"
 #include "dns.h"
 #include "ipset.h"
+#include "metrics.h"
 #include "nat_table.h"
+#include "nat_table6.h"
 #include "nfqueue.h"
+#include "nft.h"
 
 struct nfq_args {
   unsigned int queue_num;
   unsigned int fwmark;
+  unsigned int ctmark;
 };
 
 void *nfq_loop_wrapper(void *data) {
     struct nfq_args *args = (struct nfq_args *) data;
-    nfq_loop(args->queue_num, args->fwmark);
+    nfq_loop(args->queue_num, args->fwmark, args->ctmark);
     return NULL;
 }
 
 int main(int argc, char **argv) {
-    struct nfq_args nfq_args;
+    struct nfq_args nfq_args = {0};
     uint16_t port;
-    pthread_t nfq_thread;
+    pthread_t nfq_thread, watch_thread;
     char *endptr = NULL;
+    char *journal = NULL, *nft_map = NULL, *shm_name = NULL, *prefix6 = NULL, *ipset6 = NULL;
+    char *policy = NULL, *refresh = NULL, *metrics_path = NULL;
+    bool deterministic = false, queue_only = false;
+    int tcp_conns = 0;
+    char **args;
+    int opt;
 
-    if (argc != 7) {
+    while ((opt = getopt(argc, argv, "6:c:dI:j:m:n:p:Qr:S:t:")) != -1) {
+        switch (opt) {
+            case '6':
+                prefix6 = optarg;
+                break;
+            case 'c':
+                endptr = NULL;
+                nfq_args.ctmark = (unsigned int) strtoul(optarg, &endptr, 0);
+                if (optarg[0] == '\0' || *endptr != '\0') {
+                    goto usage;
+                }
+                break;
+            case 'd':
+                deterministic = true;
+                break;
+            case 'I':
+                ipset6 = optarg;
+                break;
+            case 'j':
+                journal = optarg;
+                break;
+            case 'm':
+                metrics_path = optarg;
+                break;
+            case 'n':
+                nft_map = optarg;
+                break;
+            case 'p':
+                policy = optarg;
+                break;
+            case 'Q':
+                queue_only = true;
+                break;
+            case 'r':
+                refresh = optarg;
+                break;
+            case 'S':
+                shm_name = optarg;
+                break;
+            case 't':
+                endptr = NULL;
+                tcp_conns = (int) strtol(optarg, &endptr, 10);
+                if (optarg[0] == '\0' || *endptr != '\0' || tcp_conns < 1) {
+                    goto usage;
+                }
+                break;
+            default:
+                goto usage;
+        }
+    }
+
+    if (queue_only ? !shm_name || argc - optind != 2 : argc - optind != 6) {
+        goto usage;
+    }
+    /* a restarted owner clears the shared table and only the journal can
+     * fill it back in, so without one readers would lose every mapping */
+    if (shm_name && !queue_only && !journal) {
+        fprintf(stderr, "-S needs -j\n");
         goto usage;
     }
+    args = argv + optind;
 
     endptr = NULL;
-    nfq_args.queue_num = (unsigned int) strtoul(argv[1], &endptr, 10);
-    if (argv[1][0] == '\0' || *endptr != '\0') {
+    nfq_args.queue_num = (unsigned int) strtoul(args[0], &endptr, 10);
+    if (args[0][0] == '\0' || *endptr != '\0') {
         goto usage;
     }
 
     endptr = NULL;
-    nfq_args.fwmark = (unsigned int) strtoul(argv[2], &endptr, 10);
-    if (argv[2][0] == '\0' || *endptr != '\0') {
+    nfq_args.fwmark = (unsigned int) strtoul(args[1], &endptr, 10);
+    if (args[1][0] == '\0' || *endptr != '\0') {
         goto usage;
     }
 
+    if (metrics_path) {
+        metrics_init(metrics_path);
+    }
+
+    if (queue_only) {
+        nt_attach(shm_name);
+        nfq_loop(nfq_args.queue_num, nfq_args.fwmark, nfq_args.ctmark);
+        exit(EXIT_SUCCESS);
+    }
+
     endptr = NULL;
-    port = (uint16_t) strtoul(argv[5], &endptr, 10);
-    if (argv[5][0] == '\0' || *endptr != '\0') {
+    port = (uint16_t) strtoul(args[4], &endptr, 10);
+    if (args[4][0] == '\0' || *endptr != '\0') {
         goto usage;
     }
 
-    nt_init(argv[3]);
+    if (nft_map) {
+        nft_init(nft_map);
+    }
+
+    nt_init(args[2], journal, deterministic, shm_name);
+
+    if (prefix6) {
+        nt6_init(prefix6);
+    }
+
+    nfct_watch(&watch_thread);
 
     pthread_create(&nfq_thread, NULL, nfq_loop_wrapper, &nfq_args);
 
-    dns_loop(port, argv[6], argv[4]);
+    dns_loop(port, args[5], tcp_conns, refresh, args[3], ipset6, prefix6 != NULL, policy);
 
     exit(EXIT_SUCCESS);
 
 usage:
-    fprintf(stderr, "usage: %s queue_num fwmark nat_range_cidr ipset dns_port upstream_dns\n", argv[0]);
+    fprintf(stderr, "usage: %s [-6 nat_prefix6 [-I ipset6]] [-c ctmark] [-d] [-j journal [-S shm_name]] [-m metrics.sock] [-n nft_table:nft_map] [-p policy_file] [-r min_queries[:refreshes_per_second]] [-t upstream_tcp_conns] queue_num fwmark nat_range_cidr ipset dns_port upstream_dns[,upstream_dns...]\n", argv[0]);
+    fprintf(stderr, "       %s [-c ctmark] -Q -S shm_name queue_num fwmark\n", argv[0]);
     exit(EXIT_FAILURE);
 }
@@ -0,0 +1,52 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#define METRICS_PREFIX "dns_dnat_"
+
+/* X(id, name, labels, help), entries of the same name kept together */
+#define METRICS_COUNTERS(X) \
+    X(PACKETS_QUEUED, "packets_queued_total", "", "Packets read from the queue") \
+    X(PACKETS_VERDICTED, "packets_verdicted_total", "", "Verdicts sent back to the kernel") \
+    X(PACKETS_MANGLED, "packets_mangled_total", "", "Packets sent back with their destination rewritten") \
+    X(NAT_HITS, "nat_lookups_total", "result=\"hit\"", "Lookups in the NAT table") \
+    X(NAT_MISSES, "nat_lookups_total", "result=\"miss\"", "Lookups in the NAT table") \
+    X(CT_GETS, "conntrack_queries_total", "query=\"get\"", "Queries sent to conntrack") \
+    X(CT_CREATES, "conntrack_queries_total", "query=\"create\"", "Queries sent to conntrack") \
+    X(CT_UPDATES, "conntrack_queries_total", "query=\"update\"", "Queries sent to conntrack") \
+    X(CT_FAILURES, "conntrack_failures_total", "", "Conntrack entries that could not be created or marked") \
+    X(DNS_NOERROR, "dns_responses_total", "rcode=\"NOERROR\"", "Responses sent to DNS clients") \
+    X(DNS_NXDOMAIN, "dns_responses_total", "rcode=\"NXDOMAIN\"", "Responses sent to DNS clients") \
+    X(DNS_SERVFAIL, "dns_responses_total", "rcode=\"SERVFAIL\"", "Responses sent to DNS clients") \
+    X(CACHE_HITS, "dns_cache_lookups_total", "result=\"hit\"", "Questions looked up in the answer cache") \
+    X(CACHE_MISSES, "dns_cache_lookups_total", "result=\"miss\"", "Questions looked up in the answer cache") \
+    X(UPSTREAM_FAILURES, "upstream_failures_total", "", "Upstream queries that failed outright") \
+    X(UPSTREAM_HEDGES, "upstream_hedges_total", "", "Lookups also sent to a second upstream") \
+    X(IPSET_WRITES, "ipset_writes_total", "", "Addresses sent to be added to an ipset") \
+    X(IPSET_FAILURES, "ipset_write_failures_total", "", "Addresses that could not be added to an ipset")
+
+#define METRICS_GAUGES(X) \
+    X(NAT_ENTRIES, "nat_table_entries", "", "IPv4 mappings in the NAT table")
+
+/* X(id, name, help) */
+#define METRICS_HISTOGRAMS(X) \
+    X(CT_QUERY, "conntrack_query_seconds", "Time taken by queries to conntrack") \
+    X(UPSTREAM, "upstream_response_seconds", "Time taken by upstreams to answer")
+
+#define METRICS_ENUM(id, ...) M_##id,
+enum metrics_counter {METRICS_COUNTERS(METRICS_ENUM) M_COUNTERS};
+enum metrics_gauge {METRICS_GAUGES(METRICS_ENUM) M_GAUGES};
+enum metrics_histogram {METRICS_HISTOGRAMS(METRICS_ENUM) M_HISTOGRAMS};
+#undef METRICS_ENUM
+
+void metrics_init(char *);
+void metrics_queue(unsigned int);
+void metrics_inc(enum metrics_counter);
+void metrics_add(enum metrics_counter, uint64_t);
+void metrics_set(enum metrics_gauge, int64_t);
+void metrics_omit(enum metrics_gauge);
+void metrics_observe(enum metrics_histogram, uint64_t);
+uint64_t metrics_now(void);
+
+#endif
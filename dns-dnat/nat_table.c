@@ -2,246 +2,733 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <arpa/inet.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "metrics.h"
+#include "nat_table.h"
+#include "nft.h"
+
+/*
+ * Two open-addressing (linear probing) hash maps, one from synthetic to real
+ * addresses and one from real to synthetic addresses.  Each slot packs the
+ * key into the upper and the value into the lower 32 bits; an all-zero slot
+ * is empty.  The pool may not contain 0.0.0.0, so every slot in use has a
+ * nonzero synthetic address in one half or the other, even for a real address
+ * of 0.0.0.0.  Both maps are sized for the whole NAT pool up front and never
+ * grow, which is why the pool is limited to a /12 (48 MiB in all).
+ *
+ * Only the DNS thread writes, serialised by `mutex'.  The packet thread reads
+ * the synthetic->real map without locking: writers bump `seq' to an odd value
+ * for the duration of a modification, and readers retry if they saw an odd
+ * value or if it changed underneath them (a seqlock over the whole table).
+ *
+ * Every address in the pool also has an `entry' recording when the last DNS
+ * answer handing it out expires and how many conntrack flows are still using
+ * it.  Mapped entries sit on a timer wheel keyed by expiry; once an entry has
+ * expired and has no flows left, its mapping is dropped and the address goes
+ * onto a free list, which is preferred over untouched addresses.
+ *
+ * If a journal is configured, every change is appended to it and the table
+ * is rebuilt from it on startup (see journal.c).  Mappings are also mirrored
+ * into an nftables map if one is configured (see nft.c).
+ *
+ * In deterministic mode, a real address is instead placed at a position in
+ * the pool given by a consistent hash of the address, or one of the next few
+ * positions if that is taken, so that independent instances (or one instance
+ * after losing its state) agree on nearly all mappings.  Released addresses
+ * then simply become free in place and there is no free list.
+ *
+ * The synthetic->real map and the seqlock counter can instead be placed in a
+ * named shared memory object (see nt_init() and nt_attach()).  The process
+ * owning the table keeps writing to it as usual, and any number of other
+ * processes can map it read-only and call nt_lookup() on it directly.  Only
+ * one process may own a given table at a time, which is enforced by a lock on
+ * the object.
+ */
+
+/* the largest NAT pool, as a prefix length */
+#define NT_MIN_BITS 12
+
+/* seconds an address is kept after the TTL of the last answer has expired */
+#define NT_GRACE 30
+/* seconds to wait before checking again on an expired address with flows */
+#define NT_RECHECK 60
+/* longest TTL honoured, so that the timer wheel does not spin forever */
+#define NT_MAX_TTL (7 * 24 * 60 * 60)
+
+#define WHEEL_SLOTS 4096
+
+/* positions tried in deterministic mode before allocating anywhere */
+#define NT_PROBES 16
+
+/* journal records allowed beyond twice the live mappings before compacting */
+#define JN_SLACK (1UL << 16)
+/* seconds between kicking off writeback of the journal */
+#define JN_SYNC_INTERVAL 5
+
+#define SHM_MAGIC 0x444e4154UL
+
+#define SLOT(key, val) (((uint64_t) (key) << 32) | (uint32_t) (val))
+#define SLOT_KEY(slot) ((in_addr_t) ((slot) >> 32))
+#define SLOT_VAL(slot) ((in_addr_t) (slot))
+
+struct map {
+    _Atomic uint64_t *slots;
+    uint32_t mask;
+};
 
-#define HASH(x) (x >> 24)
-
-struct index {
-    uint8_t bin;
-    uint16_t idx;
+struct entry {
+    /* zero if the address is not mapped */
+    uint32_t expires;
+    /* the expiry last written to the journal */
+    uint32_t journaled;
+    /* 1-based index of the next entry in the same wheel slot or free list */
+    uint32_t next;
+    atomic_uint flows;
 };
 
-static in_addr_t *keys[256] = {0}, *vals[256] = {0};
-static uint16_t bin_len[256] = {0};
-static uint8_t bin_space[256] = {0};
-static struct index *val_sort = NULL;
-static uint8_t val_space = 0;
-static uint32_t total_len = 0;
+/* start of the shared memory object, followed by the slots of `fwd' */
+struct shm_hdr {
+    uint32_t magic;
+    uint32_t min_key;
+    uint32_t max_key;
+    uint32_t mask;
+    atomic_uint seq;
+} __attribute__((aligned(64)));
+
+_Static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+        "the shared table needs address-free atomics");
+
+static struct map fwd, rev;
+static atomic_uint private_seq = 0;
+static atomic_uint *seq = &private_seq;
+
+static struct entry *entries;
+static uint32_t wheel[WHEEL_SLOTS] = {0};
+static uint32_t last_tick;
+static uint32_t free_head = 0;
+static uint32_t live = 0;
 
-static uint32_t next_new_key;
+static bool deterministic = false;
+
+static uint64_t next_new_key;
+static uint32_t first_key;
 static uint32_t max_key;
 static uint32_t min_key;
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void nt_init(char *cidr) {
-    uint8_t b3, b2, b1, b0, bits;
-    uint32_t mask;
+static inline uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bUL;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35UL;
+    x ^= x >> 16;
+    return x;
+}
 
-    if (sscanf(cidr, "%hhu.%hhu.%hhu.%hhu/%hhu", &b3, &b2, &b1, &b0, &bits) < 5 || bits > 32) {
-        fprintf(stderr, "failed to parse NAT range CIDR\n");
+static void map_init(struct map *map, uint32_t nslots) {
+    map->slots = calloc(nslots, sizeof(uint64_t));
+    if (!map->slots) {
+        perror("nt_init: calloc");
         exit(EXIT_FAILURE);
     }
+    map->mask = nslots - 1;
+}
 
-    next_new_key = (b3 << 24UL) | (b2 << 16UL) | (b1 << 8UL) | b0;
+static inline uint64_t slot_get(const struct map *map, uint32_t i) {
+    return atomic_load_explicit(&map->slots[i], memory_order_relaxed);
+}
 
-    mask = (0xFFFFFFFFUL << (32 - bits)) & 0xFFFFFFFFUL;
-    min_key = next_new_key & mask;
-    max_key = next_new_key | (~mask);
+static inline void slot_set(struct map *map, uint32_t i, uint64_t slot) {
+    atomic_store_explicit(&map->slots[i], slot, memory_order_relaxed);
 }
 
-static void _nt_add(in_addr_t key, in_addr_t val, bool lock) {
-    uint16_t idx;
-    uint8_t bin = HASH(key);
-    char s_key[16], s_val[16];
-    int32_t val_startidx = total_len;
+static in_addr_t map_get(const struct map *map, in_addr_t key) {
+    for (uint32_t i = hash(key) & map->mask;; i = (i + 1) & map->mask) {
+        uint64_t slot = slot_get(map, i);
+        if (slot == 0) {
+            return (in_addr_t) -1;
+        }
+        if (SLOT_KEY(slot) == key) {
+            return SLOT_VAL(slot);
+        }
+    }
+}
 
-    inet_ntop(AF_INET, &key, s_key, 16);
-    inet_ntop(AF_INET, &val, s_val, 16);
-    fprintf(stderr, "adding DNAT from %s to %s\n", s_key, s_val);
+static void map_put(struct map *map, in_addr_t key, in_addr_t val) {
+    uint32_t i = hash(key) & map->mask;
+    while (slot_get(map, i) != 0 && SLOT_KEY(slot_get(map, i)) != key) {
+        i = (i + 1) & map->mask;
+    }
+    slot_set(map, i, SLOT(key, val));
+}
 
-    if (lock) pthread_mutex_lock(&mutex);
+static void map_del(struct map *map, in_addr_t key) {
+    uint32_t i = hash(key) & map->mask;
 
-    if (bin_space[bin] == 0) {
-        keys[bin] = realloc(keys[bin], (bin_len[bin] + 2) * sizeof(in_addr_t));
-        vals[bin] = realloc(vals[bin], (bin_len[bin] + 2) * sizeof(in_addr_t));
-        if (!keys[bin] || !vals[bin]) {
-            perror("nt_add: realloc");
-            exit(EXIT_FAILURE);
+    for (;; i = (i + 1) & map->mask) {
+        uint64_t slot = slot_get(map, i);
+        if (slot == 0) {
+            return;
+        }
+        if (SLOT_KEY(slot) == key) {
+            break;
         }
-        bin_space[bin] = 2;
     }
 
-    idx = 0;
-    if (bin_len[bin] > 0) {
-        int32_t l = 0, r = bin_len[bin] - 1;
-        while (l <= r) {
-            idx = (l + r) / 2;
-            if (keys[bin][idx] == key) {
-                goto val_find_startpos;
-            } else if (keys[bin][idx] < key) {
-                l = idx + 1;
-            } else {
-                r = idx - 1;
+    /* backward-shift deletion, so that lookups never need tombstones */
+    for (uint32_t j = i;;) {
+        slot_set(map, i, 0);
+        for (;;) {
+            j = (j + 1) & map->mask;
+            if (slot_get(map, j) == 0) {
+                return;
+            }
+            uint32_t home = hash(SLOT_KEY(slot_get(map, j))) & map->mask;
+            if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+                break;
             }
         }
-        if (keys[bin][idx] < key) {
-            ++idx;
-        }
+        slot_set(map, i, slot_get(map, j));
+        i = j;
     }
+}
+
+/* must be called with `mutex' held */
+static inline void write_begin(void) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
 
-    for (uint16_t i = bin_len[bin]; i > idx; --i) {
-        keys[bin][i] = keys[bin][i-1];
-        vals[bin][i] = vals[bin][i-1];
+static inline void write_end(void) {
+    atomic_store_explicit(seq, atomic_load_explicit(seq, memory_order_relaxed) + 1, memory_order_release);
+}
+
+static inline struct entry *nt_entry(in_addr_t key) {
+    uint32_t addr = ntohl(key);
+    if (addr < min_key || addr > max_key) {
+        return NULL;
     }
+    return &entries[addr - min_key];
+}
 
-    ++total_len;
-    ++bin_len[bin];
-    --bin_space[bin];
+static void wheel_insert(uint32_t idx, uint32_t when) {
+    uint32_t slot = when % WHEEL_SLOTS;
+    entries[idx].next = wheel[slot];
+    wheel[slot] = idx + 1;
+}
 
-    if (val_space == 0) {
-        val_sort = realloc(val_sort, (total_len + 32) * sizeof(struct index));
-        if (!val_sort) {
-            perror("nt_add: realloc");
-            exit(EXIT_FAILURE);
-        }
-        val_space = 32;
+static void nt_unmap(in_addr_t key) {
+    in_addr_t val = map_get(&fwd, key);
+    if (val != (in_addr_t) -1) {
+        map_del(&fwd, key);
+        map_del(&rev, val);
     }
+    nt_entry(key)->expires = 0;
+}
 
-    goto val_sort;
+/* runs single-threaded from nt_init, before anyone else can see the table */
+static void nt_replay(in_addr_t key, in_addr_t val, uint32_t expires) {
+    struct entry *e = nt_entry(key);
+    in_addr_t old_key;
 
-val_find_startpos:
+    if (!e) {
+        return;
+    }
 
-    {
-        int32_t l = 0, r = total_len - 1, diff = 0;
-        struct index vi = {0, 0};
-        while (l <= r) {
-            val_startidx = (l + r) / 2;
-            vi = val_sort[val_startidx];
-            if (vals[vi.bin][vi.idx] == vals[bin][idx]) {
-                break;
-            } else if (vals[vi.bin][vi.idx] < vals[bin][idx]) {
-                l = val_startidx + 1;
-            } else {
-                r = val_startidx - 1;
-            }
+    nt_unmap(key);
+    if (expires == 0) {
+        return;
+    }
+
+    old_key = map_get(&rev, val);
+    if (old_key != (in_addr_t) -1) {
+        nt_unmap(old_key);
+    }
+
+    map_put(&fwd, key, val);
+    map_put(&rev, val, key);
+    e->expires = e->journaled = expires;
+}
+
+/* recreate the timer wheel and free list after replaying the journal */
+static void nt_rebuild(void) {
+    uint32_t now = time(NULL);
+    uint32_t start = next_new_key - min_key;
+    int64_t highest = -1;
+
+    for (uint32_t idx = 0; idx <= max_key - min_key; ++idx) {
+        if (entries[idx].expires) {
+            in_addr_t key = htonl(min_key + idx);
+            wheel_insert(idx, (int32_t) (entries[idx].expires - now) > 0 ? entries[idx].expires : now + 1);
+            nft_put(key, map_get(&fwd, key));
+            ++live;
+            highest = idx;
         }
-        while (vals[vi.bin][vi.idx] == vals[bin][idx]) {
-            if (vi.bin == bin && vi.idx == idx) {
-                val_startidx += diff;
-                goto val_sort;
-            }
-            --diff;
-            vi = val_sort[val_startidx + diff];
-        }
-        diff = 1;
-        while (vals[vi.bin][vi.idx] == vals[bin][idx]) {
-            if (vi.bin == bin && vi.idx == idx) {
-                val_startidx += diff;
-                goto val_sort;
-            }
-            ++diff;
-            vi = val_sort[val_startidx + diff];
+    }
+    nft_commit();
+
+    for (int64_t idx = highest - 1; !deterministic && idx >= start; --idx) {
+        if (!entries[idx].expires) {
+            entries[idx].next = free_head;
+            free_head = idx + 1;
         }
-        fprintf(stderr, "NAT table is in a state that shouldn't be possible\n");
+    }
+
+    if (highest >= 0 && min_key + (uint64_t) highest >= next_new_key) {
+        next_new_key = min_key + highest + 1;
+    }
+
+    fprintf(stderr, "restored %u NAT mappings\n", live);
+    metrics_set(M_NAT_ENTRIES, live);
+}
+
+static size_t shm_size(uint32_t nslots) {
+    return sizeof(struct shm_hdr) + (size_t) nslots * sizeof(uint64_t);
+}
+
+static bool shm_matches(const struct shm_hdr *hdr) {
+    return hdr->magic == SHM_MAGIC && hdr->min_key == min_key && hdr->max_key == max_key && hdr->mask == fwd.mask;
+}
+
+static struct shm_hdr *shm_map(int fd, int prot, size_t size) {
+    void *addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        perror("nt_init: mmap");
         exit(EXIT_FAILURE);
     }
+    return addr;
+}
 
-val_sort:
+/* returns the shared memory object `name' sized for `nslots', exclusively locked */
+static struct shm_hdr *shm_create(const char *name, uint32_t nslots) {
+    struct shm_hdr *hdr;
+    struct stat st;
+    int fd;
 
-    (void) 0;
-    int32_t val_idx = 0;
-    if (total_len > 1) {
-        int32_t l = 0, r = total_len - 2;
-        struct index vi = {0, 0};
-        while (l <= r) {
-            val_idx = (l + r) / 2;
-            vi = val_sort[val_idx];
-            if (vals[vi.bin][vi.idx] <= val) {
-                l = val_idx + 1;
-            } else {
-                r = val_idx - 1;
-            }
-        }
-        if (vals[vi.bin][vi.idx] <= val) {
-            ++val_idx;
+    fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("nt_init: shm_open");
+        exit(EXIT_FAILURE);
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK) {
+            fprintf(stderr, "NAT table %s is already owned by another process\n", name);
+        } else {
+            perror("nt_init: flock");
         }
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("nt_init: fstat");
+        exit(EXIT_FAILURE);
     }
 
-    if (val_idx < val_startidx) {
-        for (int32_t i = val_startidx; i > val_idx; --i) {
-            val_sort[i] = val_sort[i-1];
+    /* reuse a table left behind by a previous owner, so that attached
+     * readers keep working; otherwise start over with a fresh object, since
+     * shrinking one that readers have mapped would crash them */
+    if ((size_t) st.st_size == shm_size(nslots)) {
+        hdr = shm_map(fd, PROT_READ | PROT_WRITE, shm_size(nslots));
+        if (shm_matches(hdr)) {
+            /* the lock is never given up, so keep the descriptor open */
+            return hdr;
         }
-    } else {
-        for (int32_t i = val_startidx; i < val_idx; ++i) {
-            val_sort[i] = val_sort[i+1];
+        munmap(hdr, shm_size(nslots));
+    }
+    if (st.st_size != 0) {
+        fprintf(stderr, "NAT table %s has a different range, recreating it; restart any readers\n", name);
+        close(fd);
+        if (shm_unlink(name) < 0) {
+            perror("nt_init: shm_unlink");
+            exit(EXIT_FAILURE);
         }
+        return shm_create(name, nslots);
+    }
+
+    if (ftruncate(fd, shm_size(nslots)) < 0) {
+        perror("nt_init: ftruncate");
+        exit(EXIT_FAILURE);
     }
+    return shm_map(fd, PROT_READ | PROT_WRITE, shm_size(nslots));
+}
+
+static void nt_share(const char *name, uint32_t nslots) {
+    struct shm_hdr *hdr;
+    unsigned int s;
 
-    keys[bin][idx] = key;
-    vals[bin][idx] = val;
-    val_sort[val_idx] = (struct index){bin, idx};
+    fwd.mask = nslots - 1;
+    hdr = shm_create(name, nslots);
+    s = atomic_load_explicit(&hdr->seq, memory_order_relaxed);
 
-    if (lock) pthread_mutex_unlock(&mutex);
+    /* keep readers out until the table has been rebuilt; a previous owner
+     * may have died in the middle of a write, leaving the count odd */
+    atomic_store_explicit(&hdr->seq, s | 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    fwd.slots = (_Atomic uint64_t *) (hdr + 1);
+    memset((void *) fwd.slots, 0, (size_t) nslots * sizeof(uint64_t));
+    seq = &hdr->seq;
+
+    hdr->min_key = min_key;
+    hdr->max_key = max_key;
+    hdr->mask = fwd.mask;
+    atomic_thread_fence(memory_order_release);
+    hdr->magic = SHM_MAGIC;
 }
 
-void nt_add(in_addr_t key, in_addr_t val) {
-    _nt_add(key, val, true);
+void nt_init(char *cidr, char *journal, bool deterministic_alloc, char *shm_name) {
+    uint8_t b3, b2, b1, b0, bits;
+    uint32_t mask, nslots;
+
+    if (sscanf(cidr, "%hhu.%hhu.%hhu.%hhu/%hhu", &b3, &b2, &b1, &b0, &bits) < 5 || bits > 32) {
+        fprintf(stderr, "failed to parse NAT range CIDR\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bits < NT_MIN_BITS) {
+        fprintf(stderr, "NAT range CIDR must be at most a /%d\n", NT_MIN_BITS);
+        exit(EXIT_FAILURE);
+    }
+
+    next_new_key = first_key = (b3 << 24UL) | (b2 << 16UL) | (b1 << 8UL) | b0;
+    deterministic = deterministic_alloc;
+
+    mask = (0xFFFFFFFFUL << (32 - bits)) & 0xFFFFFFFFUL;
+    min_key = next_new_key & mask;
+    max_key = next_new_key | (~mask);
+    if (min_key == 0) {
+        fprintf(stderr, "NAT range CIDR must not contain 0.0.0.0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* keep the load factor of a full pool at or below one half */
+    for (nslots = 16; nslots / 2 < max_key - min_key + 1; nslots <<= 1);
+    if (shm_name) {
+        nt_share(shm_name, nslots);
+    } else {
+        map_init(&fwd, nslots);
+    }
+    map_init(&rev, nslots);
+
+    entries = calloc((uint64_t) max_key - min_key + 1, sizeof(struct entry));
+    if (!entries) {
+        perror("nt_init: calloc");
+        exit(EXIT_FAILURE);
+    }
+    last_tick = time(NULL);
+
+    if (journal) {
+        jn_open(journal, min_key, max_key, nt_replay);
+        nt_rebuild();
+    }
+
+    if (shm_name) {
+        write_end();
+    }
+}
+
+void nt_attach(char *shm_name) {
+    struct shm_hdr *hdr;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(shm_name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror("nt_attach: shm_open");
+        exit(EXIT_FAILURE);
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("nt_attach: fstat");
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t) st.st_size < sizeof(struct shm_hdr)) {
+        fprintf(stderr, "NAT table %s has not been set up yet\n", shm_name);
+        exit(EXIT_FAILURE);
+    }
+
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (hdr == MAP_FAILED) {
+        perror("nt_attach: mmap");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    if (hdr->magic != SHM_MAGIC || (size_t) st.st_size != shm_size(hdr->mask + 1)) {
+        fprintf(stderr, "NAT table %s has not been set up yet\n", shm_name);
+        exit(EXIT_FAILURE);
+    }
+    atomic_thread_fence(memory_order_acquire);
+
+    fwd.slots = (_Atomic uint64_t *) (hdr + 1);
+    fwd.mask = hdr->mask;
+    seq = &hdr->seq;
+    min_key = hdr->min_key;
+    max_key = hdr->max_key;
+
+    /* the owner counts the entries; here it would only ever read 0 */
+    metrics_omit(M_NAT_ENTRIES);
+}
+
+void nt_range(uint32_t *min, uint32_t *max) {
+    *min = min_key;
+    *max = max_key;
+}
+
+static void nt_add(in_addr_t key, in_addr_t val) {
+    char s_key[16], s_val[16];
+
+    inet_ntop(AF_INET, &key, s_key, 16);
+    inet_ntop(AF_INET, &val, s_val, 16);
+    fprintf(stderr, "adding DNAT from %s to %s\n", s_key, s_val);
+
+    write_begin();
+    map_put(&fwd, key, val);
+    write_end();
+
+    map_put(&rev, val, key);
 }
 
 in_addr_t nt_lookup(in_addr_t key) {
-    in_addr_t ret = (in_addr_t) -1;
-    uint8_t bin = HASH(key);
+    in_addr_t ret;
+    unsigned int s0, s1;
+
+    do {
+        s0 = atomic_load_explicit(seq, memory_order_acquire);
+        ret = map_get(&fwd, key);
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(seq, memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+
+    return ret;
+}
+
+static void nt_release(uint32_t idx) {
+    char s_key[16], s_val[16];
+    in_addr_t key = htonl(min_key + idx);
+    in_addr_t val = map_get(&fwd, key);
+
+    inet_ntop(AF_INET, &key, s_key, 16);
+    inet_ntop(AF_INET, &val, s_val, 16);
+    fprintf(stderr, "releasing DNAT from %s to %s\n", s_key, s_val);
+
+    write_begin();
+    map_del(&fwd, key);
+    write_end();
+
+    map_del(&rev, val);
+
+    jn_put(key, 0, 0);
+    nft_del(key);
+    --live;
+    metrics_set(M_NAT_ENTRIES, live);
+
+    entries[idx].expires = 0;
+    if (!deterministic) {
+        entries[idx].next = free_head;
+        free_head = idx + 1;
+    }
+}
+
+/* Lamping and Veach, "A Fast, Minimal Memory, Consistent Hash Algorithm" */
+static uint32_t jump_hash(uint64_t key, uint32_t nbuckets) {
+    int64_t b = -1, j = 0;
+
+    while (j < nbuckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1));
+    }
+
+    return b;
+}
+
+static int64_t nt_alloc_deterministic(in_addr_t val) {
+    uint32_t start = first_key - min_key;
+    uint32_t npool = max_key - first_key + 1;
+    /* hash the address in host order so that the result is portable */
+    uint64_t h = ((uint64_t) hash(ntohl(val)) << 32) | hash(~ntohl(val));
+    uint32_t home = jump_hash(h, npool);
+
+    for (uint32_t i = 0; i < NT_PROBES && i < npool; ++i) {
+        uint32_t idx = start + (home + i) % npool;
+        if (!entries[idx].expires) {
+            return idx;
+        }
+    }
+
+    /* the neighbourhood is full, so take the next free address anywhere */
+    for (uint32_t i = 0; i < npool; ++i) {
+        uint32_t idx = next_new_key - min_key;
+        next_new_key = next_new_key < max_key ? next_new_key + 1 : first_key;
+        if (!entries[idx].expires) {
+            return idx;
+        }
+    }
+
+    return -1;
+}
+
+static int64_t nt_alloc(in_addr_t val) {
+    uint32_t idx;
+
+    if (deterministic) {
+        return nt_alloc_deterministic(val);
+    }
+
+    if (free_head) {
+        idx = free_head - 1;
+        free_head = entries[idx].next;
+        return idx;
+    }
+
+    if (next_new_key <= max_key) {
+        return next_new_key++ - min_key;
+    }
+
+    return -1;
+}
+
+static void nt_compact(void) {
+    struct jn_rec *recs;
+    uint32_t n = 0;
+
+    recs = malloc((size_t) live * sizeof(struct jn_rec));
+    if (!recs) {
+        perror("nt_compact: malloc");
+        return;
+    }
+
+    for (uint32_t idx = 0; idx <= max_key - min_key; ++idx) {
+        if (entries[idx].expires) {
+            in_addr_t key = htonl(min_key + idx);
+            recs[n++] = (struct jn_rec){key, map_get(&fwd, key), entries[idx].expires, 0};
+            entries[idx].journaled = entries[idx].expires;
+        }
+    }
+
+    jn_compact(recs, n);
+    free(recs);
+}
+
+in_addr_t nt_reverse_lookup(in_addr_t val, uint32_t ttl) {
+    in_addr_t ret;
+    int64_t idx;
+    uint32_t expires;
+
+    if (ttl > NT_MAX_TTL) {
+        ttl = NT_MAX_TTL;
+    }
+    expires = (uint32_t) time(NULL) + ttl + NT_GRACE;
 
     pthread_mutex_lock(&mutex);
 
-    if (keys[bin]) {
-        int32_t l = 0, r = bin_len[bin] - 1;
-        while (l <= r) {
-            uint16_t m = (l + r) / 2;
-            if (keys[bin][m] == key) {
-                ret = vals[bin][m];
-                break;
-            } else if (keys[bin][m] < key) {
-                l = m + 1;
-            } else {
-                r = m - 1;
-            }
+    ret = map_get(&rev, val);
+    if (ret != (in_addr_t) -1) {
+        struct entry *e = nt_entry(ret);
+        if (expires > e->expires) {
+            e->expires = expires;
         }
+        if (e->expires >= e->journaled + NT_GRACE) {
+            jn_put(ret, val, e->expires);
+            e->journaled = e->expires;
+        }
+        goto finish;
+    }
+
+    idx = nt_alloc(val);
+    if (idx < 0) {
+        fprintf(stderr, "ran out of IP addresses in the NAT range\n");
+        goto finish;
     }
 
+    ret = htonl(min_key + idx);
+
+    nt_add(ret, val);
+    jn_put(ret, val, expires);
+    nft_put(ret, val);
+    nft_commit();
+    ++live;
+    metrics_set(M_NAT_ENTRIES, live);
+
+    entries[idx].expires = entries[idx].journaled = expires;
+    wheel_insert(idx, expires);
+
+finish:
     pthread_mutex_unlock(&mutex);
 
     return ret;
 }
 
-in_addr_t nt_reverse_lookup(in_addr_t val) {
-    in_addr_t ret;
+void nt_expire(void) {
+    uint32_t now = time(NULL);
 
     pthread_mutex_lock(&mutex);
 
-    if (val_sort) {
-        int32_t l = 0, r = total_len - 1;
-        while (l <= r) {
-            uint32_t m = (l + r) / 2;
-            struct index vi = val_sort[m];
-            if (vals[vi.bin][vi.idx] == val) {
-                ret = keys[vi.bin][vi.idx];
-                goto finish;
-            } else if (vals[vi.bin][vi.idx] < val) {
-                l = m + 1;
+    if ((int32_t) (now - last_tick) > WHEEL_SLOTS) {
+        last_tick = now - WHEEL_SLOTS;
+    }
+
+    while ((int32_t) (now - last_tick) > 0) {
+        uint32_t slot = ++last_tick % WHEEL_SLOTS;
+        uint32_t list = wheel[slot];
+
+        wheel[slot] = 0;
+        while (list) {
+            uint32_t idx = list - 1;
+            struct entry *e = &entries[idx];
+
+            list = e->next;
+            if ((int32_t) (e->expires - last_tick) > 0) {
+                wheel_insert(idx, e->expires);
+            } else if (atomic_load_explicit(&e->flows, memory_order_relaxed) > 0) {
+                wheel_insert(idx, last_tick + NT_RECHECK);
             } else {
-                r = m - 1;
+                nt_release(idx);
             }
         }
+
+        if (last_tick % JN_SYNC_INTERVAL == 0) {
+            jn_sync();
+        }
     }
+    nft_commit();
 
-    if (next_new_key > max_key) {
-        fprintf(stderr, "ran out of IP addresses; looping around\n");
-        next_new_key = min_key;
+    if (jn_len() > 2 * (uint64_t) live + JN_SLACK) {
+        nt_compact();
     }
 
-    ret = htonl(next_new_key);
+    pthread_mutex_unlock(&mutex);
+}
 
-    _nt_add(ret, val, false);
+void nt_flow_new(in_addr_t key) {
+    struct entry *e = nt_entry(key);
+    if (e) {
+        atomic_fetch_add_explicit(&e->flows, 1, memory_order_relaxed);
+    }
+}
 
-    ++next_new_key;
+void nt_flow_destroy(in_addr_t key) {
+    struct entry *e = nt_entry(key);
+    unsigned int flows;
 
-finish:
-    pthread_mutex_unlock(&mutex);
+    if (!e) {
+        return;
+    }
 
-    return ret;
+    /* conntrack.c only uncounts flows it counted; this is just a backstop */
+    flows = atomic_load_explicit(&e->flows, memory_order_relaxed);
+    while (flows > 0 && !atomic_compare_exchange_weak_explicit(&e->flows, &flows, flows - 1,
+                memory_order_relaxed, memory_order_relaxed));
 }
@@ -1,10 +1,17 @@
 #ifndef __NAT_TABLE_H__
 #define __NAT_TABLE_H__
 
+#include <stdint.h>
+#include <stdbool.h>
 #include <arpa/inet.h>
 
-int nt_init(char *);
+void nt_init(char *, char *, bool, char *);
+void nt_attach(char *);
+void nt_range(uint32_t *, uint32_t *);
 in_addr_t nt_lookup(in_addr_t);
-in_addr_t nt_reverse_lookup(in_addr_t);
+in_addr_t nt_reverse_lookup(in_addr_t, uint32_t);
+void nt_expire(void);
+void nt_flow_new(in_addr_t);
+void nt_flow_destroy(in_addr_t);
 
 #endif
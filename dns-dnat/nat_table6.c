@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+
+#include "nat_table6.h"
+
+/*
+ * The IPv6 counterpart of nat_table.c, kept much simpler: synthetic addresses
+ * are the prefix with the 1-based index of an entry in the last 32 bits, so
+ * the synthetic->real direction is a plain array lookup, and a small
+ * open-addressing map of entry indices handles real->synthetic.  There is a
+ * fixed number of entries, handed out round-robin; an entry is only reused
+ * once the last answer containing it has been expired for NT6_HOLD seconds.
+ * Flows that were already set up by then are unaffected, since conntrack
+ * keeps their translation.
+ *
+ * As in nat_table.c, only the DNS thread writes, under `mutex', and the packet
+ * thread reads entries under a seqlock.
+ */
+
+#define NT6_CAPACITY (1UL << 16)
+/* seconds an entry is kept after the TTL of the last answer has expired */
+#define NT6_HOLD (24 * 60 * 60)
+#define NT6_MAX_TTL (7 * 24 * 60 * 60)
+
+struct entry6 {
+    /* the real address, as two words so that readers can load it atomically */
+    _Atomic uint64_t val[2];
+    /* zero if unused */
+    uint32_t expires;
+};
+
+static struct in6_addr prefix;
+static struct entry6 *entries = NULL;
+static uint32_t capacity = 0;
+static uint32_t cursor = 0;
+
+/* real address -> 1-based entry index, zero if empty */
+static uint32_t *rev;
+static uint32_t rev_mask;
+
+static atomic_uint seq = 0;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline uint32_t hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bUL;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35UL;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint32_t hash6(const struct in6_addr *addr) {
+    uint32_t h = 0;
+    for (int i = 0; i < 4; ++i) {
+        h = hash(h ^ addr->s6_addr32[i]);
+    }
+    return h;
+}
+
+static inline void entry_get(const struct entry6 *e, struct in6_addr *val) {
+    uint64_t w[2] = {
+        atomic_load_explicit(&e->val[0], memory_order_relaxed),
+        atomic_load_explicit(&e->val[1], memory_order_relaxed),
+    };
+    memcpy(val, w, sizeof(w));
+}
+
+static inline void entry_set(struct entry6 *e, const struct in6_addr *val) {
+    uint64_t w[2];
+    memcpy(w, val, sizeof(w));
+    atomic_store_explicit(&e->val[0], w[0], memory_order_relaxed);
+    atomic_store_explicit(&e->val[1], w[1], memory_order_relaxed);
+}
+
+static uint32_t rev_get(const struct in6_addr *val) {
+    struct in6_addr cur;
+
+    for (uint32_t i = hash6(val) & rev_mask;; i = (i + 1) & rev_mask) {
+        if (rev[i] == 0) {
+            return 0;
+        }
+        entry_get(&entries[rev[i] - 1], &cur);
+        if (IN6_ARE_ADDR_EQUAL(&cur, val)) {
+            return rev[i];
+        }
+    }
+}
+
+static void rev_put(const struct in6_addr *val, uint32_t n) {
+    uint32_t i = hash6(val) & rev_mask;
+    while (rev[i] != 0) {
+        i = (i + 1) & rev_mask;
+    }
+    rev[i] = n;
+}
+
+static void rev_del(const struct in6_addr *val) {
+    struct in6_addr cur;
+    uint32_t i = hash6(val) & rev_mask;
+
+    for (;; i = (i + 1) & rev_mask) {
+        if (rev[i] == 0) {
+            return;
+        }
+        entry_get(&entries[rev[i] - 1], &cur);
+        if (IN6_ARE_ADDR_EQUAL(&cur, val)) {
+            break;
+        }
+    }
+
+    /* backward-shift deletion, as in nat_table.c */
+    for (uint32_t j = i;;) {
+        rev[i] = 0;
+        for (;;) {
+            j = (j + 1) & rev_mask;
+            if (rev[j] == 0) {
+                return;
+            }
+            entry_get(&entries[rev[j] - 1], &cur);
+            uint32_t home = hash6(&cur) & rev_mask;
+            if (((j - home) & rev_mask) >= ((j - i) & rev_mask)) {
+                break;
+            }
+        }
+        rev[i] = rev[j];
+        i = j;
+    }
+}
+
+void nt6_init(char *cidr) {
+    char addr[INET6_ADDRSTRLEN];
+    unsigned int bits;
+    char *sep = strchr(cidr, '/');
+
+    if (!sep || sep - cidr >= INET6_ADDRSTRLEN || sscanf(sep + 1, "%u", &bits) < 1) {
+        fprintf(stderr, "failed to parse IPv6 NAT prefix\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(addr, cidr, sep - cidr);
+    addr[sep - cidr] = '\0';
+    if (inet_pton(AF_INET6, addr, &prefix) != 1) {
+        fprintf(stderr, "failed to parse IPv6 NAT prefix\n");
+        exit(EXIT_FAILURE);
+    }
+    if (bits > 96) {
+        fprintf(stderr, "IPv6 NAT prefix must be at most a /96\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* only the bits above the prefix length count */
+    for (unsigned int i = bits; i < 128; ++i) {
+        prefix.s6_addr[i / 8] &= ~(0x80 >> (i % 8));
+    }
+
+    capacity = NT6_CAPACITY;
+    entries = calloc(capacity, sizeof(struct entry6));
+    rev = calloc(2 * capacity, sizeof(uint32_t));
+    if (!entries || !rev) {
+        perror("nt6_init: calloc");
+        exit(EXIT_FAILURE);
+    }
+    rev_mask = 2 * capacity - 1;
+}
+
+static inline void synthetic(uint32_t n, struct in6_addr *key) {
+    *key = prefix;
+    key->s6_addr32[3] = htonl(n);
+}
+
+int nt6_lookup(const struct in6_addr *key, struct in6_addr *val) {
+    uint32_t n = ntohl(key->s6_addr32[3]);
+    unsigned int s0, s1;
+
+    if (n == 0 || n > capacity || memcmp(key, &prefix, 12) != 0) {
+        return -1;
+    }
+
+    do {
+        s0 = atomic_load_explicit(&seq, memory_order_acquire);
+        entry_get(&entries[n - 1], val);
+        atomic_thread_fence(memory_order_acquire);
+        s1 = atomic_load_explicit(&seq, memory_order_relaxed);
+    } while ((s0 & 1) || s0 != s1);
+
+    /* unused entries hold the unspecified address */
+    return IN6_IS_ADDR_UNSPECIFIED(val) ? -1 : 0;
+}
+
+static int64_t nt6_alloc(uint32_t now) {
+    for (uint32_t i = 0; i < capacity; ++i) {
+        uint32_t idx = cursor;
+        struct entry6 *e = &entries[idx];
+
+        cursor = (cursor + 1) % capacity;
+        if (e->expires == 0 || (int32_t) (now - e->expires) > NT6_HOLD) {
+            return idx;
+        }
+    }
+    return -1;
+}
+
+int nt6_reverse_lookup(const struct in6_addr *val, uint32_t ttl, struct in6_addr *key) {
+    char s_key[INET6_ADDRSTRLEN], s_val[INET6_ADDRSTRLEN];
+    uint32_t now = time(NULL), n;
+    int64_t idx;
+    int ret = 0;
+
+    if (!entries || IN6_IS_ADDR_UNSPECIFIED(val)) {
+        return -1;
+    }
+    if (ttl > NT6_MAX_TTL) {
+        ttl = NT6_MAX_TTL;
+    }
+
+    pthread_mutex_lock(&mutex);
+
+    n = rev_get(val);
+    if (n) {
+        if ((int32_t) (now + ttl - entries[n - 1].expires) > 0) {
+            entries[n - 1].expires = now + ttl;
+        }
+        synthetic(n, key);
+        goto finish;
+    }
+
+    idx = nt6_alloc(now);
+    if (idx < 0) {
+        fprintf(stderr, "ran out of IP addresses in the IPv6 NAT range\n");
+        ret = -1;
+        goto finish;
+    }
+    n = idx + 1;
+    synthetic(n, key);
+
+    inet_ntop(AF_INET6, key, s_key, sizeof(s_key));
+    inet_ntop(AF_INET6, val, s_val, sizeof(s_val));
+    fprintf(stderr, "adding DNAT from %s to %s\n", s_key, s_val);
+
+    if (entries[idx].expires) {
+        struct in6_addr old;
+        entry_get(&entries[idx], &old);
+        rev_del(&old);
+    }
+
+    atomic_store_explicit(&seq, atomic_load_explicit(&seq, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry_set(&entries[idx], val);
+    atomic_store_explicit(&seq, atomic_load_explicit(&seq, memory_order_relaxed) + 1, memory_order_release);
+
+    entries[idx].expires = now + ttl;
+    rev_put(val, n);
+
+finish:
+    pthread_mutex_unlock(&mutex);
+
+    return ret;
+}
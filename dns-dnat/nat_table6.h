@@ -0,0 +1,11 @@
+#ifndef __NAT_TABLE6_H__
+#define __NAT_TABLE6_H__
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+void nt6_init(char *);
+int nt6_lookup(const struct in6_addr *, struct in6_addr *);
+int nt6_reverse_lookup(const struct in6_addr *, uint32_t, struct in6_addr *);
+
+#endif
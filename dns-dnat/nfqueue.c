@@ -3,11 +3,14 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <libmnl/libmnl.h>
 #include <linux/netfilter.h>
@@ -15,32 +18,199 @@
 
 #include <linux/types.h>
 #include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
 #include <linux/netfilter/nfnetlink_queue.h>
 
 #include <libnetfilter_queue/libnetfilter_queue.h>
-#include <libnetfilter_queue/libnetfilter_queue_ipv4.h>
-#include <libnetfilter_queue/pktbuff.h>
 
 #include "conntrack.h"
+#include "metrics.h"
 
 static struct mnl_socket *nl;
 
-static void nfq_send_verdict(int queue_num, uint32_t id, uint32_t mark, struct pkt_buff *pktb)
+static void nfq_send_verdict(int queue_num, uint32_t id, uint32_t mark, uint8_t *pkt, uint16_t plen)
 {
+    static const char pad[MNL_ALIGNTO] = {0};
     char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
+    struct nlattr attr;
+    struct iovec iov[4];
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK};
+    struct msghdr msg = {.msg_name = &addr, .msg_namelen = sizeof(addr), .msg_iov = iov, .msg_iovlen = 1};
 
     nlh = nfq_nlmsg_put(buf, NFQNL_MSG_VERDICT, queue_num);
     nfq_nlmsg_verdict_put(nlh, id, NF_ACCEPT);
     nfq_nlmsg_verdict_put_mark(nlh, mark);
-    if (pktb_mangled(pktb)) {
-        nfq_nlmsg_verdict_put_pkt(nlh, pktb_data(pktb), pktb_len(pktb));
+    iov[0] = (struct iovec){nlh, nlh->nlmsg_len};
+
+    /* hand the mangled packet back straight out of the receive buffer
+     * instead of copying it into the verdict message */
+    if (pkt) {
+        attr.nla_type = NFQA_PAYLOAD;
+        attr.nla_len = sizeof(attr) + plen;
+        iov[1] = (struct iovec){&attr, sizeof(attr)};
+        iov[2] = (struct iovec){pkt, plen};
+        iov[3] = (struct iovec){(void *) pad, MNL_ALIGN(plen) - plen};
+        msg.msg_iovlen = 4;
+        nlh->nlmsg_len += MNL_ALIGN(attr.nla_len);
     }
 
-    if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
-        perror("nfq_send_verdict: mnl_socket_sendto");
+    if (sendmsg(mnl_socket_get_fd(nl), &msg, 0) < 0) {
+        perror("nfq_send_verdict: sendmsg");
         exit(EXIT_FAILURE);
     }
+    metrics_inc(M_PACKETS_VERDICTED);
+    if (pkt) {
+        metrics_inc(M_PACKETS_MANGLED);
+    }
+}
+
+/* RFC 1624, eqn. 3: HC' = ~(~HC + ~m + m'), for a 32-bit field m; the
+ * kernel completes any checksum left to the NIC before queueing (see
+ * nfq_loop()), so every checksum seen here is a full one */
+static inline void csum_replace4(uint16_t *check, uint32_t from, uint32_t to)
+{
+    uint32_t sum = (uint16_t) ~*check;
+
+    sum += (uint16_t) ~from + (uint16_t) ~(from >> 16) + (to & 0xffff) + (to >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    *check = ~sum;
+}
+
+/* the same for a 128-bit field */
+static inline void csum_replace16(uint16_t *check, const struct in6_addr *from, const struct in6_addr *to)
+{
+    uint32_t sum = (uint16_t) ~*check;
+
+    for (int i = 0; i < 8; ++i) {
+        sum += (uint16_t) ~from->s6_addr16[i] + to->s6_addr16[i];
+    }
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+
+    *check = ~sum;
+}
+
+static void nfq_mangle_daddr(uint8_t *pkt, uint16_t plen, in_addr_t new_daddr)
+{
+    struct iphdr *ip = (struct iphdr *) pkt;
+    uint8_t *l4 = pkt + 4 * ip->ihl;
+    in_addr_t old_daddr = ip->daddr;
+
+    ip->daddr = new_daddr;
+    csum_replace4(&ip->check, old_daddr, new_daddr);
+
+    /* only the first fragment carries the transport header */
+    if (ntohs(ip->frag_off) & 0x1fff) {
+        return;
+    }
+
+    /* the TCP and UDP checksums cover the addresses via the pseudo-header */
+    switch (ip->protocol) {
+        case IPPROTO_TCP:
+            if (l4 + sizeof(struct tcphdr) <= pkt + plen) {
+                csum_replace4(&((struct tcphdr *) l4)->check, old_daddr, new_daddr);
+            }
+            break;
+        case IPPROTO_UDP:
+            if (l4 + sizeof(struct udphdr) <= pkt + plen) {
+                struct udphdr *udp = (struct udphdr *) l4;
+                if (udp->check != 0) {
+                    csum_replace4(&udp->check, old_daddr, new_daddr);
+                    if (udp->check == 0) {
+                        udp->check = 0xffff;
+                    }
+                }
+            }
+            break;
+    }
+}
+
+/* finds the transport header of an IPv6 packet behind any extension headers
+ * that may precede it; returns NULL for later fragments and truncated ones */
+static uint8_t *nfq_ipv6_l4(uint8_t *pkt, uint16_t plen, uint8_t *proto)
+{
+    struct ipv6hdr *ip6 = (struct ipv6hdr *) pkt;
+    uint8_t *cur = pkt + sizeof(*ip6);
+    uint8_t next = ip6->nexthdr;
+
+    for (;;) {
+        switch (next) {
+            case IPPROTO_HOPOPTS:
+            case IPPROTO_ROUTING:
+            case IPPROTO_DSTOPTS:
+                if (cur + 8 > pkt + plen) {
+                    return NULL;
+                }
+                next = cur[0];
+                cur += 8 * (cur[1] + 1);
+                break;
+            case IPPROTO_FRAGMENT:
+                if (cur + 8 > pkt + plen || (ntohs(*(uint16_t *) (cur + 2)) & 0xfff8)) {
+                    return NULL;
+                }
+                next = cur[0];
+                cur += 8;
+                break;
+            default:
+                *proto = next;
+                return cur <= pkt + plen ? cur : NULL;
+        }
+    }
+}
+
+static void nfq_mangle_daddr6(uint8_t *pkt, uint16_t plen, uint8_t proto, uint8_t *l4, const struct in6_addr *new_daddr)
+{
+    struct ipv6hdr *ip6 = (struct ipv6hdr *) pkt;
+    struct in6_addr old_daddr = ip6->daddr;
+
+    /* there is no header checksum, and every transport checksum (including
+     * UDP's, which IPv6 makes mandatory) covers the pseudo-header */
+    ip6->daddr = *new_daddr;
+
+    switch (proto) {
+        case IPPROTO_TCP:
+            if (l4 + sizeof(struct tcphdr) <= pkt + plen) {
+                csum_replace16(&((struct tcphdr *) l4)->check, &old_daddr, new_daddr);
+            }
+            break;
+        case IPPROTO_UDP:
+            if (l4 + sizeof(struct udphdr) <= pkt + plen) {
+                struct udphdr *udp = (struct udphdr *) l4;
+                csum_replace16(&udp->check, &old_daddr, new_daddr);
+                if (udp->check == 0) {
+                    udp->check = 0xffff;
+                }
+            }
+            break;
+        case IPPROTO_ICMPV6:
+            if (l4 + 4 <= pkt + plen) {
+                csum_replace16((uint16_t *) (l4 + 2), &old_daddr, new_daddr);
+            }
+            break;
+    }
+}
+
+/* returns whether the packet was changed */
+static bool nfq_handle_ipv6(uint8_t *pkt, uint16_t plen)
+{
+    struct in6_addr new_daddr;
+    uint8_t proto, *l4;
+
+    if (plen < sizeof(struct ipv6hdr)) {
+        return false;
+    }
+    l4 = nfq_ipv6_l4(pkt, plen, &proto);
+    if (!l4 || nfct_add6(pkt, proto, l4, &new_daddr) != 1) {
+        return false;
+    }
+
+    nfq_mangle_daddr6(pkt, plen, proto, l4, &new_daddr);
+    return true;
 }
 
 static int queue_cb(const struct nlmsghdr *nlh, void *fwmark_ptr)
@@ -51,7 +221,6 @@ static int queue_cb(const struct nlmsghdr *nlh, void *fwmark_ptr)
     uint32_t id = 0;
     struct nfgenmsg *nfg;
     in_addr_t new_daddr;
-    struct pkt_buff *pktb;
     uint16_t plen;
     uint32_t fwmark = *((uint32_t *) fwmark_ptr);
 
@@ -67,23 +236,30 @@ static int queue_cb(const struct nlmsghdr *nlh, void *fwmark_ptr)
         return MNL_CB_ERROR;
     }
 
-    plen = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
-    payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
-
-    new_daddr = nfct_add(payload);
+    ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
+    id = ntohl(ph->packet_id);
 
-    pktb = pktb_alloc(AF_INET, payload, plen, 0);
+    metrics_inc(M_PACKETS_QUEUED);
 
-    if (new_daddr != (in_addr_t) -1) {
-        nfq_ip_mangle(pktb, 0, offsetof(struct iphdr, daddr), sizeof(in_addr_t), (char *) &new_daddr, sizeof(in_addr_t));
+    if (attr[NFQA_PAYLOAD] == NULL) {
+        nfq_send_verdict(ntohs(nfg->res_id), id, fwmark, NULL, 0);
+        return MNL_CB_OK;
     }
 
-    ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
-    id = ntohl(ph->packet_id);
+    plen = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
+    payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
 
-    nfq_send_verdict(ntohs(nfg->res_id), id, fwmark, pktb);
+    if (plen > 0 && payload[0] >> 4 == 6) {
+        if (!nfq_handle_ipv6(payload, plen)) {
+            payload = NULL;
+        }
+    } else if ((new_daddr = nfct_add(payload)) != 0 && new_daddr != (in_addr_t) -1) {
+        nfq_mangle_daddr(payload, plen, new_daddr);
+    } else {
+        payload = NULL;
+    }
 
-    free(pktb);
+    nfq_send_verdict(ntohs(nfg->res_id), id, fwmark, payload, plen);
 
     return MNL_CB_OK;
 }
@@ -93,7 +269,7 @@ void nfq_cleanup(void) {
     mnl_socket_close(nl);
 }
 
-int nfq_loop(unsigned int queue_num, unsigned int fwmark)
+int nfq_loop(unsigned int queue_num, unsigned int fwmark, unsigned int ctmark)
 {
     char *buf;
     /* largest possible packet payload, plus netlink data overhead: */
@@ -120,6 +296,8 @@ int nfq_loop(unsigned int queue_num, unsigned int fwmark)
         exit(EXIT_FAILURE);
     }
 
+    /* a queue instance is not tied to the family given here, so this also
+     * receives whatever ip6tables sends to the same queue number */
     nlh = nfq_nlmsg_put(buf, NFQNL_MSG_CONFIG, queue_num);
     nfq_nlmsg_cfg_put_cmd(nlh, AF_INET, NFQNL_CFG_CMD_BIND);
 
@@ -131,7 +309,11 @@ int nfq_loop(unsigned int queue_num, unsigned int fwmark)
     nlh = nfq_nlmsg_put(buf, NFQNL_MSG_CONFIG, queue_num);
     nfq_nlmsg_cfg_put_params(nlh, NFQNL_COPY_PACKET, 0xffff);
 
-    mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_GSO));
+    /* without NFQA_CFG_F_GSO, the kernel segments GSO packets and completes
+     * any checksum left to the NIC before queueing.  A mangled verdict makes
+     * the kernel treat the checksum as final (CHECKSUM_NONE), so a partial
+     * one that was only adjusted here would go out wrong. */
+    mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(0));
     mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_GSO));
 
     if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
@@ -146,11 +328,13 @@ int nfq_loop(unsigned int queue_num, unsigned int fwmark)
     ret = 1;
     mnl_socket_setsockopt(nl, NETLINK_NO_ENOBUFS, &ret, sizeof(int));
 
-    if (nfct_init() < 0) {
+    if (nfct_init(ctmark) < 0) {
         perror("nfct_init");
         exit(EXIT_FAILURE);
     }
 
+    metrics_queue(queue_num);
+
     for (;;) {
         ret = mnl_socket_recvfrom(nl, buf, sizeof_buf);
         if (ret == -1) {
@@ -1,7 +1,7 @@
 #ifndef __NFQUEUE_H__
 #define __NFQUEUE_H__
 
-int nfq_loop(unsigned int, unsigned int);
+int nfq_loop(unsigned int, unsigned int, unsigned int);
 void nfq_cleanup(void);
 
 #endif
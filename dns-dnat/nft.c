@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "nft.h"
+
+/*
+ * Mirrors the NAT table into an nftables map (synthetic -> real address), so
+ * that a `dnat to ip daddr map' rule can translate the first packet of a flow
+ * in the kernel instead of queueing it to us.  Changes are collected into a
+ * netlink batch and sent by nft_commit(); the kernel processes the batch
+ * before sendto() returns, so once the DNS answer goes out the element is
+ * already in place.
+ */
+
+static struct mnl_socket *nl = NULL;
+static char *table, *map;
+static uint32_t seq;
+
+static char buf[MNL_SOCKET_BUFFER_SIZE];
+static struct mnl_nlmsg_batch *batch = NULL;
+static struct nlmsghdr *elem_nlh = NULL;
+static uint16_t elem_type;
+static struct nlattr *elem_list;
+
+static void nft_put_batch_marker(uint16_t type) {
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+    struct nfgenmsg *nfg;
+
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = seq++;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(NFNL_SUBSYS_NFTABLES);
+
+    mnl_nlmsg_batch_next(batch);
+}
+
+static struct nlmsghdr *nft_put_setelem_header(uint16_t type, uint16_t flags) {
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+    struct nfgenmsg *nfg;
+
+    nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = seq++;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, table);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, map);
+
+    return nlh;
+}
+
+static void nft_end_elems(void) {
+    if (elem_nlh) {
+        mnl_attr_nest_end(elem_nlh, elem_list);
+        mnl_nlmsg_batch_next(batch);
+        elem_nlh = NULL;
+    }
+}
+
+static void nft_begin(void) {
+    if (!batch) {
+        batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
+        nft_put_batch_marker(NFNL_MSG_BATCH_BEGIN);
+    }
+}
+
+/* room for the batch end marker and one more element, conservatively */
+#define NFT_ELEM_ROOM (128 + strlen(table) + strlen(map))
+
+static void nft_add_elem(uint16_t type, in_addr_t key, const in_addr_t *val) {
+    struct nlattr *elem, *nest;
+
+    if (!nl) {
+        return;
+    }
+
+    if (batch && (char *) mnl_nlmsg_batch_current(batch) + (elem_nlh ? elem_nlh->nlmsg_len : 0) + NFT_ELEM_ROOM > buf + sizeof(buf)) {
+        nft_commit();
+    }
+
+    nft_begin();
+    if (elem_nlh && elem_type != type) {
+        nft_end_elems();
+    }
+    if (!elem_nlh) {
+        elem_nlh = nft_put_setelem_header(type, type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+        elem_type = type;
+        elem_list = mnl_attr_nest_start(elem_nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+    }
+
+    elem = mnl_attr_nest_start(elem_nlh, NFTA_LIST_ELEM);
+    nest = mnl_attr_nest_start(elem_nlh, NFTA_SET_ELEM_KEY);
+    mnl_attr_put(elem_nlh, NFTA_DATA_VALUE, sizeof(in_addr_t), &key);
+    mnl_attr_nest_end(elem_nlh, nest);
+    if (val) {
+        nest = mnl_attr_nest_start(elem_nlh, NFTA_SET_ELEM_DATA);
+        mnl_attr_put(elem_nlh, NFTA_DATA_VALUE, sizeof(in_addr_t), val);
+        mnl_attr_nest_end(elem_nlh, nest);
+    }
+    mnl_attr_nest_end(elem_nlh, elem);
+}
+
+void nft_put(in_addr_t key, in_addr_t val) {
+    nft_add_elem(NFT_MSG_NEWSETELEM, key, &val);
+}
+
+void nft_del(in_addr_t key) {
+    nft_add_elem(NFT_MSG_DELSETELEM, key, NULL);
+}
+
+static int nft_error_cb(const struct nlmsghdr *nlh, void *data) {
+    (void) nlh, (void) data;
+    return MNL_CB_OK;
+}
+
+void nft_commit(void) {
+    char rbuf[MNL_SOCKET_BUFFER_SIZE];
+    ssize_t ret;
+
+    if (!batch) {
+        return;
+    }
+
+    nft_end_elems();
+    nft_put_batch_marker(NFNL_MSG_BATCH_END);
+
+    if (mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
+        perror("nft_commit: mnl_socket_sendto");
+    }
+    mnl_nlmsg_batch_stop(batch);
+    batch = NULL;
+
+    /* errors have already been queued by the time sendto() returns */
+    while ((ret = recv(mnl_socket_get_fd(nl), rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0) {
+        if (mnl_cb_run(rbuf, ret, 0, 0, nft_error_cb, NULL) < 0) {
+            fprintf(stderr, "updating nftables map %s %s: %s\n", table, map, strerror(errno));
+        }
+    }
+}
+
+void nft_init(char *spec) {
+    char *sep = strchr(spec, ':');
+
+    if (!sep || sep == spec || sep[1] == '\0') {
+        fprintf(stderr, "nftables map must be given as table:map\n");
+        exit(EXIT_FAILURE);
+    }
+    *sep = '\0';
+    table = spec;
+    map = sep + 1;
+
+    nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!nl) {
+        perror("nft_init: mnl_socket_open");
+        exit(EXIT_FAILURE);
+    }
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+        perror("nft_init: mnl_socket_bind");
+        exit(EXIT_FAILURE);
+    }
+    seq = time(NULL);
+
+    /* a DELSETELEM without elements flushes the map; whatever is still in
+     * there from a previous run is put back from the journal, if any */
+    nft_begin();
+    nft_put_setelem_header(NFT_MSG_DELSETELEM, 0);
+    mnl_nlmsg_batch_next(batch);
+    nft_commit();
+}
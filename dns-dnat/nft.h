@@ -0,0 +1,11 @@
+#ifndef __NFT_H__
+#define __NFT_H__
+
+#include <arpa/inet.h>
+
+void nft_init(char *);
+void nft_put(in_addr_t, in_addr_t);
+void nft_del(in_addr_t);
+void nft_commit(void);
+
+#endif
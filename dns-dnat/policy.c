@@ -0,0 +1,475 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <event2/event.h>
+
+#include "policy.h"
+
+/*
+ * Decides per name whether answers are NATed, and into which ipset the real
+ * addresses go.  The policy file has one rule per line:
+ *
+ *     example.com nat
+ *     cdn.example.com pass
+ *     corp.internal ipset corp
+ *
+ * A rule applies to the name itself and everything below it, the longest
+ * matching suffix wins, and `.' matches every name.  Names matching no rule
+ * are passed through.  Without a policy file, everything is NATed.
+ *
+ * The rules are compiled into a trie over labels, from the last label of a
+ * name to the first, flattened into two arrays: the edges out of a node are
+ * contiguous and sorted, so matching a name is one binary search per label.
+ * The file is watched with inotify and reloaded when it changes; if the new
+ * version fails to parse, the old one is kept.
+ */
+
+#define POLICY_MAX_LINE 1024
+
+struct node {
+    /* edges[first .. first + n) lead to the children */
+    uint32_t first;
+    uint32_t n;
+    enum policy_action action;
+    /* offset of the ipset name in `pool', or 0 for the default */
+    uint32_t ipset;
+};
+
+struct edge {
+    /* offset of the label in `pool' */
+    uint32_t label;
+    uint32_t len;
+    uint32_t child;
+};
+
+struct policy {
+    struct node *nodes;
+    struct edge *edges;
+    char *pool;
+};
+
+struct rule {
+    /* the labels of the suffix, last one first */
+    char **labels;
+    uint32_t *lens;
+    uint32_t nlabels;
+    enum policy_action action;
+    uint32_t ipset;
+};
+
+struct builder {
+    struct rule *rules;
+    struct node *nodes;
+    struct edge *edges;
+    uint32_t nnodes, nedges;
+};
+
+static struct policy *policy = NULL;
+static char *path;
+
+static struct event *inotify_ev, *retry_ev;
+static int inotify_fd, wd = -1;
+
+static int label_cmp(const char *a, uint32_t alen, const char *b, uint32_t blen) {
+    int ret = memcmp(a, b, alen < blen ? alen : blen);
+    if (ret != 0) {
+        return ret;
+    }
+    return (alen > blen) - (alen < blen);
+}
+
+static int rule_cmp(const void *a_void, const void *b_void) {
+    const struct rule *a = a_void, *b = b_void;
+
+    for (uint32_t i = 0; i < a->nlabels && i < b->nlabels; ++i) {
+        int ret = label_cmp(a->labels[i], a->lens[i], b->labels[i], b->lens[i]);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+    return (a->nlabels > b->nlabels) - (a->nlabels < b->nlabels);
+}
+
+/* builds the node for rules[lo .. hi), which share their first `depth' labels */
+static uint32_t build(struct builder *b, struct policy *p, uint32_t lo, uint32_t hi, uint32_t depth) {
+    uint32_t idx = b->nnodes++;
+    uint32_t n = 0, edge;
+
+    b->nodes[idx] = (struct node){0, 0, POLICY_NONE, 0};
+
+    /* sorting puts the rule for this node, if any, first */
+    if (lo < hi && b->rules[lo].nlabels == depth) {
+        b->nodes[idx].action = b->rules[lo].action;
+        b->nodes[idx].ipset = b->rules[lo].ipset;
+        ++lo;
+    }
+
+    for (uint32_t i = lo; i < hi; ++i) {
+        if (i == lo || label_cmp(b->rules[i].labels[depth], b->rules[i].lens[depth],
+                    b->rules[i - 1].labels[depth], b->rules[i - 1].lens[depth]) != 0) {
+            ++n;
+        }
+    }
+
+    edge = b->nedges;
+    b->nedges += n;
+    b->nodes[idx].first = edge;
+    b->nodes[idx].n = n;
+
+    for (uint32_t i = lo; i < hi;) {
+        uint32_t j = i + 1;
+        while (j < hi && label_cmp(b->rules[j].labels[depth], b->rules[j].lens[depth],
+                    b->rules[i].labels[depth], b->rules[i].lens[depth]) == 0) {
+            ++j;
+        }
+        b->edges[edge].label = b->rules[i].labels[depth] - p->pool;
+        b->edges[edge].len = b->rules[i].lens[depth];
+        b->edges[edge].child = build(b, p, i, j, depth + 1);
+        ++edge;
+        i = j;
+    }
+
+    return idx;
+}
+
+static void policy_free(struct policy *p) {
+    if (p) {
+        free(p->nodes);
+        free(p->edges);
+        free(p->pool);
+        free(p);
+    }
+}
+
+/* splits the suffix in `s' (lowercased, in the pool) into reversed labels */
+static int rule_labels(struct rule *r, char *s) {
+    size_t len = strlen(s);
+    uint32_t n = 0;
+
+    if (len > 0 && s[len - 1] == '.') {
+        s[--len] = '\0';
+    }
+    for (size_t i = 0; i < len; ++i) {
+        s[i] = tolower((unsigned char) s[i]);
+        n += s[i] == '.';
+    }
+    r->nlabels = len > 0 ? n + 1 : 0;
+    r->labels = malloc((r->nlabels + 1) * sizeof(char *));
+    r->lens = malloc((r->nlabels + 1) * sizeof(uint32_t));
+    if (!r->labels || !r->lens) {
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < r->nlabels; ++i) {
+        char *dot = memrchr(s, '.', len);
+        char *label = dot ? dot + 1 : s;
+        r->labels[i] = label;
+        r->lens[i] = s + len - label;
+        if (r->lens[i] == 0) {
+            return -1;
+        }
+        len = dot ? (size_t) (dot - s) : 0;
+    }
+
+    return 0;
+}
+
+static struct policy *policy_load(const char *fp) {
+    FILE *f;
+    struct policy *p;
+    struct builder b = {0};
+    char line[POLICY_MAX_LINE];
+    size_t pool_len = 1, pool_cap = 4096;
+    uint32_t nrules = 0, cap = 64, lineno = 0, nlabels = 0;
+    bool ok = true;
+
+    f = fopen(fp, "r");
+    if (!f) {
+        perror("policy_load: fopen");
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(struct policy));
+    b.rules = malloc(cap * sizeof(struct rule));
+    if (p) {
+        p->pool = malloc(pool_cap);
+    }
+    if (!p || !p->pool || !b.rules) {
+        perror("policy_load: malloc");
+        ok = false;
+        goto finish;
+    }
+    /* offset 0 stands for "no ipset" */
+    p->pool[0] = '\0';
+
+    /* the rules point into the pool, so read everything before parsing */
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        if (pool_len + len + 1 > pool_cap) {
+            char *pool;
+            while (pool_len + len + 1 > pool_cap) {
+                pool_cap *= 2;
+            }
+            pool = realloc(p->pool, pool_cap);
+            if (!pool) {
+                perror("policy_load: realloc");
+                ok = false;
+                goto finish;
+            }
+            p->pool = pool;
+        }
+        memcpy(p->pool + pool_len, line, len + 1);
+        pool_len += len + 1;
+    }
+
+    for (size_t off = 1, next; off < pool_len; off = next) {
+        char *s = p->pool + off, *save = NULL;
+        char *suffix, *action, *ipset, *extra;
+        struct rule *r;
+
+        next = off + strlen(s) + 1;
+        ++lineno;
+        s[strcspn(s, "#\n")] = '\0';
+        suffix = strtok_r(s, " \t", &save);
+        if (!suffix) {
+            continue;
+        }
+        action = strtok_r(NULL, " \t", &save);
+        ipset = strtok_r(NULL, " \t", &save);
+        extra = strtok_r(NULL, " \t", &save);
+
+        if (nrules == cap) {
+            struct rule *rules = realloc(b.rules, 2 * cap * sizeof(struct rule));
+            if (!rules) {
+                perror("policy_load: realloc");
+                ok = false;
+                goto finish;
+            }
+            b.rules = rules;
+            cap *= 2;
+        }
+        r = &b.rules[nrules];
+        *r = (struct rule){NULL, NULL, 0, POLICY_NAT, 0};
+        ++nrules;
+
+        if (!action || extra) {
+            ok = false;
+        } else if (strcasecmp(action, "nat") == 0 && !ipset) {
+            r->action = POLICY_NAT;
+        } else if (strcasecmp(action, "pass") == 0 && !ipset) {
+            r->action = POLICY_PASS;
+        } else if (strcasecmp(action, "ipset") == 0 && ipset) {
+            r->action = POLICY_NAT;
+            r->ipset = ipset - p->pool;
+        } else {
+            ok = false;
+        }
+        if (ok && rule_labels(r, suffix) < 0) {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "%s:%u: expected `suffix nat', `suffix pass' or `suffix ipset name'\n", fp, lineno);
+            goto finish;
+        }
+        nlabels += r->nlabels;
+    }
+
+    qsort(b.rules, nrules, sizeof(struct rule), rule_cmp);
+    for (uint32_t i = 1; i < nrules; ++i) {
+        if (rule_cmp(&b.rules[i - 1], &b.rules[i]) == 0) {
+            fprintf(stderr, "%s: duplicate rule for a suffix\n", fp);
+            ok = false;
+            goto finish;
+        }
+    }
+
+    /* every label of every rule adds at most one node and one edge */
+    p->nodes = malloc((nlabels + 1) * sizeof(struct node));
+    p->edges = malloc((nlabels + 1) * sizeof(struct edge));
+    if (!p->nodes || !p->edges) {
+        perror("policy_load: malloc");
+        ok = false;
+        goto finish;
+    }
+    b.nodes = p->nodes;
+    b.edges = p->edges;
+    build(&b, p, 0, nrules, 0);
+
+    fprintf(stderr, "loaded %u policy rules from %s\n", nrules, fp);
+
+finish:
+    fclose(f);
+    for (uint32_t i = 0; i < nrules; ++i) {
+        free(b.rules[i].labels);
+        free(b.rules[i].lens);
+    }
+    free(b.rules);
+    if (!ok) {
+        policy_free(p);
+        return NULL;
+    }
+    return p;
+}
+
+enum policy_action policy_match(const char *name, const char **ipset) {
+    const struct node *node;
+    enum policy_action action = POLICY_PASS;
+    size_t len = strlen(name);
+
+    *ipset = NULL;
+    if (!policy) {
+        return POLICY_NAT;
+    }
+
+    node = &policy->nodes[0];
+    if (len > 0 && name[len - 1] == '.') {
+        --len;
+    }
+
+    for (;;) {
+        char label[64];
+        const char *dot;
+        uint32_t label_len, lo, hi;
+
+        if (node->action != POLICY_NONE) {
+            action = node->action;
+            *ipset = node->ipset ? policy->pool + node->ipset : NULL;
+        }
+        if (len == 0 || node->n == 0) {
+            break;
+        }
+
+        dot = memrchr(name, '.', len);
+        label_len = name + len - (dot ? dot + 1 : name);
+        if (label_len >= sizeof(label)) {
+            break;
+        }
+        for (uint32_t i = 0; i < label_len; ++i) {
+            label[i] = tolower((unsigned char) name[len - label_len + i]);
+        }
+        len = dot ? (size_t) (dot - name) : 0;
+
+        lo = node->first;
+        hi = node->first + node->n;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            const struct edge *e = &policy->edges[mid];
+            int ret = label_cmp(policy->pool + e->label, e->len, label, label_len);
+            if (ret == 0) {
+                lo = mid;
+                break;
+            } else if (ret < 0) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo == node->first + node->n || label_cmp(policy->pool + policy->edges[lo].label,
+                    policy->edges[lo].len, label, label_len) != 0) {
+            break;
+        }
+        node = &policy->nodes[policy->edges[lo].child];
+    }
+
+    return action;
+}
+
+static void policy_reload(void) {
+    struct policy *p = policy_load(path);
+
+    if (!p) {
+        fprintf(stderr, "keeping the previous policy\n");
+        return;
+    }
+
+    /* matching only happens on the DNS thread, which is also this one */
+    policy_free(policy);
+    policy = p;
+}
+
+static void policy_watch_add(void) {
+    wd = inotify_add_watch(inotify_fd, path, IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+}
+
+static void retry_cb(evutil_socket_t fd, short what, void *data) {
+    struct timeval later = {0, 100000};
+    (void) fd, (void) what, (void) data;
+
+    policy_watch_add();
+    if (wd == -1) {
+        if (errno != ENOENT) {
+            perror("inotify_add_watch");
+            exit(EXIT_FAILURE);
+        }
+        evtimer_add(retry_ev, &later);
+        return;
+    }
+    policy_reload();
+}
+
+static void inotify_cb(evutil_socket_t fd, short what, void *data) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct timeval later = {0, 100000};
+    bool changed = false, gone = false;
+    ssize_t len;
+    (void) what, (void) data;
+
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+            if (ev->wd == wd) {
+                changed = true;
+                gone |= (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) != 0;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+
+    if (gone) {
+        /* in case the file was replaced, e.g. by an editor; give it a moment
+         * to reappear rather than reading a half-written file */
+        inotify_rm_watch(inotify_fd, wd);
+        wd = -1;
+        evtimer_add(retry_ev, &later);
+    } else if (changed) {
+        policy_reload();
+    }
+}
+
+void policy_init(char *fp, struct event_base *base) {
+    path = fp;
+
+    policy = policy_load(path);
+    if (!policy) {
+        exit(EXIT_FAILURE);
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1");
+        exit(EXIT_FAILURE);
+    }
+    policy_watch_add();
+    if (wd == -1) {
+        perror("inotify_add_watch");
+        exit(EXIT_FAILURE);
+    }
+
+    inotify_ev = event_new(base, inotify_fd, EV_READ | EV_PERSIST, inotify_cb, NULL);
+    retry_ev = evtimer_new(base, retry_cb, NULL);
+    if (!inotify_ev || !retry_ev || event_add(inotify_ev, NULL) < 0) {
+        perror("policy_init: event_new");
+        exit(EXIT_FAILURE);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef __POLICY_H__
+#define __POLICY_H__
+
+#include <event2/event.h>
+
+enum policy_action {
+    POLICY_NONE,
+    POLICY_NAT,
+    POLICY_PASS,
+};
+
+void policy_init(char *, struct event_base *);
+enum policy_action policy_match(const char *, const char **);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+ * The `test' build: one thread keeps adding and removing mappings while
+ * another looks them up with nt_lookup(), as the DNS and packet threads do.
+ *
+ * Each address in the pool has a generation, which is odd while the writer
+ * changes its mapping and then moves on to the next even one.  Addresses are
+ * mapped in every other even generation, to a value derived from the address
+ * and the generation.  A lookup that saw the same even generation before and
+ * after must have found exactly that value, or nothing; anything else, such
+ * as a value left over from an earlier mapping or a mapping missed while a
+ * deletion was shifting others about, fails the test.
+ */
+
+#include "nat_table.c"
+
+#define STRESS_DEFAULT_SECONDS 2
+#define STRESS_RANGE "100.64.0.0/16"
+
+static atomic_uint *gens;
+static atomic_bool done = false;
+static uint64_t nwrites = 0;
+
+static inline in_addr_t stress_val(in_addr_t key, uint32_t gen) {
+    return htonl(~ntohl(key) ^ (gen << 16));
+}
+
+static inline uint32_t xorshift(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+/* the DNS thread's half of nt_add() and nt_release() */
+static void *stress_writer(void *data) {
+    uint32_t seed = 2463534242u, npool = max_key - min_key + 1;
+    (void) data;
+
+    while (!atomic_load_explicit(&done, memory_order_relaxed)) {
+        uint32_t idx = xorshift(&seed) % npool;
+        in_addr_t key = htonl(min_key + idx);
+        uint32_t gen = atomic_load_explicit(&gens[idx], memory_order_relaxed) + 2;
+
+        atomic_store_explicit(&gens[idx], gen - 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        write_begin();
+        if (gen & 2) {
+            map_put(&fwd, key, stress_val(key, gen));
+        } else {
+            map_del(&fwd, key);
+        }
+        write_end();
+        atomic_store_explicit(&gens[idx], gen, memory_order_release);
+        ++nwrites;
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    char range[] = STRESS_RANGE;
+    uint32_t seed = 88172645u, npool;
+    uint64_t nlookups = 0, nhits = 0, nerrors = 0, deadline;
+    long seconds = STRESS_DEFAULT_SECONDS;
+    pthread_t writer;
+
+    if (argc > 2 || (argc == 2 && (seconds = strtol(argv[1], NULL, 10)) <= 0)) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    nt_init(range, NULL, false, NULL);
+    npool = max_key - min_key + 1;
+    gens = calloc(npool, sizeof(atomic_uint));
+    if (!gens) {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+
+    if (pthread_create(&writer, NULL, stress_writer, NULL) != 0) {
+        perror("pthread_create");
+        exit(EXIT_FAILURE);
+    }
+
+    deadline = metrics_now() + seconds * 1000000000ULL;
+    while (metrics_now() < deadline) {
+        for (int i = 0; i < 4096; ++i) {
+            uint32_t idx = xorshift(&seed) % npool, gen0, gen1;
+            in_addr_t key = htonl(min_key + idx), val;
+
+            gen0 = atomic_load_explicit(&gens[idx], memory_order_acquire);
+            val = nt_lookup(key);
+            atomic_thread_fence(memory_order_acquire);
+            gen1 = atomic_load_explicit(&gens[idx], memory_order_relaxed);
+
+            if ((gen0 & 1) || gen0 != gen1) {
+                continue;
+            }
+            if (val == (gen0 & 2 ? stress_val(key, gen0) : (in_addr_t) -1)) {
+                nhits += (gen0 & 2) != 0;
+            } else if (nerrors++ < 10) {
+                char s_key[16];
+                inet_ntop(AF_INET, &key, s_key, 16);
+                fprintf(stderr, "lookup of %s in generation %u returned %08x\n", s_key, gen0, ntohl(val));
+            }
+        }
+        nlookups += 4096;
+    }
+
+    atomic_store(&done, true);
+    pthread_join(writer, NULL);
+
+    printf("%lu lookups (%lu found) against %lu writes, %lu wrong\n",
+            (unsigned long) nlookups, (unsigned long) nhits, (unsigned long) nwrites, (unsigned long) nerrors);
+
+    return nerrors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
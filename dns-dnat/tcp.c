@@ -0,0 +1,337 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/dns.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+#include <udns.h>
+
+#include "dns.h"
+#include "tcp.h"
+
+/*
+ * DNS over TCP on the same port as the UDP server, which evdns can't do
+ * for us.  Each message is parsed just far enough to get the questions,
+ * which are answered through dns_answer() like UDP ones; the response is
+ * built here.  Queries on one connection are answered in whatever order
+ * their answers come in, as RFC 7766 allows.
+ */
+
+/* questions in one query; anything beyond this is refused */
+#define TCP_MAX_QUESTIONS 8
+/* queries in flight on one connection before we stop reading from it */
+#define TCP_MAX_PENDING 64
+#define TCP_IDLE_TIMEOUT 30
+
+struct tcp_conn {
+    struct bufferevent *bev;
+    int pending;
+};
+
+struct tcp_query {
+    struct tcp_conn *conn;
+    uint16_t id, flags;
+    uint16_t ancount;
+    struct evbuffer *answers;
+    int n;
+    const char *names[TCP_MAX_QUESTIONS];
+    int types[TCP_MAX_QUESTIONS];
+    /* the question section, echoed back in the response */
+    size_t qlen;
+    uint8_t *question;
+    char name_buf[TCP_MAX_QUESTIONS][DNS_MAXNAME];
+};
+
+static void conn_release(struct tcp_conn *conn) {
+    if (--conn->pending == 0 && !conn->bev) {
+        free(conn);
+    } else if (conn->bev && conn->pending == TCP_MAX_PENDING - 1) {
+        /* deferred, since we may be inside read_cb() right now */
+        bufferevent_enable(conn->bev, EV_READ);
+        bufferevent_trigger(conn->bev, EV_READ, BEV_TRIG_DEFER_CALLBACKS);
+    }
+}
+
+static void conn_close(struct tcp_conn *conn) {
+    bufferevent_free(conn->bev);
+    conn->bev = NULL;
+    if (conn->pending == 0) {
+        free(conn);
+    }
+}
+
+static int add_rr(struct tcp_query *q, const char *name, uint16_t type, int ttl, const void *rdata, uint16_t rdlen) {
+    dnsc_t dn[DNS_MAXDN];
+    uint8_t fixed[10];
+    int len = dns_ptodn(name, 0, dn, sizeof(dn), NULL);
+
+    if (len <= 0) {
+        return -1;
+    }
+
+    fixed[0] = type >> 8;
+    fixed[1] = type;
+    fixed[2] = 0;
+    fixed[3] = DNS_C_IN;
+    fixed[4] = ttl >> 24;
+    fixed[5] = ttl >> 16;
+    fixed[6] = ttl >> 8;
+    fixed[7] = ttl;
+    fixed[8] = rdlen >> 8;
+    fixed[9] = rdlen;
+
+    if (evbuffer_add(q->answers, dn, len) < 0 || evbuffer_add(q->answers, fixed, sizeof(fixed)) < 0
+            || evbuffer_add(q->answers, rdata, rdlen) < 0) {
+        return -1;
+    }
+    ++q->ancount;
+    return 0;
+}
+
+static int tcp_add_cname(void *reply, const char *name, const char *cname, int ttl) {
+    dnsc_t dn[DNS_MAXDN];
+    int len = dns_ptodn(cname, 0, dn, sizeof(dn), NULL);
+
+    if (len <= 0) {
+        return -1;
+    }
+    return add_rr(reply, name, DNS_T_CNAME, ttl, dn, len);
+}
+
+static int tcp_add_a(void *reply, const char *name, int n, const void *addrs, int ttl) {
+    for (int i = 0; i < n; ++i) {
+        if (add_rr(reply, name, DNS_T_A, ttl, (const uint8_t *) addrs + 4 * i, 4) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int tcp_add_aaaa(void *reply, const char *name, int n, const void *addrs, int ttl) {
+    for (int i = 0; i < n; ++i) {
+        if (add_rr(reply, name, DNS_T_AAAA, ttl, (const uint8_t *) addrs + 16 * i, 16) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void send_response(struct bufferevent *bev, uint16_t id, uint16_t flags, uint16_t rcode,
+        uint16_t qdcount, const uint8_t *question, size_t qlen, uint16_t ancount, struct evbuffer *answers) {
+    size_t alen = answers ? evbuffer_get_length(answers) : 0;
+    size_t len = DNS_HSIZE + qlen + alen;
+    uint8_t hdr[2 + DNS_HSIZE];
+
+    if (len > 0xffff) {
+        /* can't happen with the handful of records we return */
+        alen = ancount = 0;
+        rcode = 2;
+        len = DNS_HSIZE + qlen;
+    }
+
+    /* QR, the opcode and RD from the query, RA */
+    flags = 0x8000 | (flags & 0x7900) | 0x0080 | rcode;
+    hdr[0] = len >> 8;
+    hdr[1] = len;
+    hdr[2] = id >> 8;
+    hdr[3] = id;
+    hdr[4] = flags >> 8;
+    hdr[5] = flags;
+    hdr[6] = qdcount >> 8;
+    hdr[7] = qdcount;
+    hdr[8] = ancount >> 8;
+    hdr[9] = ancount;
+    memset(hdr + 10, 0, 4);
+
+    bufferevent_write(bev, hdr, sizeof(hdr));
+    if (qlen) {
+        bufferevent_write(bev, question, qlen);
+    }
+    if (alen) {
+        bufferevent_write_buffer(bev, answers);
+    }
+}
+
+static void tcp_respond(void *reply, int err) {
+    struct tcp_query *q = reply;
+    uint16_t rcode;
+
+    switch (err) {
+        case DNS_ERR_NONE:
+        case DNS_ERR_NODATA:
+            rcode = 0;
+            break;
+        case DNS_ERR_NOTEXIST:
+            rcode = 3;
+            break;
+        default:
+            rcode = 2;
+            q->ancount = 0;
+            evbuffer_drain(q->answers, evbuffer_get_length(q->answers));
+            break;
+    }
+
+    if (q->conn->bev) {
+        send_response(q->conn->bev, q->id, q->flags, rcode, q->n, q->question, q->qlen, q->ancount, q->answers);
+    }
+    conn_release(q->conn);
+
+    evbuffer_free(q->answers);
+    free(q);
+}
+
+static const struct dns_reply_ops tcp_ops = {tcp_add_cname, tcp_add_a, tcp_add_aaaa, tcp_respond};
+
+/* returns -1 if the message is not worth answering at all */
+static int handle_query(struct tcp_conn *conn, uint8_t *msg, size_t len) {
+    struct tcp_query *q;
+    dnscc_t *cur = msg + DNS_HSIZE, *end = msg + len;
+    uint16_t id, flags, qdcount;
+
+    if (len < DNS_HSIZE) {
+        return -1;
+    }
+    id = (msg[0] << 8) | msg[1];
+    flags = (msg[2] << 8) | msg[3];
+    qdcount = (msg[4] << 8) | msg[5];
+
+    if (flags & 0x8000) {
+        return -1;
+    }
+    if ((flags & 0x7800) != 0) {
+        send_response(conn->bev, id, flags, 4, 0, NULL, 0, 0, NULL);
+        return 0;
+    }
+    if (qdcount == 0 || qdcount > TCP_MAX_QUESTIONS) {
+        send_response(conn->bev, id, flags, qdcount ? 5 : 1, 0, NULL, 0, 0, NULL);
+        return 0;
+    }
+
+    q = malloc(sizeof(struct tcp_query) + len);
+    if (!q) {
+        perror("tcp: malloc");
+        send_response(conn->bev, id, flags, 2, 0, NULL, 0, 0, NULL);
+        return 0;
+    }
+    q->conn = conn;
+    q->id = id;
+    q->flags = flags;
+    q->ancount = 0;
+    q->n = qdcount;
+
+    for (int i = 0; i < qdcount; ++i) {
+        dnsc_t dn[DNS_MAXDN];
+        if (dns_getdn(msg, &cur, end, dn, sizeof(dn)) <= 0 || cur + 4 > end) {
+            free(q);
+            send_response(conn->bev, id, flags, 1, 0, NULL, 0, 0, NULL);
+            return 0;
+        }
+        dns_dntop(dn, q->name_buf[i], DNS_MAXNAME);
+        q->names[i] = q->name_buf[i];
+        q->types[i] = (cur[0] << 8) | cur[1];
+        cur += 4;
+    }
+
+    q->question = (uint8_t *) (q + 1);
+    q->qlen = cur - (msg + DNS_HSIZE);
+    memcpy(q->question, msg + DNS_HSIZE, q->qlen);
+
+    q->answers = evbuffer_new();
+    if (!q->answers) {
+        free(q);
+        send_response(conn->bev, id, flags, 2, 0, NULL, 0, 0, NULL);
+        return 0;
+    }
+
+    if (++conn->pending == TCP_MAX_PENDING) {
+        bufferevent_disable(conn->bev, EV_READ);
+    }
+    dns_answer(&tcp_ops, q, q->n, q->names, q->types);
+    return 0;
+}
+
+static void read_cb(struct bufferevent *bev, void *data) {
+    struct tcp_conn *conn = data;
+    struct evbuffer *in = bufferevent_get_input(bev);
+
+    while (conn->bev && conn->pending < TCP_MAX_PENDING) {
+        uint8_t *msg;
+        uint16_t len;
+
+        if (evbuffer_copyout(in, &len, 2) < 2) {
+            break;
+        }
+        len = ntohs(len);
+        if (evbuffer_get_length(in) < 2 + (size_t) len) {
+            break;
+        }
+
+        msg = evbuffer_pullup(in, 2 + len);
+        if (handle_query(conn, msg + 2, len) < 0) {
+            conn_close(conn);
+            return;
+        }
+        evbuffer_drain(in, 2 + len);
+    }
+}
+
+static void event_cb(struct bufferevent *bev, short what, void *data) {
+    struct tcp_conn *conn = data;
+    (void) bev;
+
+    if ((what & BEV_EVENT_TIMEOUT) && conn->pending > 0) {
+        bufferevent_enable(bev, EV_READ);
+        return;
+    }
+    conn_close(conn);
+}
+
+static void accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *addr, int addrlen, void *data) {
+    struct event_base *base = evconnlistener_get_base(listener);
+    struct timeval idle = {TCP_IDLE_TIMEOUT, 0};
+    struct tcp_conn *conn;
+    (void) addr, (void) addrlen, (void) data;
+
+    conn = calloc(1, sizeof(struct tcp_conn));
+    if (!conn) {
+        perror("tcp: calloc");
+        evutil_closesocket(fd);
+        return;
+    }
+
+    conn->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    if (!conn->bev) {
+        perror("tcp: bufferevent_socket_new");
+        evutil_closesocket(fd);
+        free(conn);
+        return;
+    }
+    bufferevent_setcb(conn->bev, read_cb, NULL, event_cb, conn);
+    bufferevent_set_timeouts(conn->bev, &idle, NULL);
+    bufferevent_enable(conn->bev, EV_READ);
+}
+
+void tcp_listen(struct event_base *base, uint16_t port) {
+    struct evconnlistener *listener;
+    struct sockaddr_in listenaddr;
+
+    memset(&listenaddr, 0, sizeof(listenaddr));
+    listenaddr.sin_family = AF_INET;
+    listenaddr.sin_port = htons(port);
+    listenaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listener = evconnlistener_new_bind(base, accept_cb, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+            (struct sockaddr *) &listenaddr, sizeof(listenaddr));
+    if (!listener) {
+        perror("tcp_listen: evconnlistener_new_bind");
+        exit(EXIT_FAILURE);
+    }
+}
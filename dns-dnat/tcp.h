@@ -0,0 +1,10 @@
+#ifndef __TCP_H__
+#define __TCP_H__
+
+#include <stdint.h>
+
+#include <event2/event.h>
+
+void tcp_listen(struct event_base *, uint16_t);
+
+#endif
@@ -0,0 +1,438 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/time.h>
+
+#include <event2/event.h>
+
+#include <udns.h>
+
+#include "metrics.h"
+#include "upstream.h"
+#include "upstream_tcp.h"
+
+/*
+ * Resolves names asynchronously against one or more upstream servers, each
+ * with its own udns context driven from the libevent loop.  Every upstream
+ * keeps a moving average of its response time and a histogram of recent
+ * ones.  A lookup goes to the upstream with the lowest average; if no answer
+ * has come back by the 95th percentile of that upstream's recent response
+ * times, the same lookup is also sent to the next best one (hedging), and
+ * whichever answers first wins.  An upstream that fails outright is hedged
+ * immediately, and the failure counts as a response that took at least as
+ * long as its hedge delay, so failing fast doesn't put an upstream first.
+ *
+ * With TCP enabled, each upstream is instead queried over a small pool of
+ * persistent, pipelined TCP connections (see upstream_tcp.c); the rest works
+ * the same.
+ *
+ * SIGUSR1 dumps per-upstream statistics to stderr.
+ */
+
+#define UP_MAX 8
+
+/* bucket i counts response times in [2^i, 2^(i + 1)) microseconds */
+#define HIST_BUCKETS 24
+/* halve the recent histogram once it holds this many samples */
+#define HIST_DECAY 1024
+/* percentile of recent response times after which a lookup is hedged */
+#define HEDGE_PERCENTILE 0.95
+#define HEDGE_MIN_US 10000
+#define HEDGE_MAX_US 1000000
+/* until an upstream has this many recent samples */
+#define HEDGE_MIN_SAMPLES 16
+#define HEDGE_DEFAULT_US 250000
+
+/* weight of a new sample in the moving average */
+#define EWMA_ALPHA 0.125
+
+struct upstream {
+    char *addr;
+    struct dns_ctx *ctx;
+    /* instead of ctx, if TCP is enabled */
+    struct ut_pool *tcp;
+    struct event *io_ev, *timer_ev;
+
+    double ewma_us;
+    uint32_t recent[HIST_BUCKETS];
+    uint32_t nrecent;
+    uint64_t hist[HIST_BUCKETS];
+
+    uint64_t sent, won, failed, hedged;
+};
+
+struct lookup;
+
+struct attempt {
+    struct lookup *l;
+    int i;
+};
+
+struct lookup {
+    int type;
+    up_result_fn *cb;
+    void *arg;
+    struct event *hedge_ev;
+    int nsent, outstanding;
+    /* one per upstream the lookup was sent to */
+    struct attempt attempts[2];
+    /* struct dns_query or struct ut_query */
+    void *queries[2];
+    int ups[2];
+    struct timeval sent[2];
+    char name[];
+};
+
+static struct upstream ups[UP_MAX];
+static int nups = 0;
+static struct event_base *base;
+
+static uint64_t elapsed_us(const struct timeval *since) {
+    struct timeval now, diff;
+    gettimeofday(&now, NULL);
+    timersub(&now, since, &diff);
+    return (uint64_t) diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+static int bucket(uint64_t us) {
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && us >= (2ULL << b)) {
+        ++b;
+    }
+    return b;
+}
+
+static void record(struct upstream *up, uint64_t us) {
+    int b = bucket(us);
+
+    up->ewma_us = up->ewma_us == 0 ? us : up->ewma_us + EWMA_ALPHA * ((double) us - up->ewma_us);
+    ++up->hist[b];
+
+    if (++up->nrecent > HIST_DECAY) {
+        up->nrecent = 0;
+        for (int i = 0; i < HIST_BUCKETS; ++i) {
+            up->recent[i] /= 2;
+            up->nrecent += up->recent[i];
+        }
+    }
+    ++up->recent[b];
+}
+
+/* interpolates within the bucket holding the given fraction of the samples */
+static uint64_t percentile(const uint32_t *counts, uint64_t total, double p) {
+    uint64_t target = p * total, seen = 0;
+
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        if (seen + counts[b] > target) {
+            uint64_t lo = b ? 1ULL << b : 0, hi = 2ULL << b;
+            return lo + (hi - lo) * (target - seen) / counts[b];
+        }
+        seen += counts[b];
+    }
+    return 2ULL << (HIST_BUCKETS - 1);
+}
+
+static uint64_t hedge_us(const struct upstream *up) {
+    uint64_t us;
+
+    if (up->nrecent < HEDGE_MIN_SAMPLES) {
+        return HEDGE_DEFAULT_US;
+    }
+    us = percentile(up->recent, up->nrecent, HEDGE_PERCENTILE);
+    return us < HEDGE_MIN_US ? HEDGE_MIN_US : us > HEDGE_MAX_US ? HEDGE_MAX_US : us;
+}
+
+/* the fastest upstream other than `except' */
+static int best(int except) {
+    int ret = -1;
+    for (int i = 0; i < nups; ++i) {
+        if (i != except && (ret < 0 || ups[i].ewma_us < ups[ret].ewma_us)) {
+            ret = i;
+        }
+    }
+    return ret;
+}
+
+static void lookup_free(struct lookup *l) {
+    if (l->hedge_ev) {
+        event_free(l->hedge_ev);
+    }
+    free(l);
+}
+
+static void attempt_done(struct attempt *a, void *result, int status);
+
+static void a4_cb(struct dns_ctx *ctx, struct dns_rr_a4 *result, void *data) {
+    attempt_done(data, result, dns_status(ctx));
+}
+
+static void a6_cb(struct dns_ctx *ctx, struct dns_rr_a6 *result, void *data) {
+    attempt_done(data, result, dns_status(ctx));
+}
+
+static void tcp_cb(void *result, int status, void *data) {
+    attempt_done(data, result, status);
+}
+
+static void cancel_attempt(struct lookup *l, int i) {
+    struct upstream *up = &ups[l->ups[i]];
+
+    if (up->tcp) {
+        ut_cancel(l->queries[i]);
+    } else {
+        dns_cancel(up->ctx, l->queries[i]);
+    }
+}
+
+static int send_attempt(struct lookup *l) {
+    int i = l->nsent;
+    int u = best(i ? l->ups[0] : -1);
+    void *q;
+
+    if (u < 0) {
+        return -1;
+    }
+
+    l->attempts[i] = (struct attempt){l, i};
+    if (ups[u].tcp) {
+        q = ut_submit(ups[u].tcp, l->name, l->type == DNS_T_AAAA ? DNS_T_AAAA : DNS_T_A, tcp_cb, &l->attempts[i]);
+    } else if (l->type == DNS_T_AAAA) {
+        q = dns_submit_a6(ups[u].ctx, l->name, 0, a6_cb, &l->attempts[i]);
+    } else {
+        q = dns_submit_a4(ups[u].ctx, l->name, 0, a4_cb, &l->attempts[i]);
+    }
+    if (!q) {
+        return -1;
+    }
+
+    l->queries[i] = q;
+    l->ups[i] = u;
+    gettimeofday(&l->sent[i], NULL);
+    ++l->nsent;
+    ++l->outstanding;
+    ++ups[u].sent;
+
+    if (i == 0 && nups > 1) {
+        uint64_t us = hedge_us(&ups[u]);
+        struct timeval tv = {us / 1000000, us % 1000000};
+        evtimer_add(l->hedge_ev, &tv);
+    }
+
+    return 0;
+}
+
+static void hedge_cb(evutil_socket_t fd, short what, void *data) {
+    struct lookup *l = data;
+    (void) fd, (void) what;
+
+    if (l->nsent == 1 && send_attempt(l) == 0) {
+        ++ups[l->ups[1]].hedged;
+        metrics_inc(M_UPSTREAM_HEDGES);
+    }
+}
+
+static void attempt_done(struct attempt *a, void *result, int status) {
+    struct lookup *l = a->l;
+    struct upstream *up = &ups[l->ups[a->i]];
+    /* a name error or an empty answer is as good an answer as any */
+    bool answered = result || status == DNS_E_NXDOMAIN || status == DNS_E_NODATA;
+    uint64_t us, penalty;
+
+    l->queries[a->i] = NULL;
+    --l->outstanding;
+    us = elapsed_us(&l->sent[a->i]);
+    metrics_observe(M_UPSTREAM, us * 1000);
+
+    /* a quick SERVFAIL or REFUSED is no better than waiting out the hedge,
+     * so it must not make the upstream look fast */
+    penalty = hedge_us(up);
+    record(up, answered || us > penalty ? us : penalty);
+
+    if (answered) {
+        ++up->won;
+        for (int i = 0; i < l->nsent; ++i) {
+            if (l->queries[i]) {
+                /* the loser would have taken at least this long, and
+                 * counting it keeps a slowed-down upstream from staying
+                 * first in line forever */
+                record(&ups[l->ups[i]], elapsed_us(&l->sent[i]));
+                cancel_attempt(l, i);
+            }
+        }
+        l->cb(result, status, l->arg);
+        lookup_free(l);
+        return;
+    }
+
+    ++up->failed;
+    metrics_inc(M_UPSTREAM_FAILURES);
+    if (l->outstanding > 0) {
+        return;
+    }
+    if (l->nsent == 1 && nups > 1) {
+        evtimer_del(l->hedge_ev);
+        if (send_attempt(l) == 0) {
+            return;
+        }
+    }
+    l->cb(NULL, status, l->arg);
+    lookup_free(l);
+}
+
+int up_resolve(const char *name, int type, up_result_fn *cb, void *arg) {
+    struct lookup *l = calloc(1, sizeof(struct lookup) + strlen(name) + 1);
+
+    if (!l) {
+        perror("up_resolve: calloc");
+        return -1;
+    }
+    strcpy(l->name, name);
+    l->type = type;
+    l->cb = cb;
+    l->arg = arg;
+
+    l->hedge_ev = evtimer_new(base, hedge_cb, l);
+    if (!l->hedge_ev || send_attempt(l) < 0) {
+        lookup_free(l);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void io_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what;
+    dns_ioevent(data, 0);
+}
+
+static void timer_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what;
+    dns_timeouts(data, -1, 0);
+}
+
+/* udns asks for its timeouts to be checked in `timeout' seconds */
+static void utm_cb(struct dns_ctx *ctx, int timeout, void *data) {
+    struct upstream *up = data;
+    struct timeval tv = {timeout, 0};
+    (void) ctx;
+
+    if (timeout < 0) {
+        evtimer_del(up->timer_ev);
+    } else {
+        evtimer_add(up->timer_ev, &tv);
+    }
+}
+
+static void stats_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what, (void) data;
+
+    for (int i = 0; i < nups; ++i) {
+        struct upstream *up = &ups[i];
+        uint64_t total = 0;
+        uint32_t counts[HIST_BUCKETS];
+
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            total += up->hist[b];
+        }
+
+        fprintf(stderr, "upstream %s: %" PRIu64 " sent, %" PRIu64 " answered first, %" PRIu64 " failed, %" PRIu64 " hedged to; average %.1f ms",
+                up->addr, up->sent, up->won, up->failed, up->hedged, up->ewma_us / 1000);
+        if (total > 0) {
+            /* the lifetime counts can exceed 32 bits, so scale them down */
+            uint64_t max = 0, shift = 0;
+            for (int b = 0; b < HIST_BUCKETS; ++b) {
+                max = up->hist[b] > max ? up->hist[b] : max;
+            }
+            while ((max >> shift) > UINT32_MAX) {
+                ++shift;
+            }
+            total = 0;
+            for (int b = 0; b < HIST_BUCKETS; ++b) {
+                counts[b] = up->hist[b] >> shift;
+                total += counts[b];
+            }
+            fprintf(stderr, ", p50 %.1f ms, p95 %.1f ms, p99 %.1f ms",
+                    percentile(counts, total, 0.50) / 1000.0,
+                    percentile(counts, total, 0.95) / 1000.0,
+                    percentile(counts, total, 0.99) / 1000.0);
+        }
+        fputc('\n', stderr);
+
+        for (int b = 0; b < HIST_BUCKETS; ++b) {
+            if (up->hist[b]) {
+                fprintf(stderr, "    < %8.3f ms: %" PRIu64 "\n", (2ULL << b) / 1000.0, up->hist[b]);
+            }
+        }
+    }
+}
+
+void up_init(char *list, struct event_base *event_base, int tcp_conns) {
+    struct event *stats_ev;
+    char *save = NULL;
+
+    base = event_base;
+
+    /* every context copies the default one, which must not pick up
+     * resolv.conf: its search list would be appended to client names */
+    dns_reset(NULL);
+
+    for (char *addr = strtok_r(list, ",", &save); addr; addr = strtok_r(NULL, ",", &save)) {
+        struct upstream *up = &ups[nups];
+        int fd;
+
+        if (nups == UP_MAX) {
+            fprintf(stderr, "at most %d upstream servers are supported\n", UP_MAX);
+            exit(EXIT_FAILURE);
+        }
+
+        up->addr = addr;
+        if (tcp_conns > 0) {
+            up->tcp = ut_new(base, addr, tcp_conns);
+            ++nups;
+            continue;
+        }
+
+        up->ctx = dns_new(NULL);
+        if (!up->ctx) {
+            perror("dns_new");
+            exit(EXIT_FAILURE);
+        }
+        dns_add_serv(up->ctx, NULL);
+        if (dns_add_serv(up->ctx, addr) < 0) {
+            fprintf(stderr, "invalid upstream server %s\n", addr);
+            exit(EXIT_FAILURE);
+        }
+
+        fd = dns_open(up->ctx);
+        if (fd < 0) {
+            perror("dns_open");
+            exit(EXIT_FAILURE);
+        }
+
+        up->io_ev = event_new(base, fd, EV_READ | EV_PERSIST, io_cb, up->ctx);
+        up->timer_ev = evtimer_new(base, timer_cb, up->ctx);
+        if (!up->io_ev || !up->timer_ev || event_add(up->io_ev, NULL) < 0) {
+            perror("up_init: event_new");
+            exit(EXIT_FAILURE);
+        }
+        dns_set_tmcbck(up->ctx, utm_cb, up);
+
+        ++nups;
+    }
+
+    if (nups == 0) {
+        fprintf(stderr, "no upstream servers given\n");
+        exit(EXIT_FAILURE);
+    }
+
+    stats_ev = evsignal_new(base, SIGUSR1, stats_cb, NULL);
+    if (!stats_ev || event_add(stats_ev, NULL) < 0) {
+        perror("up_init: evsignal_new");
+        exit(EXIT_FAILURE);
+    }
+}
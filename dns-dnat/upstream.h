@@ -0,0 +1,12 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+#include <event2/event.h>
+
+/* gets a struct dns_rr_a4 or dns_rr_a6 to free, or NULL and a udns status */
+typedef void up_result_fn(void *, int, void *);
+
+void up_init(char *, struct event_base *, int);
+int up_resolve(const char *, int, up_result_fn *, void *);
+
+#endif
@@ -0,0 +1,306 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include <udns.h>
+
+#include "upstream_tcp.h"
+
+/*
+ * A few persistent TCP connections to one upstream server, with any number
+ * of queries outstanding on each (RFC 7766 pipelining).  Responses are
+ * matched to queries by ID, which is unique across the pool, and parsed with
+ * the same udns parsers as UDP answers.  Connections are opened on first use
+ * and reopened after the server closes them; queries that were outstanding
+ * on a connection that went away fail, and the caller may try elsewhere.
+ */
+
+#define UT_PORT 53
+/* seconds before an unanswered query fails */
+#define UT_TIMEOUT 5
+
+struct ut_conn {
+    struct ut_pool *pool;
+    struct bufferevent *bev;
+    int outstanding;
+};
+
+struct ut_query {
+    struct ut_pool *pool;
+    struct ut_conn *conn;
+    struct ut_query *next;
+    struct event *timeout_ev;
+    uint16_t id;
+    int type;
+    ut_result_fn *cb;
+    void *arg;
+    dnsc_t dn[DNS_MAXDN];
+};
+
+struct ut_pool {
+    struct event_base *base;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int nconns;
+    struct ut_conn *conns;
+    uint16_t next_id;
+    /* outstanding queries by ID */
+    struct ut_query *queries[1 << 16];
+};
+
+static void query_finish(struct ut_query *q, void *result, int status) {
+    if (q->pool->queries[q->id] == q) {
+        q->pool->queries[q->id] = NULL;
+    }
+    if (q->conn) {
+        --q->conn->outstanding;
+    }
+    event_free(q->timeout_ev);
+    q->cb(result, status, q->arg);
+    free(q);
+}
+
+static void conn_reset(struct ut_conn *conn) {
+    struct ut_pool *pool = conn->pool;
+
+    struct ut_query *failed = NULL;
+
+    bufferevent_free(conn->bev);
+    conn->bev = NULL;
+
+    /* detach everything first, since the callbacks may submit new queries,
+     * possibly on a new connection in this same slot */
+    for (int id = 0; id < (1 << 16) && conn->outstanding > 0; ++id) {
+        struct ut_query *q = pool->queries[id];
+        if (q && q->conn == conn) {
+            pool->queries[id] = NULL;
+            q->conn = NULL;
+            q->next = failed;
+            failed = q;
+            --conn->outstanding;
+        }
+    }
+
+    while (failed) {
+        struct ut_query *q = failed;
+        failed = q->next;
+        query_finish(q, NULL, DNS_E_TEMPFAIL);
+    }
+}
+
+static void handle_response(struct ut_pool *pool, dnscc_t *pkt, size_t len) {
+    dnsc_t dn[DNS_MAXDN];
+    dnscc_t *cur = pkt + DNS_HSIZE, *end = pkt + len;
+    struct ut_query *q;
+    void *result = NULL;
+    int status;
+
+    if (len < DNS_HSIZE || !(q = pool->queries[(pkt[0] << 8) | pkt[1]])) {
+        return;
+    }
+
+    /* the question has to match too, as with UDP */
+    if (((pkt[4] << 8) | pkt[5]) != 1 || dns_getdn(pkt, &cur, end, dn, sizeof(dn)) <= 0 || cur + 4 > end
+            || dns_dnlen(dn) != dns_dnlen(q->dn) || memcmp(dn, q->dn, dns_dnlen(dn)) != 0
+            || ((cur[0] << 8) | cur[1]) != q->type) {
+        return;
+    }
+
+    switch (pkt[3] & 0x0f) {
+        case 0:
+            if (((pkt[6] << 8) | pkt[7]) == 0) {
+                status = DNS_E_NODATA;
+            } else {
+                status = q->type == DNS_T_AAAA ? dns_parse_a6(q->dn, pkt, cur, end, &result)
+                    : dns_parse_a4(q->dn, pkt, cur, end, &result);
+            }
+            break;
+        case 3:
+            status = DNS_E_NXDOMAIN;
+            break;
+        default:
+            status = DNS_E_TEMPFAIL;
+            break;
+    }
+
+    query_finish(q, status < 0 ? NULL : result, status < 0 ? status : 0);
+}
+
+static void read_cb(struct bufferevent *bev, void *data) {
+    struct ut_conn *conn = data;
+    struct evbuffer *in = bufferevent_get_input(bev);
+
+    for (;;) {
+        uint16_t len;
+
+        if (evbuffer_copyout(in, &len, 2) < 2) {
+            break;
+        }
+        len = ntohs(len);
+        if (evbuffer_get_length(in) < 2 + (size_t) len) {
+            break;
+        }
+
+        handle_response(conn->pool, evbuffer_pullup(in, 2 + len) + 2, len);
+        evbuffer_drain(in, 2 + len);
+    }
+}
+
+static void event_cb(struct bufferevent *bev, short what, void *data) {
+    (void) bev;
+
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        conn_reset(data);
+    }
+}
+
+static void timeout_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what;
+    query_finish(data, NULL, DNS_E_TEMPFAIL);
+}
+
+static struct ut_conn *conn_get(struct ut_pool *pool) {
+    struct ut_conn *conn = &pool->conns[0];
+
+    for (int i = 1; i < pool->nconns; ++i) {
+        if (pool->conns[i].outstanding < conn->outstanding) {
+            conn = &pool->conns[i];
+        }
+    }
+
+    if (!conn->bev) {
+        conn->bev = bufferevent_socket_new(pool->base, -1, BEV_OPT_CLOSE_ON_FREE);
+        if (!conn->bev) {
+            return NULL;
+        }
+        bufferevent_setcb(conn->bev, read_cb, NULL, event_cb, conn);
+        bufferevent_enable(conn->bev, EV_READ);
+        /* writes are buffered until the connection is up */
+        if (bufferevent_socket_connect(conn->bev, (struct sockaddr *) &pool->addr, pool->addrlen) < 0) {
+            bufferevent_free(conn->bev);
+            conn->bev = NULL;
+            return NULL;
+        }
+    }
+
+    return conn;
+}
+
+struct ut_query *ut_submit(struct ut_pool *pool, const char *name, int type, ut_result_fn *cb, void *arg) {
+    struct timeval timeout = {UT_TIMEOUT, 0};
+    struct ut_query *q;
+    struct ut_conn *conn;
+    uint8_t hdr[2 + DNS_HSIZE], tail[4];
+    int dnlen;
+
+    /* IDs are handed out in turn, skipping ones still in use */
+    for (int i = 0; pool->queries[pool->next_id]; ++i, ++pool->next_id) {
+        if (i == 0xffff) {
+            return NULL;
+        }
+    }
+
+    q = calloc(1, sizeof(struct ut_query));
+    if (!q) {
+        return NULL;
+    }
+    dnlen = dns_ptodn(name, 0, q->dn, sizeof(q->dn), NULL);
+    q->timeout_ev = evtimer_new(pool->base, timeout_cb, q);
+    conn = dnlen > 0 && q->timeout_ev ? conn_get(pool) : NULL;
+    if (!conn) {
+        if (q->timeout_ev) {
+            event_free(q->timeout_ev);
+        }
+        free(q);
+        return NULL;
+    }
+
+    q->pool = pool;
+    q->conn = conn;
+    q->id = pool->next_id++;
+    q->type = type;
+    q->cb = cb;
+    q->arg = arg;
+
+    hdr[0] = (DNS_HSIZE + dnlen + 4) >> 8;
+    hdr[1] = DNS_HSIZE + dnlen + 4;
+    hdr[2] = q->id >> 8;
+    hdr[3] = q->id;
+    /* RD */
+    hdr[4] = 0x01;
+    hdr[5] = 0;
+    /* one question */
+    hdr[6] = 0;
+    hdr[7] = 1;
+    memset(hdr + 8, 0, 6);
+    tail[0] = type >> 8;
+    tail[1] = type;
+    tail[2] = 0;
+    tail[3] = DNS_C_IN;
+
+    bufferevent_write(conn->bev, hdr, sizeof(hdr));
+    bufferevent_write(conn->bev, q->dn, dnlen);
+    bufferevent_write(conn->bev, tail, sizeof(tail));
+
+    pool->queries[q->id] = q;
+    ++conn->outstanding;
+    evtimer_add(q->timeout_ev, &timeout);
+
+    return q;
+}
+
+void ut_cancel(struct ut_query *q) {
+    q->pool->queries[q->id] = NULL;
+    --q->conn->outstanding;
+    event_free(q->timeout_ev);
+    free(q);
+}
+
+struct ut_pool *ut_new(struct event_base *base, const char *addr, int nconns) {
+    struct ut_pool *pool = calloc(1, sizeof(struct ut_pool));
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+
+    if (!pool) {
+        perror("ut_new: calloc");
+        exit(EXIT_FAILURE);
+    }
+    sin = (struct sockaddr_in *) &pool->addr;
+    sin6 = (struct sockaddr_in6 *) &pool->addr;
+
+    if (inet_pton(AF_INET, addr, &sin->sin_addr) == 1) {
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(UT_PORT);
+        pool->addrlen = sizeof(*sin);
+    } else if (inet_pton(AF_INET6, addr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(UT_PORT);
+        pool->addrlen = sizeof(*sin6);
+    } else {
+        fprintf(stderr, "invalid upstream server %s\n", addr);
+        exit(EXIT_FAILURE);
+    }
+
+    pool->base = base;
+    pool->nconns = nconns;
+    pool->next_id = random();
+    pool->conns = calloc(nconns, sizeof(struct ut_conn));
+    if (!pool->conns) {
+        perror("ut_new: calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nconns; ++i) {
+        pool->conns[i].pool = pool;
+    }
+
+    return pool;
+}
@@ -0,0 +1,16 @@
+#ifndef __UPSTREAM_TCP_H__
+#define __UPSTREAM_TCP_H__
+
+#include <event2/event.h>
+
+struct ut_pool;
+struct ut_query;
+
+/* as up_result_fn */
+typedef void ut_result_fn(void *, int, void *);
+
+struct ut_pool *ut_new(struct event_base *, const char *, int);
+struct ut_query *ut_submit(struct ut_pool *, const char *, int, ut_result_fn *, void *);
+void ut_cancel(struct ut_query *);
+
+#endif
@@ -0,0 +1,266 @@
+/*
+ * The `test' build: runs upstream_tcp.c against a stub DNS server on the
+ * loopback, in the same event loop.  The stub answers according to the name
+ * asked for:
+ *
+ *     nN.test      192.0.2.N, but only once `batch' such queries are waiting,
+ *                  and then the last one first
+ *     drop.test    never
+ *     close.test   by closing the connection
+ *
+ * which takes one connection through pipelined queries answered out of order,
+ * a query timing out after UT_TIMEOUT seconds, and the server hanging up with
+ * queries outstanding, after which the next query has to reconnect.
+ */
+
+#include "upstream_tcp.c"
+
+#include <time.h>
+#include <sys/time.h>
+
+#include <event2/listener.h>
+
+#define TEST_PIPELINE 8
+/* seconds the whole test may take */
+#define TEST_DEADLINE (UT_TIMEOUT + 10)
+
+struct stub_query {
+    struct bufferevent *bev;
+    uint8_t pkt[DNS_MAXPACKET];
+    uint16_t len;
+    int n;
+};
+
+static struct event_base *base;
+static struct ut_pool *pool;
+
+/* the stub's side */
+static struct stub_query waiting[TEST_PIPELINE];
+static int nwaiting = 0, batch = TEST_PIPELINE, naccepted = 0;
+
+/* the client's side */
+static int phase = 0, ndone = 0, order[TEST_PIPELINE];
+static struct timespec submitted;
+static bool failed = false;
+
+static void fail(const char *msg) {
+    fprintf(stderr, "phase %d: %s\n", phase, msg);
+    failed = true;
+    event_base_loopbreak(base);
+}
+
+static double elapsed(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - submitted.tv_sec) + (now.tv_nsec - submitted.tv_nsec) / 1e9;
+}
+
+static void stub_answer(struct stub_query *sq) {
+    uint8_t resp[2 + DNS_MAXPACKET], *an;
+    uint16_t len = sq->len + 16;
+
+    resp[0] = len >> 8;
+    resp[1] = len;
+    memcpy(resp + 2, sq->pkt, sq->len);
+    /* QR, RD, RA, NOERROR, one answer */
+    resp[2 + 2] = 0x81;
+    resp[2 + 3] = 0x80;
+    resp[2 + 6] = 0;
+    resp[2 + 7] = 1;
+
+    /* the question's name, A, IN, TTL 60, 192.0.2.N */
+    an = resp + 2 + sq->len;
+    memcpy(an, (uint8_t[]) {0xc0, DNS_HSIZE, 0, DNS_T_A, 0, DNS_C_IN, 0, 0, 0, 60, 0, 4, 192, 0, 2, sq->n}, 16);
+
+    bufferevent_write(sq->bev, resp, 2 + len);
+}
+
+static void stub_read_cb(struct bufferevent *bev, void *data) {
+    struct evbuffer *in = bufferevent_get_input(bev);
+    (void) data;
+
+    for (;;) {
+        dnsc_t dn[DNS_MAXDN];
+        char name[DNS_MAXNAME];
+        dnscc_t *pkt, *cur;
+        uint16_t len;
+        int n;
+
+        if (evbuffer_copyout(in, &len, 2) < 2) {
+            return;
+        }
+        len = ntohs(len);
+        if (evbuffer_get_length(in) < 2 + (size_t) len) {
+            return;
+        }
+        pkt = evbuffer_pullup(in, 2 + len) + 2;
+        cur = pkt + DNS_HSIZE;
+        if (len > DNS_MAXPACKET || dns_getdn(pkt, &cur, pkt + len, dn, sizeof(dn)) <= 0
+                || dns_dntop(dn, name, sizeof(name)) <= 0) {
+            fail("stub got a malformed query");
+            return;
+        }
+
+        if (strcmp(name, "close.test") == 0) {
+            bufferevent_free(bev);
+            return;
+        } else if (sscanf(name, "n%d.test", &n) == 1 && nwaiting < batch) {
+            struct stub_query *sq = &waiting[nwaiting++];
+            sq->bev = bev;
+            memcpy(sq->pkt, pkt, len);
+            sq->len = len;
+            sq->n = n;
+        } else if (strcmp(name, "drop.test") != 0) {
+            fail("stub got an unexpected query");
+            return;
+        }
+        evbuffer_drain(in, 2 + len);
+
+        if (nwaiting == batch) {
+            while (nwaiting > 0) {
+                stub_answer(&waiting[--nwaiting]);
+            }
+        }
+    }
+}
+
+static void stub_event_cb(struct bufferevent *bev, short what, void *data) {
+    (void) data;
+    if (what & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+        bufferevent_free(bev);
+    }
+}
+
+static void stub_accept_cb(struct evconnlistener *listener, evutil_socket_t fd, struct sockaddr *addr, int len, void *data) {
+    struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    (void) listener, (void) addr, (void) len, (void) data;
+
+    ++naccepted;
+    bufferevent_setcb(bev, stub_read_cb, NULL, stub_event_cb, NULL);
+    bufferevent_enable(bev, EV_READ);
+}
+
+static void submit(const char *name, ut_result_fn *cb, intptr_t arg) {
+    if (!ut_submit(pool, name, DNS_T_A, cb, (void *) arg)) {
+        fail("ut_submit failed");
+    }
+}
+
+static void reconnected_cb(void *result, int status, void *arg) {
+    struct dns_rr_a4 *rr = result;
+    (void) arg;
+
+    if (status != 0 || rr->dnsa4_nrr != 1 || rr->dnsa4_addr[0].s_addr != htonl(0xc0000209)) {
+        fail("no answer after reconnecting");
+    } else if (naccepted != 2) {
+        fail("expected a second connection");
+    } else {
+        printf("reconnected after the server hung up\n");
+        event_base_loopbreak(base);
+    }
+    free(result);
+}
+
+static void hangup_cb(void *result, int status, void *arg) {
+    (void) result, (void) arg;
+
+    if (status != DNS_E_TEMPFAIL || elapsed() >= UT_TIMEOUT) {
+        fail("outstanding queries didn't fail when the server hung up");
+        return;
+    }
+    if (++ndone == 2) {
+        printf("outstanding queries failed when the server hung up\n");
+        phase = 3;
+        batch = 1;
+        submit("n9.test", reconnected_cb, 0);
+    }
+}
+
+static void timeout_test_cb(void *result, int status, void *arg) {
+    double t = elapsed();
+    (void) result, (void) arg;
+
+    if (status != DNS_E_TEMPFAIL || t < UT_TIMEOUT - 0.1 || t > UT_TIMEOUT + 1) {
+        fail("unanswered query didn't time out after UT_TIMEOUT");
+        return;
+    }
+    printf("unanswered query timed out after %.1fs\n", t);
+
+    phase = 2;
+    ndone = 0;
+    clock_gettime(CLOCK_MONOTONIC, &submitted);
+    submit("drop.test", hangup_cb, 0);
+    submit("close.test", hangup_cb, 0);
+}
+
+static void pipelined_cb(void *result, int status, void *arg) {
+    struct dns_rr_a4 *rr = result;
+    int n = (intptr_t) arg;
+
+    if (status != 0 || rr->dnsa4_nrr != 1 || rr->dnsa4_addr[0].s_addr != htonl(0xc0000200 | n)) {
+        fail("wrong answer to a pipelined query");
+        free(result);
+        return;
+    }
+    free(result);
+    order[ndone++] = n;
+    if (ndone < TEST_PIPELINE) {
+        return;
+    }
+
+    for (int i = 0; i < TEST_PIPELINE; ++i) {
+        if (order[i] != TEST_PIPELINE - i) {
+            fail("answers weren't matched up out of order");
+            return;
+        }
+    }
+    if (naccepted != 1) {
+        fail("pipelined queries used more than one connection");
+        return;
+    }
+    printf("%d pipelined queries answered in reverse order on one connection\n", TEST_PIPELINE);
+
+    phase = 1;
+    clock_gettime(CLOCK_MONOTONIC, &submitted);
+    submit("drop.test", timeout_test_cb, 0);
+}
+
+static void deadline_cb(evutil_socket_t fd, short what, void *data) {
+    (void) fd, (void) what, (void) data;
+    fail("timed out");
+}
+
+int main(void) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t addrlen = sizeof(addr);
+    struct timeval deadline = {TEST_DEADLINE, 0};
+    struct evconnlistener *listener;
+
+    base = event_base_new();
+    if (!base) {
+        fprintf(stderr, "event_base_new failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    listener = evconnlistener_new_bind(base, stub_accept_cb, NULL, LEV_OPT_CLOSE_ON_FREE | LEV_OPT_REUSEABLE, -1,
+            (struct sockaddr *) &addr, sizeof(addr));
+    if (!listener || getsockname(evconnlistener_get_fd(listener), (struct sockaddr *) &addr, &addrlen) < 0) {
+        perror("stub server");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the stub isn't on port 53 */
+    pool = ut_new(base, "127.0.0.1", 1);
+    ((struct sockaddr_in *) &pool->addr)->sin_port = addr.sin_port;
+
+    for (int n = 1; n <= TEST_PIPELINE; ++n) {
+        char name[16];
+        snprintf(name, sizeof(name), "n%d.test", n);
+        submit(name, pipelined_cb, n);
+    }
+    event_base_once(base, -1, EV_TIMEOUT, deadline_cb, NULL, &deadline);
+
+    event_base_dispatch(base);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
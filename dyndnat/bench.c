@@ -0,0 +1,90 @@
+/*
+ * The `bench' build: replays packets through queue_cb() and nfct_add(), with
+ * the netlink socket and conntrack replaced by stubs (see ../bench/replay.c).
+ * Mapped destinations go into a NAT table that is loaded with nt_read().
+ */
+
+#include <errno.h>
+
+#include <libnetfilter_conntrack/libnetfilter_conntrack.h>
+
+#include "nfqueue.c"
+#include "nat_table.h"
+#include "replay.h"
+
+#define BENCH_FLOWS_BITS 21
+
+/* conntrack as nfct_add() sees it: a set of flows, by a hash of the tuple */
+static uint64_t flows[1 << BENCH_FLOWS_BITS];
+static uint32_t nflows = 0;
+
+static char table_path[] = "/tmp/dyndnat-bench.XXXXXX";
+static FILE *table;
+static uint32_t nmapped = 0;
+
+static uint64_t flow_hash(const struct nf_conntrack *ct) {
+    uint64_t h = 14695981039346656037ull;
+    uint32_t fields[] = {
+        nfct_get_attr_u32(ct, ATTR_IPV4_SRC),
+        nfct_get_attr_u32(ct, ATTR_IPV4_DST),
+        nfct_get_attr_u8(ct, ATTR_L4PROTO),
+        nfct_get_attr_u16(ct, ATTR_PORT_SRC),
+        nfct_get_attr_u16(ct, ATTR_PORT_DST),
+    };
+
+    for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+        h = (h ^ fields[i]) * 1099511628211ull;
+    }
+    /* 0 marks a free slot */
+    return h | 1;
+}
+
+int nfct_query(struct nfct_handle *h, const enum nf_conntrack_query query, const void *data) {
+    uint64_t key = flow_hash(data);
+    uint32_t mask = (1 << BENCH_FLOWS_BITS) - 1, i;
+    (void) h;
+
+    for (i = key & mask; flows[i] != 0; i = (i + 1) & mask) {
+        if (flows[i] == key) {
+            if (query == NFCT_Q_CREATE) {
+                errno = EEXIST;
+                return -1;
+            }
+            return 0;
+        }
+    }
+    if (query != NFCT_Q_CREATE) {
+        errno = ENOENT;
+        return -1;
+    }
+    /* past three quarters full, new flows are simply forgotten */
+    if (nflows < mask / 4 * 3) {
+        flows[i] = key;
+        ++nflows;
+    }
+    return 0;
+}
+
+static void map(uint8_t *daddr, int version) {
+    (void) version;
+    fprintf(table, "%u.%u.%u.%u,100.64.%u.%u\n", daddr[0], daddr[1], daddr[2], daddr[3], (nmapped >> 8) & 0xff, nmapped & 0xff);
+    ++nmapped;
+}
+
+static void ready(void) {
+    fclose(table);
+    nt_read(table_path);
+    unlink(table_path);
+}
+
+int main(int argc, char **argv) {
+    struct replay_ops ops = {.ipv6 = false, .map = map, .ready = ready, .cb = queue_cb};
+    int fd = mkstemp(table_path);
+
+    if (fd < 0 || !(table = fdopen(fd, "w"))) {
+        perror("mkstemp");
+        exit(EXIT_FAILURE);
+    }
+
+    return replay_main(argc, argv, &ops);
+}
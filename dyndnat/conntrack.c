@@ -11,6 +11,7 @@
 #include <libnetfilter_conntrack/libnetfilter_conntrack.h>
 #include <libnetfilter_conntrack/libnetfilter_conntrack_tcp.h>
 
+#include "metrics.h"
 #include "nat_table.h"
 
 static struct nfct_handle *handle;
@@ -27,6 +28,19 @@ void nfct_cleanup(void) {
   nfct_close(handle);
 }
 
+/* a GET that finds nothing is how a new flow is found, not a failure */
+static int ct_query(enum nf_conntrack_query query, struct nf_conntrack *ct, enum metrics_counter counter) {
+    uint64_t start = metrics_now();
+    int ret = nfct_query(handle, query, ct);
+
+    metrics_observe(M_CT_QUERY, metrics_now() - start);
+    metrics_inc(counter);
+    if (ret == -1 && query != NFCT_Q_GET) {
+        metrics_inc(M_CT_FAILURES);
+    }
+    return ret;
+}
+
 union l4hdr {
     struct tcphdr tcp;
     struct udphdr udp;
@@ -42,8 +56,10 @@ int nfct_add(uint8_t *pkt) {
 
     in_addr_t new_daddr = nt_lookup(ip->daddr);
     if (new_daddr == (in_addr_t) -1) {
+      metrics_inc(M_NAT_MISSES);
       return 0;
     }
+    metrics_inc(M_NAT_HITS);
 
     ct = nfct_new();
     if (!ct) {
@@ -80,7 +96,7 @@ int nfct_add(uint8_t *pkt) {
 
     nfct_set_attr_u32(ct, ATTR_DNAT_IPV4, new_daddr);
 
-    ret = nfct_query(handle, NFCT_Q_GET, ct);
+    ret = ct_query(NFCT_Q_GET, ct, M_CT_GETS);
     if (ret == -1) {
         char s_saddr[16], s_daddr[16], s_naddr[16], s_proto[9], s_sport[7], s_dport[7];
         inet_ntop(AF_INET, &(ip->saddr), s_saddr, 16);
@@ -104,7 +120,7 @@ int nfct_add(uint8_t *pkt) {
         }
         fprintf(stderr, "adding %s connection from %s%s to %s%s with DNAT to %s\n", s_proto, s_saddr, s_sport, s_daddr, s_dport, s_naddr);
 
-        ret = nfct_query(handle, NFCT_Q_CREATE, ct);
+        ret = ct_query(NFCT_Q_CREATE, ct, M_CT_CREATES);
         if (ret == -1) {
             perror("nfct_query");
         }
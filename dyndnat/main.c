@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "inotify.h"
+#include "metrics.h"
 #include "nat_table.h"
 #include "nfqueue.h"
 
@@ -14,27 +16,42 @@ void *nfq_loop_wrapper(void *queue_num) {
 int main(int argc, char **argv) {
     unsigned int queue_num;
     pthread_t nfq_thread;
-    char *endptr = NULL;
+    char *endptr = NULL, *metrics_path = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:")) != -1) {
+        switch (opt) {
+            case 'm':
+                metrics_path = optarg;
+                break;
+            default:
+                goto usage;
+        }
+    }
 
-    if (argc != 3) {
+    if (argc - optind != 2) {
         goto usage;
     }
 
     endptr = NULL;
-    queue_num = (unsigned int) strtoul(argv[1], &endptr, 10);
-    if (argv[1][0] == '\0' || *endptr != '\0') {
+    queue_num = (unsigned int) strtoul(argv[optind], &endptr, 10);
+    if (argv[optind][0] == '\0' || *endptr != '\0') {
         goto usage;
     }
 
-    nt_read(argv[2]);
+    nt_read(argv[optind + 1]);
+
+    if (metrics_path) {
+        metrics_init(metrics_path);
+    }
 
     pthread_create(&nfq_thread, NULL, nfq_loop_wrapper, &queue_num);
 
-    in_watch(argv[2]);
+    in_watch(argv[optind + 1]);
 
     exit(EXIT_SUCCESS);
 
 usage:
-    fprintf(stderr, "usage: %s queue_num /path/to/csv\n", argv[0]);
+    fprintf(stderr, "usage: %s [-m metrics.sock] queue_num /path/to/table\n", argv[0]);
     exit(EXIT_FAILURE);
 }
@@ -0,0 +1,42 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#define METRICS_PREFIX "dyndnat_"
+
+/* X(id, name, labels, help), entries of the same name kept together */
+#define METRICS_COUNTERS(X) \
+    X(PACKETS_QUEUED, "packets_queued_total", "", "Packets read from the queue") \
+    X(PACKETS_VERDICTED, "packets_verdicted_total", "", "Verdicts sent back to the kernel") \
+    X(NAT_HITS, "nat_lookups_total", "result=\"hit\"", "Lookups in the NAT table") \
+    X(NAT_MISSES, "nat_lookups_total", "result=\"miss\"", "Lookups in the NAT table") \
+    X(CT_GETS, "conntrack_queries_total", "query=\"get\"", "Queries sent to conntrack") \
+    X(CT_CREATES, "conntrack_queries_total", "query=\"create\"", "Queries sent to conntrack") \
+    X(CT_FAILURES, "conntrack_failures_total", "", "Connections that could not be added to conntrack") \
+    X(TABLE_RELOAD_FAILURES, "nat_table_reload_failures_total", "", "NAT table reloads that kept the old table")
+
+#define METRICS_GAUGES(X) \
+    X(TABLE_ENTRIES, "nat_table_entries", "", "Mappings in the NAT table")
+
+/* X(id, name, help) */
+#define METRICS_HISTOGRAMS(X) \
+    X(CT_QUERY, "conntrack_query_seconds", "Time taken by queries to conntrack") \
+    X(TABLE_RELOAD, "nat_table_reload_seconds", "Time taken to load the NAT table")
+
+#define METRICS_ENUM(id, ...) M_##id,
+enum metrics_counter {METRICS_COUNTERS(METRICS_ENUM) M_COUNTERS};
+enum metrics_gauge {METRICS_GAUGES(METRICS_ENUM) M_GAUGES};
+enum metrics_histogram {METRICS_HISTOGRAMS(METRICS_ENUM) M_HISTOGRAMS};
+#undef METRICS_ENUM
+
+void metrics_init(char *);
+void metrics_queue(unsigned int);
+void metrics_inc(enum metrics_counter);
+void metrics_add(enum metrics_counter, uint64_t);
+void metrics_set(enum metrics_gauge, int64_t);
+void metrics_omit(enum metrics_gauge);
+void metrics_observe(enum metrics_histogram, uint64_t);
+uint64_t metrics_now(void);
+
+#endif
@@ -4,20 +4,101 @@
 #include <errno.h>
 #include <pthread.h>
 
+#include <sys/stat.h>
 #include <arpa/inet.h>
 
-static uint32_t *keys;
-static in_addr_t *vals;
-static uint16_t *bins = NULL;
+#include "metrics.h"
+#include "nat_table.h"
+
+static struct nt_table *table = NULL;
 
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 
+static struct nt_table *nt_alloc(uint16_t count) {
+    struct nt_table *t = malloc(NT_SIZE(count));
+    if (!t) {
+        return NULL;
+    }
+    t->magic = NT_MAGIC;
+    t->count = count;
+    t->pad = 0;
+    return t;
+}
+
+/*
+ * The table as resolve-hostsfile -b writes it, already sorted and indexed, so
+ * all that's left is to check that lookups in it will stay in bounds and
+ * find what they are looking for.
+ */
+static struct nt_table *nt_read_binary(FILE *file, char *fp) {
+    struct nt_table hdr, *t;
+    struct stat st;
+
+    if (fread(&hdr, sizeof(struct nt_table), 1, file) != 1) {
+        goto nt_read_binary_malformed;
+    }
+    if (fstat(fileno(file), &st) == -1) {
+        perror("nt_read: fstat");
+        return NULL;
+    }
+    if (hdr.count > UINT16_MAX || st.st_size != (off_t) NT_SIZE(hdr.count)) {
+        goto nt_read_binary_malformed;
+    }
+
+    t = nt_alloc(hdr.count);
+    if (!t) {
+        perror("nt_read: malloc");
+        return NULL;
+    }
+    rewind(file);
+    if (fread(t, NT_SIZE(hdr.count), 1, file) != 1) {
+        if (ferror(file)) {
+            perror("nt_read: fread");
+        } else {
+            fprintf(stderr, "malformed data in file `%s'\n", fp);
+        }
+        free(t);
+        return NULL;
+    }
+
+    if (t->bins[0] != 0 || t->bins[256] != t->count) {
+        goto nt_read_binary_unsorted;
+    }
+    for (uint16_t bin = 0; bin < 256; ++bin) {
+        if (t->bins[bin] > t->bins[bin+1]) {
+            goto nt_read_binary_unsorted;
+        }
+        for (uint16_t i = t->bins[bin]; i < t->bins[bin+1]; ++i) {
+            if (t->keys[i] % 256 != bin || (i > t->bins[bin] && t->keys[i] <= t->keys[i-1])) {
+                goto nt_read_binary_unsorted;
+            }
+        }
+    }
+
+    fprintf(stderr, "reading in new NAT table, %u mappings\n", (unsigned) t->count);
+
+    return t;
+
+nt_read_binary_unsorted:
+
+    free(t);
+
+    /* continue */
+
+nt_read_binary_malformed:
+
+    fprintf(stderr, "malformed data in file `%s'\n", fp);
+    return NULL;
+}
+
 int nt_read(char *fp) {
     FILE* file;
-    uint32_t *old_keys = keys, *new_keys = NULL, *tmp_keys = NULL;
-    in_addr_t *old_vals = vals, *new_vals = NULL, *tmp_vals = NULL;
-    uint16_t *old_bins = bins, *new_bins = NULL, *sorted_order = NULL;
+    struct nt_table *old_table = table, *new_table = NULL;
+    uint32_t *tmp_keys = NULL, magic;
+    in_addr_t *tmp_vals = NULL;
+    uint16_t *sorted_order = NULL;
     uint16_t nlines;
+    uint64_t start = metrics_now();
 
     file = fopen(fp, "r");
     if (!file) {
@@ -25,9 +106,30 @@ int nt_read(char *fp) {
         goto nt_read_failure;
     }
 
+    if (fread(&magic, sizeof(magic), 1, file) == 1 && magic == NT_MAGIC) {
+        rewind(file);
+        new_table = nt_read_binary(file, fp);
+        if (!new_table) {
+            goto nt_read_failure;
+        }
+        fclose(file);
+        goto nt_read_swap;
+    }
+    if (ferror(file)) {
+        perror("nt_read: fread");
+        goto nt_read_failure;
+    }
+    rewind(file);
+
     nlines = 0;
     for (int chr; (chr = getc(file)) != EOF;) {
         if (chr == ',') {
+            /* the table is indexed with 16 bits, so the count would wrap
+             * and the arrays below would be too small */
+            if (nlines == UINT16_MAX) {
+                fprintf(stderr, "more than %u mappings in file `%s'\n", UINT16_MAX, fp);
+                goto nt_read_failure;
+            }
             ++nlines;
         }
     }
@@ -99,15 +201,16 @@ int nt_read(char *fp) {
         goto nt_read_failure;
     }
 
-    new_keys = malloc(nlines * sizeof(in_addr_t));
-    new_vals = malloc(nlines * sizeof(in_addr_t));
-    new_bins = malloc(257 * sizeof(uint16_t));
-    if (!new_keys || !new_vals || !new_bins) {
+    new_table = nt_alloc(nlines);
+    if (!new_table) {
         perror("nt_read: malloc");
         goto nt_read_failure;
     }
 
     {
+        uint32_t *new_keys = new_table->keys;
+        in_addr_t *new_vals = NT_VALS(new_table);
+        uint16_t *new_bins = new_table->bins;
         fprintf(stderr, "reading in new NAT table\n");
         char s_key[16], s_val[16];
         uint16_t next_bin = 0;
@@ -134,19 +237,18 @@ int nt_read(char *fp) {
 
     fclose(file);
 
+nt_read_swap:
+
     pthread_mutex_lock(&mutex);
 
-    keys = new_keys;
-    vals = new_vals;
-    bins = new_bins;
+    table = new_table;
 
     pthread_mutex_unlock(&mutex);
 
-    if (old_bins) {
-        free(old_keys);
-        free(old_vals);
-        free(old_bins);
-    }
+    free(old_table);
+
+    metrics_set(M_TABLE_ENTRIES, new_table->count);
+    metrics_observe(M_TABLE_RELOAD, metrics_now() - start);
 
     return 0;
 
@@ -162,15 +264,15 @@ nt_read_failure:
         fclose(file);
     }
 
-    free(new_keys);
-    free(new_vals);
-    free(new_bins);
+    free(new_table);
 
     free(tmp_keys);
     free(tmp_vals);
+    free(sorted_order);
 
-    if (old_bins != NULL) {
+    if (old_table != NULL) {
         fprintf(stderr, "error loading new NAT table, continuing with old one\n");
+        metrics_inc(M_TABLE_RELOAD_FAILURES);
         return -1;
     } else {
         fprintf(stderr, "fatal error loading NAT table\n");
@@ -185,16 +287,15 @@ in_addr_t nt_lookup(in_addr_t addr_raw) {
 
     pthread_mutex_lock(&mutex);
 
-    if (bins) {
-        uint16_t bin = bins[addr % 256];
-        uint16_t bin_next = bins[(addr % 256) + 1];
+    if (table) {
+        uint32_t *keys = table->keys;
+        int32_t l = table->bins[addr % 256];
+        int32_t r = (int32_t) table->bins[(addr % 256) + 1] - 1;
 
-        uint16_t l = bin;
-        uint16_t r = bin_next - 1;
         while (l <= r) {
-            uint16_t m = (l + r) / 2;
+            int32_t m = (l + r) / 2;
             if (keys[m] == addr) {
-                ret = vals[m];
+                ret = NT_VALS(table)[m];
                 break;
             } else if (keys[m] < addr) {
                 l = m + 1;
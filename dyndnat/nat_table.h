@@ -1,8 +1,29 @@
 #ifndef __NAT_TABLE_H__
 #define __NAT_TABLE_H__
 
+#include <stdint.h>
 #include <arpa/inet.h>
 
+/*
+ * The NAT table, both in memory and as resolve-hostsfile -b writes it: keys
+ * (in host byte order) sorted by their last octet and then by value, with
+ * bins[n] the index of the first key whose last octet is at least n, followed
+ * by the value for each key (in network byte order).  The magic number also
+ * tells a file written on a host of the other endianness apart.
+ */
+#define NT_MAGIC 0x544e4444 /* "DDNT" on little-endian hosts */
+
+struct nt_table {
+    uint32_t magic;
+    uint32_t count;
+    uint16_t bins[257];
+    uint16_t pad;
+    uint32_t keys[];
+};
+
+#define NT_VALS(t) ((in_addr_t *) ((t)->keys + (t)->count))
+#define NT_SIZE(count) (sizeof(struct nt_table) + (size_t) (count) * (sizeof(uint32_t) + sizeof(in_addr_t)))
+
 int nt_read(char *);
 in_addr_t nt_lookup(in_addr_t);
 
@@ -18,6 +18,7 @@
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
 #include "conntrack.h"
+#include "metrics.h"
 
 static struct mnl_socket *nl;
 
@@ -33,6 +34,7 @@ static void nfq_send_verdict(int queue_num, uint32_t id)
         perror("nfq_send_verdict: mnl_socket_sendto");
         exit(EXIT_FAILURE);
     }
+    metrics_inc(M_PACKETS_VERDICTED);
 }
 
 static int queue_cb(const struct nlmsghdr *nlh, void *data)
@@ -55,6 +57,8 @@ static int queue_cb(const struct nlmsghdr *nlh, void *data)
         return MNL_CB_ERROR;
     }
 
+    metrics_inc(M_PACKETS_QUEUED);
+
     payload = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
     nfct_add(payload);
 
@@ -129,6 +133,8 @@ int nfq_loop(unsigned int queue_num)
         exit(EXIT_FAILURE);
     }
 
+    metrics_queue(queue_num);
+
     for (;;) {
         ret = mnl_socket_recvfrom(nl, buf, sizeof_buf);
         if (ret == -1) {
@@ -1,70 +1,266 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 #include <pthread.h>
 
+#include <poll.h>
+#include <sys/eventfd.h>
+
 #include <systemd/sd-bus.h>
 
-static char *unit_name = NULL;
+#include "dbus.h"
+#include "warm.h"
+
+/*
+ * Everything on the bus happens on the bus thread, over the one connection
+ * opened in dbus_init(), with a PropertiesChanged match per unit.  The
+ * packet thread only reads each unit's `active' flag, and asks for units
+ * to be started by setting their bits in `start_mask' and poking an
+ * eventfd.  StartUnit is called asynchronously, so any number of units
+ * start in parallel, and the JobRemoved signal for the job it returns
+ * tells us right away whether the start worked.  A failed start, or an
+ * error reply to StartUnit (such as its timing out while systemd is busy),
+ * is retried after START_RETRY seconds, doubling up to START_RETRY_MAX, so
+ * that a unit that asks for 2FA doesn't prompt every few seconds.  From
+ * START_GIVE_UP failures in a row on, each failure drops the packets held
+ * for the unit, which is then only started again for new packets, once the
+ * backoff has run out.
+ */
+
+#define START_RETRY 5
+#define START_RETRY_MAX 300
+#define START_GIVE_UP 3
+/* how often units are checked for being worth keeping warm */
+#define WARM_CHECK 60
+
+struct unit {
+    char *name;
+    char *path;
+    /* written on the bus thread, read without a lock on the packet path */
+    atomic_bool active;
+    char last_state[16];
+    /* the job of a StartUnit in flight; "" while waiting for the reply */
+    char *job;
+    /* CLOCK_MONOTONIC microseconds, or 0; no start before then */
+    uint64_t retry_at;
+    /* failed starts since the unit was last active */
+    int failures;
+    /* whether to start it once retry_at comes */
+    bool wanted;
+};
+
+static struct unit units[DBUS_MAX_UNITS];
+static int nunits = 0;
+static sd_bus *bus;
+
+/* becomes readable when a unit turns active */
+static int event_fd = -1;
+/* poked by the packet thread to have the units in start_mask started */
+static int start_fd = -1;
+static atomic_uint_least32_t start_mask = 0;
+/* units whose held packets the packet thread should drop */
+static atomic_uint_least32_t give_up_mask = 0;
+
+int dbus_unit(char *name) {
+    for (int i = 0; i < nunits; ++i) {
+        if (strcmp(units[i].name, name) == 0) {
+            return i;
+        }
+    }
+    if (nunits == DBUS_MAX_UNITS) {
+        fprintf(stderr, "at most %d units are supported\n", DBUS_MAX_UNITS);
+        exit(EXIT_FAILURE);
+    }
+    units[nunits].name = name;
+    return nunits++;
+}
+
+int dbus_units(void) {
+    return nunits;
+}
 
-static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t activated = PTHREAD_COND_INITIALIZER;
-static bool active = false;
-static char last_state[16] = {0};
+const char *dbus_unit_name(int u) {
+    return units[u].name;
+}
 
-void dbus_await(void) {
+bool dbus_active(int u) {
+    return atomic_load_explicit(&units[u].active, memory_order_acquire);
+}
+
+int dbus_event_fd(void) {
+    return event_fd;
+}
+
+bool dbus_gave_up(int u) {
+    return atomic_fetch_and(&give_up_mask, ~(1U << u)) & (1U << u);
+}
+
+void dbus_start(int u) {
+    uint64_t one = 1;
+
+    atomic_fetch_or(&start_mask, 1U << u);
+    if (write(start_fd, &one, sizeof(one)) < 0) {
+        perror("dbus_start: write");
+    }
+}
+
+static uint64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool dbus_all_active(void) {
+    for (int i = 0; i < nunits; ++i) {
+        if (!dbus_active(i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void set_active(struct unit *unit, bool b_state) {
+    uint64_t one = 1;
+
+    atomic_store_explicit(&unit->active, b_state, memory_order_release);
+    if (b_state) {
+        /* whatever job was in flight is moot now */
+        free(unit->job);
+        unit->job = NULL;
+        unit->retry_at = 0;
+        unit->failures = 0;
+        unit->wanted = false;
+    }
+
+    /* the packet thread releases what it holds and then decides whether
+     * the queue can be bypassed, so new packets never skip past held ones */
+    if (write(event_fd, &one, sizeof(one)) < 0) {
+        perror("set_active: write");
+    }
+}
+
+static void start_failed(struct unit *unit) {
+    uint64_t one = 1;
+    int shift = unit->failures < 6 ? unit->failures : 6;
+    uint64_t delay = (uint64_t) START_RETRY << shift;
+
+    free(unit->job);
+    unit->job = NULL;
+    unit->retry_at = now_usec() + (delay < START_RETRY_MAX ? delay : START_RETRY_MAX) * 1000000ULL;
+
+    if (++unit->failures >= START_GIVE_UP) {
+        fprintf(stderr, "giving up on %s after %d failed starts\n", unit->name, unit->failures);
+        unit->wanted = false;
+        atomic_fetch_or(&give_up_mask, 1U << (unit - units));
+        if (write(event_fd, &one, sizeof(one)) < 0) {
+            perror("start_failed: write");
+        }
+    }
+}
+
+static int start_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    (void) ret_error;
+    struct unit *unit = data;
+    const sd_bus_error *err = sd_bus_message_get_error(msg);
+    char *path;
     int ret;
-    sd_bus *bus;
-    sd_bus_error err = SD_BUS_ERROR_NULL;
-    sd_bus_message *msg;
-    struct timespec timeout;
 
-    if (!unit_name) {
-        fprintf(stderr, "error: dbus_await called before dbus_init");
+    if (err) {
+        fprintf(stderr, "org.freedesktop.systemd1.Manager.StartUnit %s: %s\n", unit->name, err->message);
+        start_failed(unit);
+        return 0;
+    }
+
+    free(unit->job);
+    unit->job = NULL;
+
+    ret = sd_bus_message_read(msg, "o", &path);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_message_read: %s\n", strerror(-ret));
+        return -1;
+    }
+    if (!atomic_load(&unit->active)) {
+        unit->job = strdup(path);
+    }
+
+    return 0;
+}
+
+static void start_unit(struct unit *unit) {
+    int ret;
+
+    if (atomic_load(&unit->active) || unit->job) {
+        return;
+    }
+    unit->wanted = true;
+    if (unit->retry_at) {
+        return;
+    }
+
+    fprintf(stderr, "starting %s...\n", unit->name);
+
+    ret = sd_bus_call_method_async(bus, NULL, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", \
+        "org.freedesktop.systemd1.Manager", "StartUnit", start_cb, unit, "ss", unit->name, "replace");
+    if (ret < 0) {
+        fprintf(stderr, "org.freedesktop.systemd1.Manager.StartUnit %s: %s\n", unit->name, strerror(-ret));
         exit(EXIT_FAILURE);
     }
+    unit->job = strdup("");
+}
 
-    pthread_mutex_lock(&mutex);
-    while (!active) {
-        pthread_mutex_unlock(&mutex);
+static int job_removed_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
+    (void) data, (void) ret_error;
+    uint32_t id;
+    char *path, *name, *result;
+    struct unit *unit = NULL;
+    int ret;
 
-        fprintf(stderr, "starting %s...\n", unit_name);
+    ret = sd_bus_message_read(msg, "uoss", &id, &path, &name, &result);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_message_read: %s\n", strerror(-ret));
+        return -1;
+    }
 
-        sd_bus_default_system(&bus);
-        ret = sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", \
-            "org.freedesktop.systemd1.Manager", "StartUnit", &err, &msg, "ss", unit_name, "replace");
-        if (ret < 0) {
-            fprintf(stderr, "org.freedesktop.systemd1.Manager.StartUnit: %s\n", err.message);
-            exit(EXIT_FAILURE);
+    for (int i = 0; i < nunits; ++i) {
+        if (units[i].job && strcmp(path, units[i].job) == 0) {
+            unit = &units[i];
+            break;
         }
-        sd_bus_message_unref(msg);
-        sd_bus_unref(bus);
+    }
+    if (!unit) {
+        return 0;
+    }
+    free(unit->job);
+    unit->job = NULL;
 
-        pthread_mutex_lock(&mutex);
-        clock_gettime(CLOCK_REALTIME, &timeout);
-        timeout.tv_sec += 30;
-        pthread_cond_timedwait(&activated, &mutex, &timeout);
-        if (!active) {
-            fprintf(stderr, "timed out\n");
-        }
+    if (strcmp(result, "done") == 0) {
+        /* don't wait for ActiveState to catch up */
+        set_active(unit, true);
+    } else {
+        fprintf(stderr, "starting %s: %s\n", unit->name, result);
+        start_failed(unit);
     }
-    pthread_mutex_unlock(&mutex);
+
+    return 0;
 }
 
-static void dbus_update_state(char *state) {
+static void dbus_update_state(struct unit *unit, char *state) {
     bool b_state;
 
-    if (strncmp(state, last_state, sizeof(last_state)) == 0) {
+    if (strncmp(state, unit->last_state, sizeof(unit->last_state)) == 0) {
         return;
     }
 
-    fprintf(stderr, "%s %s\n", unit_name, state);
+    fprintf(stderr, "%s %s\n", unit->name, state);
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wstringop-truncation"
-    strncpy(last_state, state, sizeof(last_state));
+    strncpy(unit->last_state, state, sizeof(unit->last_state));
 #pragma GCC diagnostic pop
 
     if (strcmp(state, "active") == 0) {
@@ -75,19 +271,16 @@ static void dbus_update_state(char *state) {
         return;
     }
 
-    pthread_mutex_lock(&mutex);
+    set_active(unit, b_state);
 
-    active = b_state;
-
-    if (active) {
-        pthread_cond_broadcast(&activated);
+    /* a failed unit isn't going to do any better for being started again */
+    if (strcmp(state, "inactive") == 0 && warm_expired(unit - units)) {
+        start_unit(unit);
     }
-
-    pthread_mutex_unlock(&mutex);
 }
 
 static int dbus_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
-    (void) data, (void) ret_error;
+    (void) ret_error;
     int ret;
     char *state;
 
@@ -155,21 +348,22 @@ static int dbus_cb(sd_bus_message *msg, void *data, sd_bus_error *ret_error) {
         return -1;
     }
 
-    dbus_update_state(state);
+    dbus_update_state(data, state);
 
     return 0;
 }
 
 static void *dbus_loop(void *data) {
-    sd_bus *bus = (sd_bus *) data;
+    struct pollfd fds[2];
+    uint64_t timeout, now, n;
+    uint64_t warm_check_at = warm_enabled() ? now_usec() + WARM_CHECK * 1000000ULL : 0;
     int ret;
+    (void) data;
 
-    while (true) {
-        ret = sd_bus_wait(bus, UINT64_MAX);
-        if (ret < 0) {
-            fprintf(stderr, "sd_bus_wait: %s\n", strerror(-ret));
-        }
+    fds[1].fd = start_fd;
+    fds[1].events = POLLIN;
 
+    while (true) {
         ret = 1;
         while(ret > 0) {
             ret = sd_bus_process(bus, NULL);
@@ -177,31 +371,79 @@ static void *dbus_loop(void *data) {
                 fprintf(stderr, "sd_bus_process: %s\n", strerror(-ret));
             }
         }
+
+        fds[0].fd = sd_bus_get_fd(bus);
+        fds[0].events = sd_bus_get_events(bus);
+
+        ret = sd_bus_get_timeout(bus, &timeout);
+        if (ret < 0) {
+            timeout = UINT64_MAX;
+        }
+        for (int i = 0; i < nunits; ++i) {
+            if (units[i].retry_at && units[i].retry_at < timeout) {
+                timeout = units[i].retry_at;
+            }
+        }
+        if (warm_check_at && warm_check_at < timeout) {
+            timeout = warm_check_at;
+        }
+        now = now_usec();
+
+        ret = poll(fds, 2, timeout == UINT64_MAX ? -1 : timeout <= now ? 0 : (int) ((timeout - now + 999) / 1000));
+        if (ret < 0 && errno != EINTR) {
+            fprintf(stderr, "poll: %s\n", strerror(errno));
+        }
+
+        if (ret > 0 && (fds[1].revents & POLLIN)) {
+            uint32_t mask;
+
+            if (read(start_fd, &n, sizeof(n)) < 0 && errno != EAGAIN) {
+                perror("dbus_loop: read");
+            }
+            mask = atomic_exchange(&start_mask, 0);
+            for (int i = 0; i < nunits; ++i) {
+                if (mask & (1U << i)) {
+                    start_unit(&units[i]);
+                }
+            }
+        }
+
+        now = now_usec();
+        for (int i = 0; i < nunits; ++i) {
+            if (units[i].retry_at && now >= units[i].retry_at) {
+                units[i].retry_at = 0;
+                if (units[i].wanted) {
+                    start_unit(&units[i]);
+                }
+            }
+        }
+
+        if (warm_check_at && now >= warm_check_at) {
+            warm_check_at = now + WARM_CHECK * 1000000ULL;
+            for (int i = 0; i < nunits; ++i) {
+                if (!atomic_load(&units[i].active) && !units[i].job && strcmp(units[i].last_state, "inactive") == 0
+                        && warm_due(i)) {
+                    start_unit(&units[i]);
+                }
+            }
+        }
     }
 
     sd_bus_unref(bus);
     return NULL;
 }
 
-void dbus_init(char *name, pthread_t *forked_thread) {
+/* loads the unit and starts following its state */
+static void watch_unit(struct unit *unit) {
     int ret;
-    sd_bus *bus;
     sd_bus_error err = SD_BUS_ERROR_NULL;
     sd_bus_message *msg;
     char *unit_path, *state;
 
-    unit_name = strdup(name);
-
-    ret = sd_bus_open_system(&bus);
-    if (ret < 0) {
-        fprintf(stderr, "sd_bus_open_system: %s\n", strerror(-ret));
-        exit(EXIT_FAILURE);
-    }
-
     ret = sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", \
-        "org.freedesktop.systemd1.Manager", "LoadUnit", &err, &msg, "s", unit_name);
+        "org.freedesktop.systemd1.Manager", "LoadUnit", &err, &msg, "s", unit->name);
     if (ret < 0) {
-        fprintf(stderr, "org.freedesktop.systemd1.Manager.LoadUnit: %s\n", err.message);
+        fprintf(stderr, "org.freedesktop.systemd1.Manager.LoadUnit %s: %s\n", unit->name, err.message);
         exit(EXIT_FAILURE);
     }
 
@@ -210,30 +452,69 @@ void dbus_init(char *name, pthread_t *forked_thread) {
         fprintf(stderr, "sd_bus_message_read: %s\n", strerror(-ret));
         exit(EXIT_FAILURE);
     }
+    unit->path = strdup(unit_path);
+    sd_bus_message_unref(msg);
 
     char *rule_fmt = "sender=org.freedesktop.systemd1,path=%s,interface=org.freedesktop.DBus.Properties,member=PropertiesChanged,type=signal,arg0=org.freedesktop.systemd1.Unit";
-    char *rule = malloc(strlen(rule_fmt) + strlen(unit_path) - 1);
+    char *rule = malloc(strlen(rule_fmt) + strlen(unit->path) - 1);
     if (!rule) {
-        perror("dbus_init: malloc");
+        perror("watch_unit: malloc");
         exit(EXIT_FAILURE);
     }
-    sprintf(rule, rule_fmt, unit_path);
-    ret = sd_bus_add_match(bus, NULL, rule, dbus_cb, NULL);
+    sprintf(rule, rule_fmt, unit->path);
+    ret = sd_bus_add_match(bus, NULL, rule, dbus_cb, unit);
     if (ret < 0) {
         fprintf(stderr, "sd_bus_add_match: %s\n", strerror(-ret));
         exit(EXIT_FAILURE);
     }
     free(rule);
 
-    ret = sd_bus_get_property_string(bus, "org.freedesktop.systemd1", unit_path, "org.freedesktop.systemd1.Unit", "ActiveState", &err, &state);
+    ret = sd_bus_get_property_string(bus, "org.freedesktop.systemd1", unit->path, "org.freedesktop.systemd1.Unit", "ActiveState", &err, &state);
     if (ret < 0) {
         fprintf(stderr, "sd_bus_get_property_string org.freedesktop.systemd1.Unit.ActiveState: %s\n", err.message);
         exit(EXIT_FAILURE);
     }
-    dbus_update_state(state);
+    dbus_update_state(unit, state);
     free(state);
+}
+
+void dbus_init(pthread_t *forked_thread) {
+    int ret;
+    sd_bus_error err = SD_BUS_ERROR_NULL;
+
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    start_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (event_fd < 0 || start_fd < 0) {
+        perror("dbus_init: eventfd");
+        exit(EXIT_FAILURE);
+    }
+
+    ret = sd_bus_open_system(&bus);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_open_system: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    ret = sd_bus_match_signal(bus, NULL, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", \
+        "org.freedesktop.systemd1.Manager", "JobRemoved", job_removed_cb, NULL);
+    if (ret < 0) {
+        fprintf(stderr, "sd_bus_match_signal: %s\n", strerror(-ret));
+        exit(EXIT_FAILURE);
+    }
+
+    /* systemd only sends job signals to subscribed clients */
+    ret = sd_bus_call_method(bus, "org.freedesktop.systemd1", "/org/freedesktop/systemd1", \
+        "org.freedesktop.systemd1.Manager", "Subscribe", &err, NULL, "");
+    if (ret < 0) {
+        fprintf(stderr, "org.freedesktop.systemd1.Manager.Subscribe: %s\n", err.message);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < nunits; ++i) {
+        watch_unit(&units[i]);
+    }
 
-    ret = pthread_create(forked_thread, NULL, dbus_loop, bus);
+    ret = pthread_create(forked_thread, NULL, dbus_loop, NULL);
     if (ret != 0) {
         fprintf(stderr, "pthread_create: %s\n", strerror(ret));
         exit(EXIT_FAILURE);
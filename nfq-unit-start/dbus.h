@@ -1,9 +1,20 @@
 #ifndef __DBUS_H__
 #define __DBUS_H__
 
+#include <stdbool.h>
 #include <pthread.h>
 
-void dbus_init(char *, pthread_t *);
-void dbus_await(void);
+/* bits in the start request mask */
+#define DBUS_MAX_UNITS 32
+
+int dbus_unit(char *);
+int dbus_units(void);
+const char *dbus_unit_name(int);
+void dbus_init(pthread_t *);
+bool dbus_active(int);
+bool dbus_all_active(void);
+void dbus_start(int);
+int dbus_event_fd(void);
+bool dbus_gave_up(int);
 
 #endif
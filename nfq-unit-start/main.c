@@ -1,29 +1,61 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <pthread.h>
 
 #include "dbus.h"
+#include "metrics.h"
 #include "nfqueue.h"
+#include "nft.h"
+#include "stats.h"
+#include "warm.h"
 
 int main(int argc, char *argv[]) {
     unsigned int queue_num;
     pthread_t dbus_thread;
+    char **args;
+    int opt;
 
-    if (argc != 3) {
+    while ((opt = getopt(argc, argv, "b:km:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                nft_init(optarg);
+                break;
+            case 'k':
+                warm_init();
+                break;
+            case 'm':
+                metrics_init(optarg);
+                break;
+            case 's':
+                stats_init(optarg);
+                break;
+            default:
+                goto usage;
+        }
+    }
+
+    if (argc - optind < 2) {
         goto usage;
     }
+    args = argv + optind;
 
     char *endptr = NULL;
-    queue_num = (unsigned int) strtoul(argv[1], &endptr, 10);
-    if (argv[1][0] == '\0' || *endptr != '\0') {
+    queue_num = (unsigned int) strtoul(args[0], &endptr, 10);
+    if (args[0][0] == '\0' || *endptr != '\0') {
         goto usage;
     }
 
-    dbus_init(argv[2], &dbus_thread);
+    for (int i = 1; i < argc - optind; ++i) {
+        nfq_add_rule(args[i]);
+    }
+
+    dbus_init(&dbus_thread);
 
     return nfq_loop(queue_num);
 
 usage:
-    fprintf(stderr, "usage: %s <queue number> <systemd unit name>\n", argv[0]);
+    fprintf(stderr, "usage: %s [-b nft_family:nft_table:nft_set] [-k] [-m metrics.sock] [-s stats_socket] <queue number> <rule>...\n", argv[0]);
+    fprintf(stderr, "rules, matched in order: <unit> | mark:<mark>[/<mask>]=<unit> | <destination cidr>=<unit>\n");
     exit(EXIT_FAILURE);
 }
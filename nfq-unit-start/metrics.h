@@ -0,0 +1,39 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+
+#define METRICS_PREFIX "nfq_unit_start_"
+
+/* X(id, name, labels, help), entries of the same name kept together */
+#define METRICS_COUNTERS(X) \
+    X(PACKETS_QUEUED, "packets_queued_total", "", "Packets read from the queue") \
+    X(PACKETS_ACCEPTED, "packets_verdicted_total", "verdict=\"accept\"", "Verdicts sent back to the kernel") \
+    X(PACKETS_DROPPED, "packets_verdicted_total", "verdict=\"drop\"", "Verdicts sent back to the kernel") \
+    X(PACKETS_HELD, "packets_held_total", "", "Packets held until their unit was active") \
+    X(ACTIVATIONS, "activations_total", "", "Units that released held packets on becoming active")
+
+#define METRICS_GAUGES(X) \
+    X(PACKETS_WAITING, "packets_waiting", "", "Packets held right now")
+
+/* X(id, name, help) */
+#define METRICS_HISTOGRAMS(X) \
+    X(HOLD, "packet_hold_seconds", "Time packets were held for their unit") \
+    X(ACTIVATION, "activation_seconds", "Time from the first held packet to its unit being active")
+
+#define METRICS_ENUM(id, ...) M_##id,
+enum metrics_counter {METRICS_COUNTERS(METRICS_ENUM) M_COUNTERS};
+enum metrics_gauge {METRICS_GAUGES(METRICS_ENUM) M_GAUGES};
+enum metrics_histogram {METRICS_HISTOGRAMS(METRICS_ENUM) M_HISTOGRAMS};
+#undef METRICS_ENUM
+
+void metrics_init(char *);
+void metrics_queue(unsigned int);
+void metrics_inc(enum metrics_counter);
+void metrics_add(enum metrics_counter, uint64_t);
+void metrics_set(enum metrics_gauge, int64_t);
+void metrics_omit(enum metrics_gauge);
+void metrics_observe(enum metrics_histogram, uint64_t);
+uint64_t metrics_now(void);
+
+#endif
@@ -3,9 +3,12 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
 #include <time.h>
+#include <poll.h>
 #include <arpa/inet.h>
 
 #include <libmnl/libmnl.h>
@@ -18,16 +21,192 @@
 #include <libnetfilter_queue/libnetfilter_queue.h>
 
 #include "dbus.h"
+#include "metrics.h"
+#include "nft.h"
+#include "stats.h"
+#include "warm.h"
+
+/*
+ * Each packet is matched against the rules in the order given to find the
+ * unit it waits for: by its mark, by its destination prefix, or
+ * unconditionally.  Packets matching no rule go through.  While its unit
+ * isn't active a packet is held in the kernel queue without a verdict, and
+ * we keep reading so that the queue doesn't back up behind it; packets for
+ * units that are already up are accepted meanwhile.  When a unit comes up,
+ * its packets are accepted together: with a single batch verdict on the
+ * newest ID if nothing else is being held, since packet IDs only go up,
+ * and with one verdict per packet sent in one go otherwise.
+ */
+
+/* beyond this many held packets per unit, new ones are dropped */
+#define NFQ_HOLD_MAX 4096
+/* held packets stay in the kernel queue, so it has to fit every unit's,
+ * plus room for the packets not read yet; otherwise the kernel would drop
+ * packets at its default of 1024 without us knowing */
+#define NFQ_QUEUE_MAXLEN (NFQ_HOLD_MAX * DBUS_MAX_UNITS + 1024)
+#define NFQ_MAX_RULES 64
+
+enum rule_kind {
+    RULE_ANY,
+    RULE_MARK,
+    RULE_PREFIX,
+};
+
+struct rule {
+    enum rule_kind kind;
+    uint32_t mark, mask;
+    /* IP version for RULE_PREFIX */
+    int version;
+    uint8_t addr[16];
+    int plen;
+    int unit;
+};
+
+struct held {
+    uint32_t count;
+    uint32_t ids[NFQ_HOLD_MAX];
+    /* CLOCK_MONOTONIC microseconds when each packet came in */
+    uint64_t since[NFQ_HOLD_MAX];
+};
 
 static struct mnl_socket *nl;
 
-static void nfq_send_verdict(int queue_num, uint32_t id)
+static struct rule rules[NFQ_MAX_RULES];
+static int nrules = 0;
+
+static struct held held[DBUS_MAX_UNITS];
+static uint32_t nheld = 0;
+static uint16_t held_queue_num;
+
+void nfq_add_rule(char *spec)
+{
+    struct rule *rule = &rules[nrules];
+    char *sep = strchr(spec, '=');
+
+    if (nrules == NFQ_MAX_RULES) {
+        fprintf(stderr, "at most %d rules are supported\n", NFQ_MAX_RULES);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!sep) {
+        rule->kind = RULE_ANY;
+        rule->unit = dbus_unit(spec);
+        ++nrules;
+        return;
+    }
+    *sep = '\0';
+    if (sep[1] == '\0') {
+        goto invalid;
+    }
+    rule->unit = dbus_unit(sep + 1);
+
+    if (strncmp(spec, "mark:", 5) == 0) {
+        char *endptr = NULL, *mark = spec + 5;
+
+        rule->kind = RULE_MARK;
+        rule->mark = (uint32_t) strtoul(mark, &endptr, 0);
+        rule->mask = UINT32_MAX;
+        if (endptr != mark && *endptr == '/') {
+            mark = endptr + 1;
+            rule->mask = (uint32_t) strtoul(mark, &endptr, 0);
+        }
+        if (mark[0] == '\0' || *endptr != '\0') {
+            goto invalid;
+        }
+        rule->mark &= rule->mask;
+    } else {
+        char *slash = strchr(spec, '/'), *endptr = NULL;
+
+        rule->kind = RULE_PREFIX;
+        if (slash) {
+            *slash = '\0';
+        }
+        if (inet_pton(AF_INET, spec, rule->addr) == 1) {
+            rule->version = 4;
+            rule->plen = 32;
+        } else if (inet_pton(AF_INET6, spec, rule->addr) == 1) {
+            rule->version = 6;
+            rule->plen = 128;
+        } else {
+            goto invalid;
+        }
+        if (slash) {
+            long plen = strtol(slash + 1, &endptr, 10);
+            if (slash[1] == '\0' || *endptr != '\0' || plen < 0 || plen > rule->plen) {
+                goto invalid;
+            }
+            rule->plen = plen;
+        }
+    }
+
+    ++nrules;
+    return;
+
+invalid:
+    fprintf(stderr, "invalid rule %s, expected unit, mark:MARK[/MASK]=unit or CIDR=unit\n", spec);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool prefix_match(const uint8_t *addr, const uint8_t *prefix, int plen)
+{
+    int bytes = plen / 8, bits = plen % 8;
+
+    if (memcmp(addr, prefix, bytes) != 0) {
+        return false;
+    }
+    return bits == 0 || ((addr[bytes] ^ prefix[bytes]) & (0xff << (8 - bits))) == 0;
+}
+
+/* the unit a packet waits for, or -1 */
+static int nfq_classify(struct nlattr **attr)
+{
+    uint32_t mark = attr[NFQA_MARK] ? ntohl(mnl_attr_get_u32(attr[NFQA_MARK])) : 0;
+    const uint8_t *payload = attr[NFQA_PAYLOAD] ? mnl_attr_get_payload(attr[NFQA_PAYLOAD]) : NULL;
+    uint16_t len = attr[NFQA_PAYLOAD] ? mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]) : 0;
+    int version = len > 0 ? payload[0] >> 4 : 0;
+    const uint8_t *daddr = NULL;
+
+    if (version == 4 && len >= 20) {
+        daddr = payload + 16;
+    } else if (version == 6 && len >= 40) {
+        daddr = payload + 24;
+    }
+
+    for (int i = 0; i < nrules; ++i) {
+        struct rule *rule = &rules[i];
+        switch (rule->kind) {
+            case RULE_ANY:
+                return rule->unit;
+            case RULE_MARK:
+                if ((mark & rule->mask) == rule->mark) {
+                    return rule->unit;
+                }
+                break;
+            case RULE_PREFIX:
+                if (daddr && version == rule->version && prefix_match(daddr, rule->addr, rule->plen)) {
+                    return rule->unit;
+                }
+                break;
+        }
+    }
+
+    return -1;
+}
+
+static void nfq_send_verdict(int queue_num, uint32_t id, int type, int verdict)
 {
     char buf[MNL_SOCKET_BUFFER_SIZE];
     struct nlmsghdr *nlh;
 
-    nlh = nfq_nlmsg_put(buf, NFQNL_MSG_VERDICT, queue_num);
-    nfq_nlmsg_verdict_put(nlh, id, NF_ACCEPT);
+    nlh = nfq_nlmsg_put(buf, type, queue_num);
+    nfq_nlmsg_verdict_put(nlh, id, verdict);
 
     if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
         perror("nfq_send_verdict: mnl_socket_sendto");
@@ -35,6 +214,34 @@ static void nfq_send_verdict(int queue_num, uint32_t id)
     }
 }
 
+/* gives the given packets a verdict with as few sendto() calls as will fit */
+static void nfq_send_verdicts(int queue_num, const uint32_t *ids, uint32_t n, int verdict)
+{
+    /* room for the message that overflows the limit */
+    char buf[MNL_SOCKET_BUFFER_SIZE * 2];
+    struct mnl_nlmsg_batch *batch = mnl_nlmsg_batch_start(buf, MNL_SOCKET_BUFFER_SIZE);
+
+    for (uint32_t i = 0; i < n; ++i) {
+        struct nlmsghdr *nlh = nfq_nlmsg_put(mnl_nlmsg_batch_current(batch), NFQNL_MSG_VERDICT, queue_num);
+        nfq_nlmsg_verdict_put(nlh, ids[i], verdict);
+
+        if (!mnl_nlmsg_batch_next(batch)) {
+            if (mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
+                perror("nfq_send_verdicts: mnl_socket_sendto");
+                exit(EXIT_FAILURE);
+            }
+            mnl_nlmsg_batch_reset(batch);
+        }
+    }
+
+    if (!mnl_nlmsg_batch_is_empty(batch)
+            && mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
+        perror("nfq_send_verdicts: mnl_socket_sendto");
+        exit(EXIT_FAILURE);
+    }
+    mnl_nlmsg_batch_stop(batch);
+}
+
 static int queue_cb(const struct nlmsghdr *nlh, void *data)
 {
     (void) data;
@@ -42,6 +249,8 @@ static int queue_cb(const struct nlmsghdr *nlh, void *data)
     struct nlattr *attr[NFQA_MAX+1] = {};
     uint32_t id = 0;
     struct nfgenmsg *nfg;
+    struct held *h;
+    int unit;
 
     if (nfq_nlmsg_parse(nlh, attr) < 0) {
         perror("nfq_nlmsg_parse");
@@ -58,13 +267,100 @@ static int queue_cb(const struct nlmsghdr *nlh, void *data)
     ph = mnl_attr_get_payload(attr[NFQA_PACKET_HDR]);
     id = ntohl(ph->packet_id);
 
-    dbus_await();
+    metrics_inc(M_PACKETS_QUEUED);
+
+    unit = nfq_classify(attr);
+    if (unit >= 0 && warm_enabled()) {
+        warm_packet(unit);
+    }
+    if (unit < 0 || dbus_active(unit)) {
+        nfq_send_verdict(ntohs(nfg->res_id), id, NFQNL_MSG_VERDICT, NF_ACCEPT);
+        metrics_inc(M_PACKETS_ACCEPTED);
+        return MNL_CB_OK;
+    }
+
+    h = &held[unit];
+    if (h->count == NFQ_HOLD_MAX) {
+        fprintf(stderr, "dropping packet, %u already waiting for %s\n", h->count, dbus_unit_name(unit));
+        stats_dropped(unit);
+        nfq_send_verdict(ntohs(nfg->res_id), id, NFQNL_MSG_VERDICT, NF_DROP);
+        metrics_inc(M_PACKETS_DROPPED);
+        return MNL_CB_OK;
+    }
 
-    nfq_send_verdict(ntohs(nfg->res_id), id);
+    if (h->count == 0) {
+        dbus_start(unit);
+    }
+    h->ids[h->count] = id;
+    h->since[h->count++] = now_usec();
+    ++nheld;
+    stats_held(unit);
+    metrics_inc(M_PACKETS_HELD);
+    metrics_set(M_PACKETS_WAITING, nheld);
+    held_queue_num = ntohs(nfg->res_id);
 
     return MNL_CB_OK;
 }
 
+static void nfq_release(void)
+{
+    uint64_t n;
+
+    /* just clears the eventfd */
+    if (read(dbus_event_fd(), &n, sizeof(n)) < 0 && errno != EAGAIN) {
+        perror("nfq_release: read");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int u = 0; u < dbus_units(); ++u) {
+        struct held *h = &held[u];
+        uint64_t now;
+
+        /* cleared either way, so it can't catch packets held later */
+        if (dbus_gave_up(u) && h->count > 0) {
+            fprintf(stderr, "dropping %u packets held for %s\n", h->count, dbus_unit_name(u));
+            if (h->count == nheld) {
+                nfq_send_verdict(held_queue_num, h->ids[h->count - 1], NFQNL_MSG_VERDICT_BATCH, NF_DROP);
+            } else {
+                nfq_send_verdicts(held_queue_num, h->ids, h->count, NF_DROP);
+            }
+            for (uint32_t i = 0; i < h->count; ++i) {
+                stats_dropped(u);
+            }
+            metrics_add(M_PACKETS_DROPPED, h->count);
+            nheld -= h->count;
+            metrics_set(M_PACKETS_WAITING, nheld);
+            h->count = 0;
+            continue;
+        }
+
+        if (h->count == 0 || !dbus_active(u)) {
+            continue;
+        }
+
+        if (h->count == nheld) {
+            nfq_send_verdict(held_queue_num, h->ids[h->count - 1], NFQNL_MSG_VERDICT_BATCH, NF_ACCEPT);
+        } else {
+            nfq_send_verdicts(held_queue_num, h->ids, h->count, NF_ACCEPT);
+        }
+        now = now_usec();
+        stats_released(u, h->since, h->count, now);
+        metrics_inc(M_ACTIVATIONS);
+        metrics_add(M_PACKETS_ACCEPTED, h->count);
+        metrics_observe(M_ACTIVATION, (now - h->since[0]) * 1000);
+        for (uint32_t i = 0; i < h->count; ++i) {
+            metrics_observe(M_HOLD, (now - h->since[i]) * 1000);
+        }
+        nheld -= h->count;
+        metrics_set(M_PACKETS_WAITING, nheld);
+        h->count = 0;
+    }
+
+    /* only now that the held packets have their verdicts can new ones skip
+     * the queue without overtaking them */
+    warm_bypass(nft_bypass(dbus_all_active()));
+}
+
 int nfq_loop(unsigned int queue_num)
 {
     char *buf;
@@ -73,6 +369,7 @@ int nfq_loop(unsigned int queue_num)
     struct nlmsghdr *nlh;
     int ret;
     unsigned int portid;
+    struct pollfd fds[3];
 
     nl = mnl_socket_open(NETLINK_NETFILTER);
     if (nl == NULL) {
@@ -105,6 +402,7 @@ int nfq_loop(unsigned int queue_num)
 
     mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_GSO));
     mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_GSO));
+    mnl_attr_put_u32(nlh, NFQA_CFG_QUEUE_MAXLEN, htonl(NFQ_QUEUE_MAXLEN));
 
     if (mnl_socket_sendto(nl, nlh, nlh->nlmsg_len) < 0) {
         perror("mnl_socket_sendto");
@@ -118,7 +416,37 @@ int nfq_loop(unsigned int queue_num)
     ret = 1;
     mnl_socket_setsockopt(nl, NETLINK_NO_ENOBUFS, &ret, sizeof(int));
 
+    metrics_queue(queue_num);
+
+    fds[0].fd = mnl_socket_get_fd(nl);
+    fds[0].events = POLLIN;
+    fds[1].fd = dbus_event_fd();
+    fds[1].events = POLLIN;
+    /* ignored by poll() if there is no stats socket */
+    fds[2].fd = stats_fd();
+    fds[2].events = POLLIN;
+
     for (;;) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            exit(EXIT_FAILURE);
+        }
+
+        if (fds[1].revents & POLLIN) {
+            nfq_release();
+        }
+
+        if (fds[2].revents & POLLIN) {
+            stats_serve();
+        }
+
+        if (!(fds[0].revents & POLLIN)) {
+            continue;
+        }
+
         ret = mnl_socket_recvfrom(nl, buf, sizeof_buf);
         if (ret == -1) {
             perror("mnl_socket_recvfrom");
@@ -1,6 +1,7 @@
 #ifndef __NFQUEUE_H__
 #define __NFQUEUE_H__
 
+void nfq_add_rule(char *);
 int nfq_loop(unsigned int);
 
 #endif
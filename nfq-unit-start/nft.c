@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <libmnl/libmnl.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+
+#include "nft.h"
+
+/*
+ * Once the unit is active there is nothing left to gate, so instead of
+ * having every packet copied to us just to be accepted, we put the IPv4
+ * and IPv6 protocol values into an nftables set of type nf_proto that the
+ * queue rule excludes, e.g.
+ *
+ *     meta nfproto != @bypass queue num 0
+ *
+ * and empty the set again when the unit goes down.  Each change is a
+ * single netlink batch, which the kernel applies before sendto() returns.
+ */
+
+static struct mnl_socket *nl = NULL;
+static char *table, *set;
+static uint8_t family;
+static uint32_t seq;
+static int bypassing = -1;
+
+static void nft_put_batch_marker(struct mnl_nlmsg_batch *batch, uint16_t type) {
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+    struct nfgenmsg *nfg;
+
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST;
+    nlh->nlmsg_seq = seq++;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(NFNL_SUBSYS_NFTABLES);
+
+    mnl_nlmsg_batch_next(batch);
+}
+
+static struct nlmsghdr *nft_put_setelem_header(struct mnl_nlmsg_batch *batch, uint16_t type, uint16_t flags) {
+    struct nlmsghdr *nlh = mnl_nlmsg_put_header(mnl_nlmsg_batch_current(batch));
+    struct nfgenmsg *nfg;
+
+    nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = seq++;
+
+    nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(struct nfgenmsg));
+    nfg->nfgen_family = family;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_TABLE, table);
+    mnl_attr_put_strz(nlh, NFTA_SET_ELEM_LIST_SET, set);
+
+    return nlh;
+}
+
+static int nft_error_cb(const struct nlmsghdr *nlh, void *data) {
+    (void) nlh, (void) data;
+    return MNL_CB_OK;
+}
+
+/* says whether packets might be skipping the queue now */
+bool nft_bypass(bool on) {
+    static const uint8_t protos[] = {NFPROTO_IPV4, NFPROTO_IPV6};
+    char buf[MNL_SOCKET_BUFFER_SIZE], rbuf[MNL_SOCKET_BUFFER_SIZE];
+    struct mnl_nlmsg_batch *batch;
+    struct nlmsghdr *nlh;
+    ssize_t ret;
+
+    if (!nl) {
+        return false;
+    }
+    if (bypassing == on) {
+        return on;
+    }
+
+    batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
+    nft_put_batch_marker(batch, NFNL_MSG_BATCH_BEGIN);
+
+    if (on) {
+        struct nlattr *list, *elem, *key;
+
+        nlh = nft_put_setelem_header(batch, NFT_MSG_NEWSETELEM, NLM_F_CREATE);
+        list = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+        for (size_t i = 0; i < sizeof(protos); ++i) {
+            elem = mnl_attr_nest_start(nlh, NFTA_LIST_ELEM);
+            key = mnl_attr_nest_start(nlh, NFTA_SET_ELEM_KEY);
+            mnl_attr_put(nlh, NFTA_DATA_VALUE, sizeof(protos[i]), &protos[i]);
+            mnl_attr_nest_end(nlh, key);
+            mnl_attr_nest_end(nlh, elem);
+        }
+        mnl_attr_nest_end(nlh, list);
+    } else {
+        /* a DELSETELEM without elements flushes the set */
+        nft_put_setelem_header(batch, NFT_MSG_DELSETELEM, 0);
+    }
+    mnl_nlmsg_batch_next(batch);
+
+    nft_put_batch_marker(batch, NFNL_MSG_BATCH_END);
+
+    if (mnl_socket_sendto(nl, mnl_nlmsg_batch_head(batch), mnl_nlmsg_batch_size(batch)) < 0) {
+        perror("nft_bypass: mnl_socket_sendto");
+        mnl_nlmsg_batch_stop(batch);
+        return bypassing != 0;
+    }
+    mnl_nlmsg_batch_stop(batch);
+
+    /* the ack, or the error, has been queued by the time sendto() returns */
+    bypassing = on;
+    while ((ret = recv(mnl_socket_get_fd(nl), rbuf, sizeof(rbuf), MSG_DONTWAIT)) > 0) {
+        if (mnl_cb_run(rbuf, ret, 0, 0, nft_error_cb, NULL) < 0) {
+            fprintf(stderr, "updating nftables set %s %s: %s\n", table, set, strerror(errno));
+            bypassing = -1;
+        }
+    }
+
+    if (bypassing == on) {
+        fprintf(stderr, on ? "bypassing the queue\n" : "queueing again\n");
+    }
+    /* if the update failed, the set is in an unknown state */
+    return bypassing != 0;
+}
+
+void nft_init(char *spec) {
+    char *sep1 = strchr(spec, ':'), *sep2 = sep1 ? strchr(sep1 + 1, ':') : NULL;
+
+    if (!sep2 || sep1 == spec || sep2 == sep1 + 1 || sep2[1] == '\0') {
+        fprintf(stderr, "nftables set must be given as family:table:set\n");
+        exit(EXIT_FAILURE);
+    }
+    *sep1 = *sep2 = '\0';
+    table = sep1 + 1;
+    set = sep2 + 1;
+
+    if (strcmp(spec, "ip") == 0) {
+        family = NFPROTO_IPV4;
+    } else if (strcmp(spec, "ip6") == 0) {
+        family = NFPROTO_IPV6;
+    } else if (strcmp(spec, "inet") == 0) {
+        family = NFPROTO_INET;
+    } else {
+        fprintf(stderr, "unknown nftables family %s\n", spec);
+        exit(EXIT_FAILURE);
+    }
+
+    nl = mnl_socket_open(NETLINK_NETFILTER);
+    if (!nl) {
+        perror("nft_init: mnl_socket_open");
+        exit(EXIT_FAILURE);
+    }
+    if (mnl_socket_bind(nl, 0, MNL_SOCKET_AUTOPID) < 0) {
+        perror("nft_init: mnl_socket_bind");
+        exit(EXIT_FAILURE);
+    }
+    seq = time(NULL);
+}
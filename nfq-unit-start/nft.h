@@ -0,0 +1,9 @@
+#ifndef __NFT_H__
+#define __NFT_H__
+
+#include <stdbool.h>
+
+void nft_init(char *);
+bool nft_bypass(bool);
+
+#endif
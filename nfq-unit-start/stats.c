@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbus.h"
+#include "stats.h"
+
+/*
+ * How long packets wait for their unit.  Per unit we count activations
+ * (a release of held packets) and the packets held and dropped, and keep
+ * two histograms in microseconds: from the first held packet to the
+ * release, which is what a cold start costs, and the hold time of every
+ * released packet.  The histograms have 8 linear buckets per power of two,
+ * so percentiles are within about 12%.
+ *
+ * Everything is updated and served on the packet thread, so no locking:
+ * connecting to the stats socket gets a text dump and EOF.
+ */
+
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+/* enough for values up to 2^40 us, about 12 days */
+#define BUCKETS ((40 - SUB_BITS + 1) * SUB_BUCKETS)
+
+struct hist {
+    uint64_t count[BUCKETS];
+    uint64_t n;
+    uint64_t max;
+};
+
+struct unit_stats {
+    uint64_t activations, held, dropped;
+    struct hist activation, hold;
+};
+
+static struct unit_stats stats[DBUS_MAX_UNITS];
+static int listen_fd = -1;
+
+static int bucket(uint64_t v) {
+    int e, b;
+
+    if (v < SUB_BUCKETS) {
+        return v;
+    }
+    e = 63 - __builtin_clzll(v);
+    b = ((e - SUB_BITS + 1) << SUB_BITS) + ((v >> (e - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+/* the smallest value that lands in bucket b */
+static uint64_t bucket_low(int b) {
+    int e;
+
+    if (b < SUB_BUCKETS) {
+        return b;
+    }
+    e = (b >> SUB_BITS) + SUB_BITS - 1;
+    return ((uint64_t) SUB_BUCKETS + (b & (SUB_BUCKETS - 1))) << (e - SUB_BITS);
+}
+
+static void hist_add(struct hist *h, uint64_t v) {
+    ++h->count[bucket(v)];
+    ++h->n;
+    if (v > h->max) {
+        h->max = v;
+    }
+}
+
+static uint64_t hist_percentile(const struct hist *h, double p) {
+    uint64_t target = p * h->n, seen = 0;
+
+    for (int b = 0; b < BUCKETS; ++b) {
+        seen += h->count[b];
+        if (seen > target) {
+            /* the middle of the bucket, but never past the largest value */
+            uint64_t mid = (bucket_low(b) + (b + 1 < BUCKETS ? bucket_low(b + 1) : h->max)) / 2;
+            return mid < h->max ? mid : h->max;
+        }
+    }
+    return h->max;
+}
+
+void stats_held(int unit) {
+    ++stats[unit].held;
+}
+
+void stats_dropped(int unit) {
+    ++stats[unit].dropped;
+}
+
+void stats_released(int unit, const uint64_t *since, uint32_t n, uint64_t now) {
+    struct unit_stats *s = &stats[unit];
+
+    ++s->activations;
+    hist_add(&s->activation, now - since[0]);
+    for (uint32_t i = 0; i < n; ++i) {
+        hist_add(&s->hold, now - since[i]);
+    }
+}
+
+static void print_hist(FILE *f, const char *name, const struct hist *h) {
+    fprintf(f, "%s_us count %" PRIu64 " p50 %" PRIu64 " p90 %" PRIu64 " p99 %" PRIu64 " max %" PRIu64 "\n",
+            name, h->n, hist_percentile(h, 0.50), hist_percentile(h, 0.90), hist_percentile(h, 0.99), h->max);
+    for (int b = 0; b < BUCKETS; ++b) {
+        if (h->count[b]) {
+            fprintf(f, "%s_us bucket %" PRIu64 " %" PRIu64 "\n", name, bucket_low(b), h->count[b]);
+        }
+    }
+}
+
+void stats_serve(void) {
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f;
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("stats_serve: accept4");
+        }
+        return;
+    }
+
+    f = open_memstream(&text, &len);
+    if (!f) {
+        perror("stats_serve: open_memstream");
+        close(fd);
+        return;
+    }
+    for (int u = 0; u < dbus_units(); ++u) {
+        struct unit_stats *s = &stats[u];
+
+        fprintf(f, "unit %s\n", dbus_unit_name(u));
+        fprintf(f, "active %d\n", dbus_active(u));
+        fprintf(f, "activations %" PRIu64 "\n", s->activations);
+        fprintf(f, "held %" PRIu64 "\n", s->held);
+        fprintf(f, "dropped %" PRIu64 "\n", s->dropped);
+        print_hist(f, "activation", &s->activation);
+        print_hist(f, "hold", &s->hold);
+    }
+    fclose(f);
+
+    /* it all fits in the socket buffer; a client that can't take it
+     * doesn't get to stall the packet loop */
+    if (write(fd, text, len) < 0) {
+        perror("stats_serve: write");
+    }
+    free(text);
+    close(fd);
+}
+
+int stats_fd(void) {
+    return listen_fd;
+}
+
+void stats_init(char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "stats socket path too long: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror("stats_init: socket");
+        exit(EXIT_FAILURE);
+    }
+    /* left over from a previous run */
+    unlink(path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0) {
+        perror("stats_init: bind");
+        exit(EXIT_FAILURE);
+    }
+}
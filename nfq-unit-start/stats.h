@@ -0,0 +1,13 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+void stats_init(char *);
+int stats_fd(void);
+void stats_serve(void);
+void stats_held(int);
+void stats_dropped(int);
+void stats_released(int, const uint64_t *, uint32_t, uint64_t);
+
+#endif
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "dbus.h"
+#include "warm.h"
+
+/*
+ * Keeps units that time out from inactivity warm while they are likely to
+ * be needed.  For each unit, the packet thread keeps a moving average of
+ * the gaps between packets (at one second resolution) per hour of the day,
+ * and the bus thread learns the inactivity timeout from how long the unit
+ * had been idle whenever it went inactive.  Traffic is likely in an hour
+ * if packets usually come closer together than that timeout, and then a
+ * unit that has gone inactive is started again right away, without
+ * waiting for a packet to pay for the start.
+ *
+ * A unit is only started this way if a packet has been seen for it since
+ * the last time, so an unused unit isn't restarted over and over.
+ *
+ * While the queue is bypassed (see nft.c), no packets are seen at all, so a
+ * gap or an idle time that overlaps a bypass says nothing and isn't learned
+ * from, and a unit that goes inactive after one isn't started again.
+ */
+
+/* idle times shorter than this aren't taken for a timeout */
+#define WARM_MIN_IDLE 30
+/* weight of a new gap in the hourly averages, as a shift */
+#define WARM_GAP_SHIFT 3
+
+struct warm {
+    /* CLOCK_MONOTONIC seconds */
+    _Atomic uint32_t last_packet;
+    /* seconds, 0 if nothing was seen in that hour yet */
+    _Atomic uint32_t gap[24];
+    atomic_bool seen;
+    /* bus thread only */
+    uint32_t timeout;
+};
+
+static bool enabled = false;
+static struct warm warm[DBUS_MAX_UNITS];
+
+static atomic_bool bypassing = false;
+/* CLOCK_MONOTONIC seconds when the queue was last bypassed, 0 if never */
+static _Atomic uint32_t bypassed_at = 0;
+
+bool warm_enabled(void) {
+    return enabled;
+}
+
+void warm_init(void) {
+    enabled = true;
+}
+
+static uint32_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+static int hour_of_day(void) {
+    time_t t = time(NULL);
+    struct tm tm;
+    localtime_r(&t, &tm);
+    return tm.tm_hour;
+}
+
+void warm_bypass(bool on) {
+    if (on) {
+        atomic_store_explicit(&bypassing, true, memory_order_relaxed);
+    } else if (atomic_load_explicit(&bypassing, memory_order_relaxed)) {
+        atomic_store_explicit(&bypassed_at, now_sec(), memory_order_relaxed);
+        atomic_store_explicit(&bypassing, false, memory_order_relaxed);
+    }
+}
+
+/* whether packets might have skipped the queue at some point since `t' */
+static bool bypassed_since(uint32_t t) {
+    return atomic_load_explicit(&bypassing, memory_order_relaxed)
+        || atomic_load_explicit(&bypassed_at, memory_order_relaxed) >= t;
+}
+
+void warm_packet(int unit) {
+    struct warm *w = &warm[unit];
+    uint32_t now = now_sec();
+    uint32_t last = atomic_load_explicit(&w->last_packet, memory_order_relaxed);
+
+    if (now == last) {
+        return;
+    }
+    atomic_store_explicit(&w->last_packet, now, memory_order_relaxed);
+    atomic_store_explicit(&w->seen, true, memory_order_relaxed);
+
+    if (last && !bypassed_since(last)) {
+        int hour = hour_of_day();
+        uint32_t gap = now - last;
+        uint32_t avg = atomic_load_explicit(&w->gap[hour], memory_order_relaxed);
+        avg = avg ? avg + (((int64_t) gap - avg) >> WARM_GAP_SHIFT) : gap;
+        atomic_store_explicit(&w->gap[hour], avg ? avg : 1, memory_order_relaxed);
+    }
+}
+
+static bool likely(struct warm *w) {
+    uint32_t gap = atomic_load_explicit(&w->gap[hour_of_day()], memory_order_relaxed);
+    return w->timeout > 0 && gap > 0 && gap < w->timeout;
+}
+
+bool warm_due(int unit) {
+    struct warm *w = &warm[unit];
+
+    if (!enabled || !likely(w) || !atomic_load_explicit(&w->seen, memory_order_relaxed)) {
+        return false;
+    }
+    atomic_store_explicit(&w->seen, false, memory_order_relaxed);
+    fprintf(stderr, "keeping %s warm\n", dbus_unit_name(unit));
+    return true;
+}
+
+bool warm_expired(int unit) {
+    struct warm *w = &warm[unit];
+    uint32_t last = atomic_load_explicit(&w->last_packet, memory_order_relaxed);
+    uint32_t idle;
+
+    if (!enabled || !last) {
+        return false;
+    }
+
+    /* the packets that would say how long it was idle skipped the queue */
+    if (bypassed_since(last)) {
+        fprintf(stderr, "%s went inactive after bypassing the queue, not learning from it\n", dbus_unit_name(unit));
+        return false;
+    }
+
+    /* anything else was probably stopped on purpose */
+    idle = now_sec() - last;
+    if (idle < WARM_MIN_IDLE) {
+        return false;
+    }
+    w->timeout = w->timeout ? (3 * w->timeout + idle) / 4 : idle;
+    fprintf(stderr, "%s went inactive after %us idle, timeout estimate %us\n", dbus_unit_name(unit), idle, w->timeout);
+
+    return warm_due(unit);
+}
@@ -0,0 +1,13 @@
+#ifndef __WARM_H__
+#define __WARM_H__
+
+#include <stdbool.h>
+
+void warm_init(void);
+bool warm_enabled(void);
+void warm_packet(int);
+bool warm_expired(int);
+bool warm_due(int);
+void warm_bypass(bool);
+
+#endif